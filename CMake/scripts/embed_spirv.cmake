@@ -0,0 +1,45 @@
+# Generates a header with every SPIR-V module in SPIRV_DIR as a constexpr
+# uint32_t array plus a table of them by file name (see embedded_shaders.h).
+#
+#   cmake -DSPIRV_DIR=<dir> -DOUTPUT=<file> -P embed_spirv.cmake
+
+file(GLOB SPIRV_FILES "${SPIRV_DIR}/*.spv")
+list(SORT SPIRV_FILES)
+if (NOT SPIRV_FILES)
+    message(FATAL_ERROR "no SPIR-V modules in ${SPIRV_DIR}")
+endif ()
+
+set(ARRAYS "")
+set(TABLE "")
+foreach (SPIRV ${SPIRV_FILES})
+    get_filename_component(FILE_NAME ${SPIRV} NAME)
+    string(MAKE_C_IDENTIFIER "spirv_${FILE_NAME}" SYMBOL)
+
+    file(READ ${SPIRV} HEX HEX)
+    string(LENGTH "${HEX}" HEX_LENGTH)
+    math(EXPR REMAINDER "${HEX_LENGTH} % 8")
+    if (HEX_LENGTH EQUAL 0 OR NOT REMAINDER EQUAL 0)
+        message(FATAL_ERROR "${SPIRV} is not a whole number of 32-bit words")
+    endif ()
+    # SPIR-V words are little-endian on disk.
+    string(REGEX REPLACE "(..)(..)(..)(..)" "0x\\4\\3\\2\\1u," WORDS "${HEX}")
+    # Eight words per line; CMake regexes have no {n} repetition.
+    set(WORD "0x[0-9a-f]+u,")
+    string(REGEX REPLACE "(${WORD}${WORD}${WORD}${WORD}${WORD}${WORD}${WORD}${WORD})" "\\1\n\t" WORDS "${WORDS}")
+    string(REPLACE "u,0x" "u, 0x" WORDS "${WORDS}")
+    string(STRIP "${WORDS}" WORDS)
+
+    string(APPEND ARRAYS "constexpr uint32_t ${SYMBOL}[] = {\n\t${WORDS}\n};\n\n")
+    string(APPEND TABLE "\t{ \"${FILE_NAME}\", ${SYMBOL}, sizeof(${SYMBOL}) },\n")
+endforeach ()
+
+set(CONTENT "// Generated by CMake/scripts/embed_spirv.cmake; do not edit.\n\n${ARRAYS}")
+string(APPEND CONTENT "constexpr spirv_blob embedded_spirv[] = {\n${TABLE}};\n")
+
+# Rewriting an unchanged file would rebuild everything that includes it.
+if (EXISTS "${OUTPUT}")
+    file(READ "${OUTPUT}" OLD_CONTENT)
+endif ()
+if (NOT "${OLD_CONTENT}" STREQUAL "${CONTENT}")
+    file(WRITE "${OUTPUT}" "${CONTENT}")
+endif ()
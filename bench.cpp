@@ -0,0 +1,538 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+#include "utils.h"
+#include "window.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+std::atomic<uint64_t> heap_allocations{ 0 };
+
+uint64_t
+count_allocations()
+{
+	return heap_allocations.load( std::memory_order_relaxed );
+}
+
+}
+
+// Every heap allocation of the process, on any thread, goes through here
+// and is counted; the renderer reports the count of each frame.
+void *
+operator new( size_t size )
+{
+	heap_allocations.fetch_add( 1, std::memory_order_relaxed );
+	if (auto p = std::malloc( size ? size : 1 )) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void
+operator delete( void *p ) noexcept
+{
+	std::free( p );
+}
+
+void
+operator delete( void *p, size_t ) noexcept
+{
+	std::free( p );
+}
+
+namespace {
+
+struct bench_mode {
+	const char *name;
+	bool headless;
+	vk::PresentModeKHR present_mode;
+};
+
+const bench_mode all_modes[] = {
+	{ "mailbox", false, vk::PresentModeKHR::eMailbox },
+	{ "fifo_relaxed", false, vk::PresentModeKHR::eFifoRelaxed },
+	{ "fifo", false, vk::PresentModeKHR::eFifo },
+	{ "immediate", false, vk::PresentModeKHR::eImmediate },
+	{ "headless", true, vk::PresentModeKHR::eFifo },
+};
+
+struct bench_options {
+	uint64_t frames = 1000;
+	uint64_t warmup = 60;
+	double seconds = 0;
+	uint32_t width = 800;
+	uint32_t height = 600;
+	uint32_t frames_in_flight = 2;
+	uint32_t threads = 0;
+	uint32_t draws = 1;
+	uint32_t instances = 1;
+	bool cull = false;
+	uint32_t variants = 1;
+	bool skip_pending = false;
+	uint32_t layers = 1;
+	// Each mode is run once per entry, with and without draw sorting.
+	std::vector<bool> sort_draws = { true };
+	// Likewise with and without low-latency pacing.
+	std::vector<bool> low_latency = { false };
+	uint32_t max_queued = 1;
+	bool latency_sleep = false;
+	// Fail if any frame after the warmup allocated from the heap.
+	bool check_allocations = false;
+	std::vector<std::string> texture_paths;
+	uint64_t texture_budget_mib = 256;
+	std::string mesh_path;
+	vertex_layout_kind vertex_layout = vertex_layout_kind::interleaved;
+	bool depth_prepass = false;
+	std::string shader_dir;
+	// Files whose cold and warm load times are measured.
+	std::vector<std::string> load_paths = { "shaders/shader.vert.spv", "shaders/shader.frag.spv",
+	                                        "shaders/cull.comp.spv" };
+	uint32_t load_repeats = 5;
+	std::vector<bench_mode> modes;
+	std::string out_path = "bench.json";
+};
+
+// Nearest-rank percentile of an already sorted sample.
+double
+percentile( const std::vector<double> &sorted, double p )
+{
+	if (sorted.empty()) {
+		return 0;
+	}
+	auto rank = ( size_t ) (p / 100.0 * (sorted.size() - 1) + 0.5);
+	return sorted[ std::min( rank, sorted.size() - 1 ) ];
+}
+
+void
+write_series( std::ostream &out, const char *name, std::vector<double> samples )
+{
+	std::sort( samples.begin(), samples.end() );
+	double sum = 0;
+	for (double s : samples) {
+		sum += s;
+	}
+	out << "\"" << name << "\": {"
+		<< "\"mean\": " << (samples.empty() ? 0 : sum / samples.size())
+		<< ", \"p50\": " << percentile( samples, 50 )
+		<< ", \"p95\": " << percentile( samples, 95 )
+		<< ", \"p99\": " << percentile( samples, 99 )
+		<< ", \"max\": " << (samples.empty() ? 0 : samples.back()) << "}";
+}
+
+// Returns the number of frames after the warmup that allocated.
+uint64_t
+run_mode( std::ostream &out, const bench_options &options, const bench_mode &mode, bool sort_draws,
+          bool low_latency )
+{
+	window_config config;
+	config.headless = mode.headless;
+	config.force_present_mode = !mode.headless;
+	config.present_mode = mode.present_mode;
+	config.frames_in_flight = options.frames_in_flight;
+	config.record_timings = true;
+	config.count_allocations = count_allocations;
+	config.record_threads = options.threads;
+	config.draw_count = options.draws;
+	config.instances_per_draw = options.instances;
+	config.gpu_culling = options.cull;
+	config.pipeline_variants = options.variants;
+	config.skip_pending_pipelines = options.skip_pending;
+	config.sort_draws = sort_draws;
+	config.depth_layers = options.layers;
+	config.texture_paths = options.texture_paths;
+	config.texture_budget = options.texture_budget_mib << 20;
+	config.mesh_path = options.mesh_path;
+	config.vertex_layout = options.vertex_layout;
+	config.depth_prepass = options.depth_prepass;
+	config.shader_dir = options.shader_dir;
+	config.low_latency = low_latency;
+	config.max_queued_frames = options.max_queued;
+	config.latency_sleep = low_latency && options.latency_sleep;
+	if (options.seconds > 0) {
+		config.max_seconds = options.seconds;
+	} else {
+		config.max_frames = options.warmup + options.frames;
+	}
+
+	out << "{\"mode\": \"" << mode.name << "\", \"frames_in_flight\": " << options.frames_in_flight
+		<< ", \"threads\": " << options.threads << ", \"draws\": " << options.draws
+		<< ", \"instances_per_draw\": " << options.instances
+		<< ", \"gpu_culling\": " << (options.cull ? "true" : "false")
+		<< ", \"pipeline_variants\": " << options.variants
+		<< ", \"skip_pending_pipelines\": " << (options.skip_pending ? "true" : "false")
+		<< ", \"depth_layers\": " << options.layers << ", \"sort_draws\": " << (sort_draws ? "true" : "false")
+		<< ", \"textures\": " << options.texture_paths.size() << ", \"texture_budget_mib\": " << options.texture_budget_mib
+		<< ", \"low_latency\": " << (low_latency ? "true" : "false") << ", \"max_queued_frames\": " << options.max_queued
+		<< ", \"latency_sleep\": " << (config.latency_sleep ? "true" : "false")
+		<< ", \"vertex_layout\": \"" << vertex_layout_name( options.vertex_layout )
+		<< "\", \"depth_prepass\": " << (options.depth_prepass ? "true" : "false");
+
+	std::vector<frame_timing> timings;
+	device_allocator::statistics memory;
+	pso_cache::statistics pso;
+	texture_streamer::statistics textures;
+	try {
+		window window{ options.width, options.height, "Vulkan Bench", config };
+		window.run();
+		timings = window.frame_timings();
+		memory = window.memory_statistics();
+		pso = window.pso_statistics();
+		textures = window.texture_statistics();
+	} catch (const std::exception &e) {
+		std::string message = e.what();
+		std::replace( message.begin(), message.end(), '"', '\'' );
+		out << ", \"error\": \"" << message << "\"}";
+		return 0;
+	}
+
+	auto first = std::min<size_t>( options.warmup, timings.size() );
+	std::vector<double> cpu, wait, acquire, record, submit, present, gpu, visible, fragments;
+	std::vector<double> queue_wait, sleep, input_to_present, input_to_gpu_done, allocations;
+	uint64_t allocating_frames = 0;
+	size_t gpu_bound = 0;
+	double total_ms = 0;
+	for (size_t i = first; i < timings.size(); ++i) {
+		cpu.push_back( timings[ i ].cpu_frame_ms );
+		wait.push_back( timings[ i ].fence_wait_ms );
+		acquire.push_back( timings[ i ].acquire_ms );
+		record.push_back( timings[ i ].record_ms );
+		submit.push_back( timings[ i ].submit_ms );
+		present.push_back( timings[ i ].present_ms );
+		queue_wait.push_back( timings[ i ].queue_wait_ms );
+		sleep.push_back( timings[ i ].sleep_ms );
+		input_to_present.push_back( timings[ i ].input_to_present_ms );
+		if (timings[ i ].allocations >= 0) {
+			allocations.push_back( ( double ) timings[ i ].allocations );
+			allocating_frames += timings[ i ].allocations > 0 ? 1 : 0;
+		}
+		if (timings[ i ].input_to_gpu_done_ms >= 0) {
+			input_to_gpu_done.push_back( timings[ i ].input_to_gpu_done_ms );
+		}
+		if (timings[ i ].gpu_ms >= 0) {
+			gpu.push_back( timings[ i ].gpu_ms );
+			// GPU-bound: the GPU needs longer than the CPU work of a frame,
+			// which excludes the time spent waiting on the frame fence.
+			if (timings[ i ].gpu_ms > timings[ i ].cpu_frame_ms - timings[ i ].fence_wait_ms) {
+				gpu_bound++;
+			}
+		}
+		if (timings[ i ].visible_draws >= 0) {
+			visible.push_back( ( double ) timings[ i ].visible_draws );
+		}
+		if (timings[ i ].fragment_invocations >= 0) {
+			fragments.push_back( ( double ) timings[ i ].fragment_invocations );
+		}
+		total_ms += timings[ i ].cpu_frame_ms;
+	}
+
+	out << ", \"frames\": " << cpu.size()
+		<< ", \"fps\": " << (total_ms > 0 ? cpu.size() * 1000.0 / total_ms : 0) << ", ";
+	write_series( out, "cpu_frame_ms", cpu );
+	out << ", ";
+	write_series( out, "fence_wait_ms", wait );
+	out << ", ";
+	write_series( out, "acquire_ms", acquire );
+	out << ", ";
+	write_series( out, "record_ms", record );
+	out << ", ";
+	write_series( out, "submit_ms", submit );
+	out << ", ";
+	write_series( out, "present_ms", present );
+	out << ", ";
+	write_series( out, "gpu_ms", gpu );
+	out << ", ";
+	write_series( out, "queue_wait_ms", queue_wait );
+	out << ", ";
+	write_series( out, "sleep_ms", sleep );
+	// Latency as far as the CPU can see it; the display adds its scanout
+	// on top, which needs a present timing extension to measure.
+	out << ", ";
+	write_series( out, "input_to_present_ms", input_to_present );
+	out << ", ";
+	write_series( out, "input_to_gpu_done_ms", input_to_gpu_done );
+	if (!visible.empty()) {
+		out << ", ";
+		write_series( out, "visible_draws", visible );
+	}
+	if (!fragments.empty()) {
+		// Overdraw shows up here: with a depth buffer, sorted draws shade
+		// each covered pixel about once.
+		out << ", ";
+		write_series( out, "fragment_invocations", fragments );
+	}
+	// Steady-state frames are expected to reuse their memory; background
+	// work such as texture decodes and pipeline compiles counts as well.
+	out << ", ";
+	write_series( out, "allocations", allocations );
+	out << ", \"allocating_frames\": " << allocating_frames;
+	out << ", \"gpu_bound_frames\": " << gpu_bound;
+	out << ", \"memory\": {\"allocations\": " << memory.allocation_count
+		<< ", \"requested_bytes\": " << memory.requested_bytes << ", \"used_bytes\": " << memory.used_bytes
+		<< ", \"reserved_bytes\": " << memory.reserved_bytes << ", \"blocks\": " << memory.block_count
+		<< ", \"dedicated\": " << memory.dedicated_count << ", \"fragmentation\": " << memory.fragmentation << "}";
+	out << ", \"pso_cache\": {\"hits\": " << pso.hits << ", \"misses\": " << pso.misses
+		<< ", \"pending\": " << pso.pending << ", \"compiled\": " << pso.compiled << ", \"failed\": " << pso.failed
+		<< ", \"compile_ms_total\": " << pso.compile_ms_total << ", \"compile_ms_max\": " << pso.compile_ms_max << "}";
+	out << ", \"texture_streaming\": {\"failed\": " << textures.failed << ", \"decodes\": " << textures.decodes
+		<< ", \"decode_ms_total\": " << textures.decode_ms_total << ", \"decode_ms_max\": " << textures.decode_ms_max
+		<< ", \"upgrades\": " << textures.upgrades << ", \"evictions\": " << textures.evictions
+		<< ", \"budget_stalls\": " << textures.budget_stalls << ", \"staging_stalls\": " << textures.staging_stalls
+		<< ", \"uploaded_bytes\": " << textures.uploaded_bytes << ", \"tail_bytes\": " << textures.tail_bytes
+		<< ", \"streamed_bytes\": " << textures.streamed_bytes
+		<< ", \"peak_streamed_bytes\": " << textures.peak_streamed_bytes << "}}";
+	return allocating_frames;
+}
+
+// Drops the file's pages from the OS cache so the next read hits storage.
+// Returns false where that is not supported.
+bool
+evict_from_page_cache( const char *path )
+{
+#if defined(POSIX_FADV_DONTNEED)
+	int fd = open( path, O_RDONLY );
+	if (fd < 0) {
+		return false;
+	}
+	bool evicted = posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED ) == 0;
+	close( fd );
+	return evicted;
+#else
+	return false;
+#endif
+}
+
+// Reads the file the way utils.cpp used to: ifstream into a zero-filled
+// vector.
+size_t
+load_streamed( const char *path )
+{
+	std::ifstream file{ path, std::ios::ate | std::ios::binary };
+	std::vector<uint8_t> data( ( size_t ) file.tellg() );
+	file.seekg( 0 );
+	file.read( ( char * ) data.data(), data.size() );
+	return data.size();
+}
+
+// Maps the file and touches every page, so the comparison includes the
+// page faults a consumer would take.
+size_t
+load_mapped( const char *path )
+{
+	mapped_file file( path );
+	volatile uint8_t sink = 0;
+	for (size_t i = 0; i < file.size(); i += 4096) {
+		sink += file.data()[ i ];
+	}
+	return file.size();
+}
+
+// Mean milliseconds per load; negative if a cold run was requested but the
+// cache cannot be dropped.
+double
+time_loads( const std::string &path, uint32_t repeats, bool cold, size_t (*load)( const char * ) )
+{
+	double total = 0;
+	load( path.c_str() );
+	for (uint32_t i = 0; i < repeats; ++i) {
+		if (cold && !evict_from_page_cache( path.c_str() )) {
+			return -1;
+		}
+		auto start = std::chrono::steady_clock::now();
+		load( path.c_str() );
+		total += std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+	}
+	return total / repeats;
+}
+
+void
+run_file_load( std::ostream &out, const bench_options &options, const std::string &path )
+{
+	out << "{\"file\": \"" << path << "\"";
+	if (!file_exists( path.c_str() )) {
+		out << ", \"error\": \"missing\"}";
+		return;
+	}
+	mapped_file file( path.c_str() );
+	out << ", \"bytes\": " << file.size() << ", \"mapped\": " << (file.is_mapped() ? "true" : "false")
+		<< ", \"cold_stream_ms\": " << time_loads( path, options.load_repeats, true, load_streamed )
+		<< ", \"cold_mapped_ms\": " << time_loads( path, options.load_repeats, true, load_mapped )
+		<< ", \"warm_stream_ms\": " << time_loads( path, options.load_repeats, false, load_streamed )
+		<< ", \"warm_mapped_ms\": " << time_loads( path, options.load_repeats, false, load_mapped ) << "}";
+}
+
+bool
+parse_modes( const std::string &list, std::vector<bench_mode> &modes )
+{
+	size_t start = 0;
+	while (start <= list.size()) {
+		auto end = list.find( ',', start );
+		if (end == std::string::npos) {
+			end = list.size();
+		}
+		auto name = list.substr( start, end - start );
+		bool known = false;
+		for (auto &mode : all_modes) {
+			if (name == "all" || name == mode.name) {
+				modes.push_back( mode );
+				known = true;
+			}
+		}
+		if (!known) {
+			std::cerr << "unknown mode: " << name << "\n";
+			return false;
+		}
+		start = end + 1;
+	}
+	return true;
+}
+
+}
+
+int
+main( int argc, char **argv )
+{
+	bench_options options;
+	for (int i = 1; i < argc; ++i) {
+		bool has_value = i + 1 < argc;
+		if (std::strcmp( argv[ i ], "--frames" ) == 0 && has_value) {
+			options.frames = std::stoull( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--warmup" ) == 0 && has_value) {
+			options.warmup = std::stoull( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--seconds" ) == 0 && has_value) {
+			options.seconds = std::stod( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--size" ) == 0 && i + 2 < argc) {
+			options.width = ( uint32_t ) std::stoul( argv[ ++i ] );
+			options.height = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--frames-in-flight" ) == 0 && has_value) {
+			options.frames_in_flight = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--threads" ) == 0 && has_value) {
+			options.threads = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--draws" ) == 0 && has_value) {
+			options.draws = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--instances" ) == 0 && has_value) {
+			options.instances = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--shader-dir" ) == 0 && has_value) {
+			options.shader_dir = argv[ ++i ];
+		} else if (std::strcmp( argv[ i ], "--mesh" ) == 0 && has_value) {
+			options.mesh_path = argv[ ++i ];
+			options.load_paths.push_back( options.mesh_path );
+		} else if (std::strcmp( argv[ i ], "--vertex-layout" ) == 0 && has_value) {
+			if (!parse_vertex_layout( argv[ ++i ], options.vertex_layout )) {
+				std::cerr << "unknown vertex layout: " << argv[ i ] << "\n";
+				return 1;
+			}
+		} else if (std::strcmp( argv[ i ], "--depth-prepass" ) == 0) {
+			options.depth_prepass = true;
+		} else if (std::strcmp( argv[ i ], "--load" ) == 0 && has_value) {
+			options.load_paths.push_back( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--cull" ) == 0) {
+			options.cull = true;
+		} else if (std::strcmp( argv[ i ], "--variants" ) == 0 && has_value) {
+			options.variants = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--skip-pending" ) == 0) {
+			options.skip_pending = true;
+		} else if (std::strcmp( argv[ i ], "--layers" ) == 0 && has_value) {
+			options.layers = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--sort" ) == 0 && has_value) {
+			std::string value = argv[ ++i ];
+			if (value == "on") {
+				options.sort_draws = { true };
+			} else if (value == "off") {
+				options.sort_draws = { false };
+			} else if (value == "both") {
+				options.sort_draws = { false, true };
+			} else {
+				std::cerr << "unknown sort setting: " << value << "\n";
+				return 1;
+			}
+		} else if (std::strcmp( argv[ i ], "--texture" ) == 0 && has_value) {
+			options.texture_paths.push_back( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--texture-budget" ) == 0 && has_value) {
+			options.texture_budget_mib = std::stoull( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--latency" ) == 0 && has_value) {
+			std::string value = argv[ ++i ];
+			if (value == "on") {
+				options.low_latency = { true };
+			} else if (value == "off") {
+				options.low_latency = { false };
+			} else if (value == "both") {
+				options.low_latency = { false, true };
+			} else {
+				std::cerr << "unknown latency setting: " << value << "\n";
+				return 1;
+			}
+		} else if (std::strcmp( argv[ i ], "--max-queued" ) == 0 && has_value) {
+			options.max_queued = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--latency-sleep" ) == 0) {
+			options.latency_sleep = true;
+		} else if (std::strcmp( argv[ i ], "--check-allocations" ) == 0) {
+			options.check_allocations = true;
+		} else if (std::strcmp( argv[ i ], "--modes" ) == 0 && has_value) {
+			if (!parse_modes( argv[ ++i ], options.modes )) {
+				return 1;
+			}
+		} else if (std::strcmp( argv[ i ], "--out" ) == 0 && has_value) {
+			options.out_path = argv[ ++i ];
+		} else {
+			std::cerr << "usage: " << argv[ 0 ] << " [--frames N | --seconds S] [--warmup N] [--size W H]\n"
+				<< "\t[--frames-in-flight N] [--threads N] [--draws N] [--instances N] [--cull]\n"
+				<< "\t[--variants N] [--skip-pending] [--layers N] [--sort on|off|both]\n"
+				<< "\t[--texture file.ktx2|file.png]... [--texture-budget MiB]\n"
+				<< "\t[--latency on|off|both] [--max-queued N] [--latency-sleep] [--check-allocations]\n"
+				<< "\t[--modes mailbox,fifo_relaxed,fifo,immediate,headless|all]\n"
+				<< "\t[--mesh file.mesh] [--vertex-layout interleaved|split|packed] [--depth-prepass]\n"
+				<< "\t[--shader-dir dir] [--load file]... [--out bench.json]\n";
+			return 1;
+		}
+	}
+	if (options.modes.empty()) {
+		options.modes.push_back( all_modes[ 2 ] );
+	}
+
+	// The renderer logs to stdout, so results go to their own file.
+	std::ofstream out{ options.out_path };
+	if (!out) {
+		std::cerr << "cannot open " << options.out_path << "\n";
+		return 1;
+	}
+
+	out << "{\"results\": [";
+	bool first = true;
+	uint64_t allocating_frames = 0;
+	for (auto &mode : options.modes) {
+		for (bool sort_draws : options.sort_draws) {
+			for (bool low_latency : options.low_latency) {
+				if (!first) {
+					out << ", ";
+				}
+				first = false;
+				allocating_frames += run_mode( out, options, mode, sort_draws, low_latency );
+			}
+		}
+	}
+	out << "], \"file_loads\": [";
+	for (size_t i = 0; i < options.load_paths.size(); ++i) {
+		if (i > 0) {
+			out << ", ";
+		}
+		run_file_load( out, options, options.load_paths[ i ] );
+	}
+	out << "]}" << std::endl;
+	std::cout << "Results written to " << options.out_path << std::endl;
+	if (options.check_allocations && allocating_frames > 0) {
+		std::cerr << allocating_frames << " frames after the warmup allocated from the heap\n";
+		return 1;
+	}
+}
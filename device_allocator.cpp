@@ -0,0 +1,270 @@
+#include "device_allocator.h"
+#include <algorithm>
+#include <iostream>
+
+constexpr vk::DeviceSize device_allocator::min_node_size;
+constexpr vk::DeviceSize device_allocator::default_block_size;
+
+void
+device_allocator::create( vk::PhysicalDevice physical_device, vk::Device device, vk::DeviceSize block_size )
+{
+	_device = device;
+	_memory_properties = physical_device.getMemoryProperties();
+	_split_by_kind = physical_device.getProperties().limits.bufferImageGranularity > min_node_size;
+
+	uint32_t kinds = _split_by_kind ? 2 : 1;
+	_pools.resize( _memory_properties.memoryTypeCount * kinds );
+	for (uint32_t i = 0; i < _pools.size(); ++i) {
+		auto &p = _pools[ i ];
+		p.memory_type = i / kinds;
+
+		// Small heaps (e.g. host-visible device memory) get smaller blocks so a
+		// single block does not claim most of the heap.
+		auto heap_size = _memory_properties.memoryHeaps[ _memory_properties.memoryTypes[ p.memory_type ].heapIndex ].size;
+		p.block_size = block_size;
+		while (p.block_size > (1ull << 20) && p.block_size > heap_size / 8) {
+			p.block_size >>= 1;
+		}
+		p.max_order = 0;
+		while ((min_node_size << p.max_order) < p.block_size) {
+			++p.max_order;
+		}
+	}
+}
+
+void
+device_allocator::destroy()
+{
+	std::lock_guard<std::mutex> lock( _mutex );
+	if (_allocation_count > 0) {
+		std::cout << "device_allocator: " << _allocation_count << " allocations still alive at destruction\n";
+	}
+	for (auto &p : _pools) {
+		for (auto &b : p.blocks) {
+			if (b.memory) {
+				free_memory( b.memory, b.mapped != nullptr );
+			}
+		}
+		p.blocks.clear();
+	}
+	_pools.clear();
+}
+
+uint32_t
+device_allocator::pool_index( uint32_t memory_type, resource_kind kind ) const
+{
+	if (!_split_by_kind) {
+		return memory_type;
+	}
+	return memory_type * 2 + (kind == resource_kind::optimal ? 1 : 0);
+}
+
+bool
+device_allocator::is_host_visible( uint32_t memory_type ) const
+{
+	return (_memory_properties.memoryTypes[ memory_type ].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible)
+		? true : false;
+}
+
+vk::DeviceMemory
+device_allocator::allocate_memory( uint32_t memory_type, vk::DeviceSize size, void **mapped )
+{
+	vk::MemoryAllocateInfo allocate_info;
+	allocate_info.setMemoryTypeIndex( memory_type ).setAllocationSize( size );
+	auto memory = _device.allocateMemory( allocate_info );
+	*mapped = nullptr;
+	if (is_host_visible( memory_type )) {
+		*mapped = _device.mapMemory( memory, 0, VK_WHOLE_SIZE, vk::MemoryMapFlags() );
+	}
+	return memory;
+}
+
+void
+device_allocator::free_memory( vk::DeviceMemory memory, bool mapped )
+{
+	if (mapped) {
+		_device.unmapMemory( memory );
+	}
+	_device.freeMemory( memory );
+}
+
+void
+device_allocator::create_block( pool &p )
+{
+	auto it = std::find_if( p.blocks.begin(), p.blocks.end(), [](const block &b) {
+		                        return !b.memory;
+	                        } );
+	if (it == p.blocks.end()) {
+		p.blocks.emplace_back();
+		it = p.blocks.end() - 1;
+	}
+	it->memory = allocate_memory( p.memory_type, p.block_size, &it->mapped );
+	it->free_bytes = p.block_size;
+	it->free_lists.assign( p.max_order + 1, std::set<vk::DeviceSize>() );
+	it->free_lists[ p.max_order ].insert( 0 );
+}
+
+bool
+device_allocator::allocate_from_block( pool &p, uint32_t block_index, uint32_t order, device_allocation &allocation )
+{
+	auto &b = p.blocks[ block_index ];
+	uint32_t k = order;
+	while (k <= p.max_order && b.free_lists[ k ].empty()) {
+		++k;
+	}
+	if (k > p.max_order) {
+		return false;
+	}
+
+	// Lowest offset first keeps live nodes packed towards the block start.
+	vk::DeviceSize offset = *b.free_lists[ k ].begin();
+	b.free_lists[ k ].erase( b.free_lists[ k ].begin() );
+	while (k > order) {
+		--k;
+		b.free_lists[ k ].insert( offset + (min_node_size << k) );
+	}
+	b.free_bytes -= min_node_size << order;
+
+	allocation.memory = b.memory;
+	allocation.offset = offset;
+	allocation.mapped = b.mapped ? static_cast<char *>( b.mapped ) + offset : nullptr;
+	allocation.block = block_index;
+	allocation.order = order;
+	return true;
+}
+
+device_allocation
+device_allocator::allocate( const vk::MemoryRequirements &requirements, uint32_t memory_type, resource_kind kind )
+{
+	std::lock_guard<std::mutex> lock( _mutex );
+
+	device_allocation allocation;
+	allocation.size = requirements.size;
+	allocation.pool = pool_index( memory_type, kind );
+	auto &p = _pools[ allocation.pool ];
+
+	vk::DeviceSize needed = std::max( { requirements.size, requirements.alignment, min_node_size } );
+	if (needed > p.block_size / 2) {
+		allocation.memory = allocate_memory( memory_type, requirements.size, &allocation.mapped );
+		allocation.dedicated = true;
+		_dedicated_bytes += requirements.size;
+		_dedicated_count++;
+	} else {
+		uint32_t order = 0;
+		while ((min_node_size << order) < needed) {
+			++order;
+		}
+
+		bool found = false;
+		for (uint32_t i = 0; i < p.blocks.size() && !found; ++i) {
+			if (p.blocks[ i ].memory && p.blocks[ i ].free_bytes >= (min_node_size << order)) {
+				found = allocate_from_block( p, i, order, allocation );
+			}
+		}
+		if (!found) {
+			create_block( p );
+			for (uint32_t i = 0; i < p.blocks.size() && !found; ++i) {
+				if (p.blocks[ i ].free_bytes == p.block_size) {
+					found = allocate_from_block( p, i, order, allocation );
+				}
+			}
+		}
+	}
+
+	_requested_bytes += requirements.size;
+	_allocation_count++;
+	return allocation;
+}
+
+void
+device_allocator::free( device_allocation &allocation )
+{
+	if (!allocation.memory) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock( _mutex );
+
+	_requested_bytes -= allocation.size;
+	_allocation_count--;
+
+	if (allocation.dedicated) {
+		free_memory( allocation.memory, allocation.mapped != nullptr );
+		_dedicated_bytes -= allocation.size;
+		_dedicated_count--;
+		allocation = device_allocation();
+		return;
+	}
+
+	auto &p = _pools[ allocation.pool ];
+	auto &b = p.blocks[ allocation.block ];
+	vk::DeviceSize offset = allocation.offset;
+	uint32_t order = allocation.order;
+	while (order < p.max_order) {
+		auto buddy = b.free_lists[ order ].find( offset ^ (min_node_size << order) );
+		if (buddy == b.free_lists[ order ].end()) {
+			break;
+		}
+		offset = std::min( offset, *buddy );
+		b.free_lists[ order ].erase( buddy );
+		++order;
+	}
+	b.free_lists[ order ].insert( offset );
+	b.free_bytes += min_node_size << allocation.order;
+
+	// Give empty blocks back to the driver, but keep one per pool around so
+	// short-lived allocations do not keep hitting vkAllocateMemory.
+	if (b.free_bytes == p.block_size) {
+		auto live = std::count_if( p.blocks.begin(), p.blocks.end(), [](const block &bl) {
+			                           return bl.memory ? true : false;
+		                           } );
+		if (live > 1) {
+			free_memory( b.memory, b.mapped != nullptr );
+			b = block();
+		}
+	}
+	allocation = device_allocation();
+}
+
+device_allocator::statistics
+device_allocator::stats() const
+{
+	std::lock_guard<std::mutex> lock( _mutex );
+
+	statistics s;
+	vk::DeviceSize free_bytes = 0;
+	// Each block's largest free node, summed over the blocks.
+	vk::DeviceSize largest_free_per_block_sum = 0;
+	for (auto &p : _pools) {
+		for (auto &b : p.blocks) {
+			if (!b.memory) {
+				continue;
+			}
+			s.block_count++;
+			s.reserved_bytes += p.block_size;
+			s.used_bytes += p.block_size - b.free_bytes;
+			free_bytes += b.free_bytes;
+			for (uint32_t order = p.max_order + 1; order-- > 0;) {
+				if (!b.free_lists[ order ].empty()) {
+					largest_free_per_block_sum += min_node_size << order;
+					break;
+				}
+			}
+		}
+	}
+	s.reserved_bytes += _dedicated_bytes;
+	s.used_bytes += _dedicated_bytes;
+	s.requested_bytes = _requested_bytes;
+	s.dedicated_count = _dedicated_count;
+	s.allocation_count = _allocation_count;
+	s.fragmentation = free_bytes ? 1.0 - ( double ) largest_free_per_block_sum / free_bytes : 0;
+	return s;
+}
+
+void
+device_allocator::print_statistics( std::ostream &out ) const
+{
+	auto s = stats();
+	out << "Device memory: " << s.allocation_count << " allocations, " << s.requested_bytes << " bytes requested, "
+		<< s.used_bytes << " used, " << s.reserved_bytes << " reserved in " << s.block_count << " blocks + "
+		<< s.dedicated_count << " dedicated, fragmentation " << s.fragmentation << "\n";
+}
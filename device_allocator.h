@@ -0,0 +1,103 @@
+#pragma once
+
+#include "vulkan.h"
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <vector>
+
+// A range of device memory handed out by device_allocator. `mapped` points at
+// `offset` inside the block when the memory type is host-visible; blocks are
+// mapped once for their whole lifetime.
+struct device_allocation {
+	vk::DeviceMemory memory;
+	vk::DeviceSize offset = 0;
+	vk::DeviceSize size = 0;
+	void *mapped = nullptr;
+
+	uint32_t pool = 0;
+	uint32_t block = 0;
+	uint32_t order = 0;
+	bool dedicated = false;
+};
+
+// Sub-allocates buffers and images out of large vkDeviceMemory blocks, one
+// set of blocks per memory type. Placement inside a block uses a buddy
+// system: every node is aligned to its own size, so rounding a request up to
+// its alignment is enough to honor it. Linear and optimal resources are kept
+// in separate blocks when bufferImageGranularity exceeds the smallest node.
+// Requests larger than half a block get a dedicated allocation.
+class device_allocator {
+public:
+	struct statistics {
+		vk::DeviceSize reserved_bytes = 0;
+		vk::DeviceSize used_bytes = 0;
+		vk::DeviceSize requested_bytes = 0;
+		uint32_t block_count = 0;
+		uint32_t dedicated_count = 0;
+		uint32_t allocation_count = 0;
+		// Share of free bytes that is not part of its block's largest free node.
+		double fragmentation = 0;
+	};
+
+	enum class resource_kind {
+		linear,
+		optimal,
+	};
+
+	static constexpr vk::DeviceSize min_node_size = 256;
+	static constexpr vk::DeviceSize default_block_size = 64ull << 20;
+
+	void create( vk::PhysicalDevice physical_device, vk::Device device,
+	             vk::DeviceSize block_size = default_block_size );
+
+	void destroy();
+
+	device_allocation allocate( const vk::MemoryRequirements &requirements, uint32_t memory_type,
+	                            resource_kind kind );
+
+	void free( device_allocation &allocation );
+
+	bool is_host_visible( uint32_t memory_type ) const;
+
+	statistics stats() const;
+
+	void print_statistics( std::ostream &out ) const;
+
+private:
+	struct block {
+		vk::DeviceMemory memory;
+		void *mapped = nullptr;
+		vk::DeviceSize free_bytes = 0;
+		// Free node offsets, indexed by order (node size = min_node_size << order).
+		std::vector<std::set<vk::DeviceSize>> free_lists;
+	};
+
+	struct pool {
+		uint32_t memory_type = 0;
+		vk::DeviceSize block_size = 0;
+		uint32_t max_order = 0;
+		std::vector<block> blocks;
+	};
+
+	uint32_t pool_index( uint32_t memory_type, resource_kind kind ) const;
+
+	bool allocate_from_block( pool &p, uint32_t block_index, uint32_t order, device_allocation &allocation );
+
+	void create_block( pool &p );
+
+	vk::DeviceMemory allocate_memory( uint32_t memory_type, vk::DeviceSize size, void **mapped );
+
+	void free_memory( vk::DeviceMemory memory, bool mapped );
+
+	vk::Device _device;
+	vk::PhysicalDeviceMemoryProperties _memory_properties;
+	bool _split_by_kind = false;
+	std::vector<pool> _pools;
+	mutable std::mutex _mutex;
+
+	vk::DeviceSize _requested_bytes = 0;
+	vk::DeviceSize _dedicated_bytes = 0;
+	uint32_t _dedicated_count = 0;
+	uint32_t _allocation_count = 0;
+};
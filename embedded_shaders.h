@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// SPIR-V modules compiled into the binary by the Shaders target.
+struct spirv_blob {
+	const char *name;
+	const uint32_t *code;
+	size_t size;
+};
+
+// Generated from ${PROJECT_BINARY_DIR}/shaders/*.spv by
+// CMake/scripts/embed_spirv.cmake.
+#include "embedded_spirv.inc"
+
+constexpr bool
+shader_name_equal( const char *a, const char *b )
+{
+	while (*a && *a == *b) {
+		++a;
+		++b;
+	}
+	return *a == *b;
+}
+
+// Looks a module up by file name (e.g. "shader.vert.spv"); usable in
+// constant expressions. Returns nullptr for an unknown name.
+constexpr const spirv_blob *
+find_embedded_shader( const char *name )
+{
+	for (size_t i = 0; i < sizeof(embedded_spirv) / sizeof(embedded_spirv[ 0 ]); ++i) {
+		if (shader_name_equal( embedded_spirv[ i ].name, name )) {
+			return &embedded_spirv[ i ];
+		}
+	}
+	return nullptr;
+}
+
+constexpr bool
+has_embedded_shader( const char *name )
+{
+	return find_embedded_shader( name ) != nullptr;
+}
@@ -0,0 +1,92 @@
+#include "frame_arena.h"
+#include <algorithm>
+#include <new>
+
+frame_arena::frame_arena( size_t capacity )
+	: _block( new char[ capacity ] )
+{
+	_stats.capacity = capacity;
+}
+
+frame_arena::~frame_arena()
+{
+	release_overflow();
+}
+
+frame_arena::frame_arena( frame_arena &&other )
+	: _block( std::move( other._block ) ), _head( other._head ), _used( other._used ), _overflow( other._overflow ),
+	  _stats( other._stats )
+{
+	other._head = 0;
+	other._used = 0;
+	other._overflow = nullptr;
+	other._stats = statistics();
+}
+
+frame_arena &
+frame_arena::operator=( frame_arena &&other )
+{
+	if (this != &other) {
+		release_overflow();
+		_block = std::move( other._block );
+		_head = other._head;
+		_used = other._used;
+		_overflow = other._overflow;
+		_stats = other._stats;
+		other._head = 0;
+		other._used = 0;
+		other._overflow = nullptr;
+		other._stats = statistics();
+	}
+	return *this;
+}
+
+void *
+frame_arena::allocate( size_t size, size_t alignment )
+{
+	auto base = reinterpret_cast<uintptr_t>( _block.get() );
+	auto offset = ((base + _head + alignment - 1) & ~(uintptr_t) (alignment - 1)) - base;
+	if (_block && offset + size <= _stats.capacity) {
+		_used += offset + size - _head;
+		_head = offset + size;
+		_stats.peak_bytes = std::max( _stats.peak_bytes, _used );
+		return _block.get() + offset;
+	}
+
+	// Its own heap block, headed by the link that frees it on reset().
+	auto block = static_cast<char *>( ::operator new( sizeof(overflow_block) + alignment + size ) );
+	auto link = reinterpret_cast<overflow_block *>( block );
+	link->next = _overflow;
+	_overflow = link;
+	auto data = (reinterpret_cast<uintptr_t>( block ) + sizeof(overflow_block) + alignment - 1)
+		& ~(uintptr_t) (alignment - 1);
+	_used += size + alignment;
+	_stats.peak_bytes = std::max( _stats.peak_bytes, _used );
+	_stats.overflows++;
+	return reinterpret_cast<void *>( data );
+}
+
+void
+frame_arena::reset()
+{
+	if (_overflow) {
+		release_overflow();
+		// Room for everything the last frame asked for, with the padding it
+		// may need in one block.
+		auto capacity = std::max( _stats.capacity * 2, _used );
+		_block.reset( new char[ capacity ] );
+		_stats.capacity = capacity;
+	}
+	_head = 0;
+	_used = 0;
+}
+
+void
+frame_arena::release_overflow()
+{
+	while (_overflow) {
+		auto next = _overflow->next;
+		::operator delete( _overflow );
+		_overflow = next;
+	}
+}
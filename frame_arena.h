@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Bump allocator for scratch memory that lives until the frame using it is
+// done. Allocation moves a pointer, and reset() frees everything at once.
+// If a frame outgrows the block, more comes from the heap for that frame,
+// and the next reset() replaces the block with one large enough for all of
+// it, so the arena stops allocating once frames stop growing. Not thread
+// safe.
+class frame_arena {
+public:
+	struct statistics {
+		size_t capacity = 0;
+		size_t peak_bytes = 0;
+		// Heap blocks taken because the arena was full.
+		uint64_t overflows = 0;
+	};
+
+	explicit frame_arena( size_t capacity = 64 << 10 );
+
+	~frame_arena();
+
+	frame_arena( const frame_arena & ) = delete;
+
+	frame_arena &operator=( const frame_arena & ) = delete;
+
+	frame_arena( frame_arena &&other );
+
+	frame_arena &operator=( frame_arena &&other );
+
+	// `alignment` must be a power of two.
+	void *allocate( size_t size, size_t alignment );
+
+	void reset();
+
+	size_t used() const { return _used; }
+
+	const statistics &stats() const { return _stats; }
+
+private:
+	struct overflow_block {
+		overflow_block *next;
+	};
+
+	void release_overflow();
+
+	std::unique_ptr<char[]> _block;
+	size_t _head = 0;
+	// Bytes allocated since reset(), in the block and outside of it.
+	size_t _used = 0;
+	overflow_block *_overflow = nullptr;
+	statistics _stats;
+};
+
+// Standard allocator drawing from a frame_arena; deallocate() does nothing,
+// the memory returns with the arena's reset(). Reserve containers up front:
+// storage they outgrow is only reclaimed by the reset.
+template <typename T>
+class arena_allocator {
+public:
+	using value_type = T;
+
+	arena_allocator( frame_arena &arena ) : _arena( &arena ) {}
+
+	template <typename U>
+	arena_allocator( const arena_allocator<U> &other ) : _arena( other.arena() ) {}
+
+	T *
+	allocate( size_t n )
+	{
+		return static_cast<T *>( _arena->allocate( n * sizeof(T), alignof(T) ) );
+	}
+
+	void deallocate( T *, size_t ) {}
+
+	frame_arena *arena() const { return _arena; }
+
+private:
+	frame_arena *_arena;
+};
+
+template <typename T, typename U>
+bool
+operator==( const arena_allocator<T> &a, const arena_allocator<U> &b )
+{
+	return a.arena() == b.arena();
+}
+
+template <typename T, typename U>
+bool
+operator!=( const arena_allocator<T> &a, const arena_allocator<U> &b )
+{
+	return a.arena() != b.arena();
+}
+
+template <typename T>
+using arena_vector = std::vector<T, arena_allocator<T>>;
@@ -0,0 +1,180 @@
+#include "gpu_profiler.h"
+#include <algorithm>
+
+constexpr uint32_t gpu_profiler::max_passes;
+
+void
+gpu_profiler::create( vk::Device device, const vk::PhysicalDeviceProperties &properties,
+                      uint32_t timestamp_valid_bits, uint32_t frame_slots, bool pipeline_statistics )
+{
+	_device = device;
+	_slots.resize( frame_slots );
+	if (pipeline_statistics) {
+		vk::QueryPoolCreateInfo statistics_pool_create_info;
+		statistics_pool_create_info.setQueryType( vk::QueryType::ePipelineStatistics )
+		                           .setQueryCount( frame_slots )
+		                           .setPipelineStatistics(
+			                           vk::QueryPipelineStatisticFlagBits::eFragmentShaderInvocations );
+		_statistics_pool = _device.createQueryPool( statistics_pool_create_info );
+	}
+	if (timestamp_valid_bits == 0) {
+		return;
+	}
+	_timestamp_period_ns = properties.limits.timestampPeriod;
+	_timestamp_mask = timestamp_valid_bits >= 64 ? ~0ull : (1ull << timestamp_valid_bits) - 1;
+
+	vk::QueryPoolCreateInfo query_pool_create_info;
+	query_pool_create_info.setQueryType( vk::QueryType::eTimestamp )
+	                      .setQueryCount( frame_slots * max_passes * 2 );
+	_query_pool = _device.createQueryPool( query_pool_create_info );
+}
+
+void
+gpu_profiler::destroy()
+{
+	if (_query_pool) {
+		_device.destroyQueryPool( _query_pool );
+		_query_pool = VK_NULL_HANDLE;
+	}
+	if (_statistics_pool) {
+		_device.destroyQueryPool( _statistics_pool );
+		_statistics_pool = VK_NULL_HANDLE;
+	}
+	_slots.clear();
+}
+
+double
+gpu_profiler::collect( uint32_t slot )
+{
+	auto &state = _slots[ slot ];
+	if (!enabled() || state.pass_names.empty()) {
+		return -1;
+	}
+
+	// Pairs of (value, availability) for every begin/end query of the slot.
+	uint64_t results[ max_passes * 2 * 2 ];
+	auto query_count = ( uint32_t ) state.pass_names.size() * 2;
+	auto ret = vkGetQueryPoolResults( _device, _query_pool, slot * max_passes * 2, query_count,
+	                                  sizeof(results), results, 2 * sizeof(uint64_t),
+	                                  VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT );
+
+	double frame_ms = -1;
+	for (uint32_t i = 0; ret == VK_SUCCESS && i < state.pass_names.size(); ++i) {
+		const uint64_t *begin = &results[ i * 4 ];
+		const uint64_t *end = &results[ i * 4 + 2 ];
+		if (!begin[ 1 ] || !end[ 1 ]) {
+			continue;
+		}
+		double ms = ((end[ 0 ] - begin[ 0 ]) & _timestamp_mask) * _timestamp_period_ns / 1e6;
+
+		auto it = std::find_if( _passes.begin(), _passes.end(), [&](const pass_stats &p) {
+			                        return p.name == state.pass_names[ i ];
+		                        } );
+		if (it == _passes.end()) {
+			_passes.emplace_back();
+			it = _passes.end() - 1;
+			it->name = state.pass_names[ i ];
+			it->min_ms = ms;
+			it->max_ms = ms;
+		}
+		it->samples++;
+		it->last_ms = ms;
+		it->min_ms = std::min( it->min_ms, ms );
+		it->max_ms = std::max( it->max_ms, ms );
+		it->total_ms += ms;
+		frame_ms = std::max( frame_ms, 0.0 ) + ms;
+	}
+	state.pass_names.clear();
+	return frame_ms;
+}
+
+int64_t
+gpu_profiler::collect_fragment_invocations( uint32_t slot )
+{
+	auto &state = _slots[ slot ];
+	if (!state.statistics_written) {
+		return -1;
+	}
+	state.statistics_written = false;
+
+	uint64_t result[ 2 ];
+	auto ret = vkGetQueryPoolResults( _device, _statistics_pool, slot, 1, sizeof(result), result, sizeof(result),
+	                                  VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT );
+	if (ret != VK_SUCCESS || !result[ 1 ]) {
+		return -1;
+	}
+	return ( int64_t ) result[ 0 ];
+}
+
+vk::QueryPipelineStatisticFlags
+gpu_profiler::pipeline_statistics() const
+{
+	if (!_statistics_pool) {
+		return vk::QueryPipelineStatisticFlags();
+	}
+	return vk::QueryPipelineStatisticFlagBits::eFragmentShaderInvocations;
+}
+
+void
+gpu_profiler::begin_frame( vk::CommandBuffer cmd, uint32_t slot )
+{
+	_recording_slot = slot;
+	if (_statistics_pool) {
+		cmd.resetQueryPool( _statistics_pool, slot, 1 );
+		cmd.beginQuery( _statistics_pool, slot, vk::QueryControlFlags() );
+		_slots[ slot ].statistics_written = true;
+	}
+	if (!enabled()) {
+		return;
+	}
+	_slots[ slot ].pass_names.clear();
+	_slots[ slot ].pass_timed = false;
+	cmd.resetQueryPool( _query_pool, slot * max_passes * 2, max_passes * 2 );
+}
+
+void
+gpu_profiler::end_frame( vk::CommandBuffer cmd )
+{
+	if (_statistics_pool) {
+		cmd.endQuery( _statistics_pool, _recording_slot );
+	}
+}
+
+void
+gpu_profiler::begin_pass( vk::CommandBuffer cmd, const char *name )
+{
+	auto &state = _slots[ _recording_slot ];
+	state.pass_timed = enabled() && state.pass_names.size() < max_passes;
+	if (!state.pass_timed) {
+		return;
+	}
+	auto query = ( uint32_t ) (_recording_slot * max_passes + state.pass_names.size()) * 2;
+	state.pass_names.push_back( name );
+	cmd.writeTimestamp( vk::PipelineStageFlagBits::eTopOfPipe, _query_pool, query );
+}
+
+void
+gpu_profiler::end_pass( vk::CommandBuffer cmd )
+{
+	auto &state = _slots[ _recording_slot ];
+	if (!state.pass_timed) {
+		return;
+	}
+	state.pass_timed = false;
+	auto query = ( uint32_t ) (_recording_slot * max_passes + state.pass_names.size() - 1) * 2 + 1;
+	cmd.writeTimestamp( vk::PipelineStageFlagBits::eBottomOfPipe, _query_pool, query );
+}
+
+void
+gpu_profiler::print_summary( std::ostream &out ) const
+{
+	if (!enabled()) {
+		out << "GPU timestamps are not supported on this queue.\n";
+		return;
+	}
+	out << "GPU pass timings:\n";
+	for (auto &pass : _passes) {
+		out << "\t" << pass.name << ": " << pass.samples << " samples, mean " << pass.mean_ms() << " ms, min "
+			<< pass.min_ms << " ms, max " << pass.max_ms << " ms\n";
+	}
+}
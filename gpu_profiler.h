@@ -0,0 +1,85 @@
+#pragma once
+
+#include "vulkan.h"
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Timestamp queries around GPU passes, and optionally a pipeline statistics
+// query over the whole frame. Each frame slot owns its own range of queries;
+// results are read back once the slot's fence has signaled, so collecting
+// never waits on the GPU.
+class gpu_profiler {
+public:
+	struct pass_stats {
+		std::string name;
+		uint64_t samples = 0;
+		double last_ms = 0;
+		double min_ms = 0;
+		double max_ms = 0;
+		double total_ms = 0;
+
+		double mean_ms() const { return samples ? total_ms / samples : 0; }
+	};
+
+	static constexpr uint32_t max_passes = 8;
+
+	// `pipeline_statistics` requires the pipelineStatisticsQuery feature, and
+	// inheritedQueries if secondary command buffers run inside the frame.
+	void create( vk::Device device, const vk::PhysicalDeviceProperties &properties, uint32_t timestamp_valid_bits,
+	             uint32_t frame_slots, bool pipeline_statistics );
+
+	void destroy();
+
+	bool enabled() const { return _query_pool ? true : false; }
+
+	// Reads back the results last written by `slot`. Must only be called
+	// after the slot's fence has signaled. Returns the summed duration of
+	// its passes in milliseconds, or a negative value if there was nothing
+	// to read.
+	double collect( uint32_t slot );
+
+	// Fragment shader invocations of the frame last recorded into `slot`,
+	// or a negative value when they are not available. Same rules as
+	// collect().
+	int64_t collect_fragment_invocations( uint32_t slot );
+
+	// Statistics active while a frame records; secondary command buffers
+	// executed meanwhile must inherit them.
+	vk::QueryPipelineStatisticFlags pipeline_statistics() const;
+
+	// Resets the slot's queries; record outside of any render pass.
+	void begin_frame( vk::CommandBuffer cmd, uint32_t slot );
+
+	// Record outside of any render pass, after the frame's last pass.
+	void end_frame( vk::CommandBuffer cmd );
+
+	// Passes are sequential, not nested. `name` must outlive the profiler.
+	// Passes past max_passes in a frame are not timed.
+	void begin_pass( vk::CommandBuffer cmd, const char *name );
+
+	void end_pass( vk::CommandBuffer cmd );
+
+	const std::vector<pass_stats> &passes() const { return _passes; }
+
+	void print_summary( std::ostream &out ) const;
+
+private:
+	struct slot_state {
+		std::vector<const char *> pass_names;
+		// Whether the open pass got a begin timestamp; passes past
+		// max_passes do not.
+		bool pass_timed = false;
+		bool statistics_written = false;
+	};
+
+	vk::Device _device;
+	vk::QueryPool _query_pool;
+	// One query per slot, counting fragment shader invocations.
+	vk::QueryPool _statistics_pool;
+	double _timestamp_period_ns = 1;
+	uint64_t _timestamp_mask = ~0ull;
+	std::vector<slot_state> _slots;
+	uint32_t _recording_slot = 0;
+	std::vector<pass_stats> _passes;
+};
@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "job_system.h"
+
+namespace {
+
+struct job_bench_options {
+	uint32_t max_threads = std::max( std::thread::hardware_concurrency(), 1u );
+	uint32_t jobs = 100000;
+	// Items of the parallel_for workload, and iterations of work per item.
+	uint32_t items = 1 << 16;
+	uint32_t work = 2000;
+	uint32_t grain = 256;
+	uint32_t repeats = 5;
+	std::string out_path = "job_bench.json";
+};
+
+double
+elapsed_ms( std::chrono::steady_clock::time_point start )
+{
+	return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+}
+
+// Best of `repeats` runs, which is the least disturbed by other processes.
+template <typename Fn>
+double
+best_ms( uint32_t repeats, Fn fn )
+{
+	double best = 0;
+	for (uint32_t i = 0; i < repeats; ++i) {
+		auto start = std::chrono::steady_clock::now();
+		fn();
+		auto ms = elapsed_ms( start );
+		best = i == 0 ? ms : std::min( best, ms );
+	}
+	return best;
+}
+
+// Arithmetic the compiler cannot fold away.
+uint32_t
+busy_work( uint32_t seed, uint32_t iterations )
+{
+	uint32_t x = seed | 1;
+	for (uint32_t i = 0; i < iterations; ++i) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+	}
+	return x;
+}
+
+// Each job starts two children until `depth` runs out, so most jobs are
+// started on worker threads and reach the others by being stolen.
+void
+spawn_tree( job_system &jobs, job_counter &counter, uint32_t depth )
+{
+	if (depth == 0) {
+		return;
+	}
+	for (int i = 0; i < 2; ++i) {
+		jobs.run( [&jobs, &counter, depth]() {
+			spawn_tree( jobs, counter, depth - 1 );
+		}, &counter );
+	}
+}
+
+void
+run_threads( std::ostream &out, const job_bench_options &options, uint32_t threads, double serial_ms )
+{
+	job_system jobs( threads );
+
+	// Scheduling overhead: empty jobs started from the main thread, which
+	// runs them too while it waits.
+	double flat_ms = best_ms( options.repeats, [&]() {
+		job_counter counter;
+		for (uint32_t i = 0; i < options.jobs; ++i) {
+			jobs.run( []() {}, &counter );
+		}
+		jobs.wait( counter );
+	} );
+
+	uint32_t depth = 1;
+	while ((2u << depth) - 2 < options.jobs) {
+		depth++;
+	}
+	auto tree_jobs = (2u << depth) - 2;
+	double tree_ms = best_ms( options.repeats, [&]() {
+		job_counter counter;
+		spawn_tree( jobs, counter, depth );
+		jobs.wait( counter );
+	} );
+
+	// Scaling: a fixed amount of work split into grain-sized jobs.
+	std::vector<uint32_t> results( options.items );
+	double parallel_ms = best_ms( options.repeats, [&]() {
+		jobs.parallel_for( options.items, options.grain, [&]( uint32_t begin, uint32_t end ) {
+			for (uint32_t i = begin; i < end; ++i) {
+				results[ i ] = busy_work( i, options.work );
+			}
+		} );
+	} );
+
+	auto stats = jobs.stats();
+	out << "{\"threads\": " << threads
+		<< ", \"empty_job_ns\": " << flat_ms * 1e6 / options.jobs
+		<< ", \"spawned_job_ns\": " << tree_ms * 1e6 / tree_jobs
+		<< ", \"parallel_for_ms\": " << parallel_ms
+		<< ", \"speedup\": " << (parallel_ms > 0 ? serial_ms / parallel_ms : 0)
+		<< ", \"efficiency\": " << (parallel_ms > 0 ? serial_ms / parallel_ms / threads : 0)
+		<< ", \"steals\": " << stats.steals << ", \"injected\": " << stats.injected
+		<< ", \"sleeps\": " << stats.sleeps << "}";
+	std::cout << threads << " threads: " << flat_ms * 1e6 / options.jobs << " ns per empty job, "
+		<< parallel_ms << " ms parallel_for (" << serial_ms / parallel_ms << "x)" << std::endl;
+}
+
+}
+
+int
+main( int argc, char **argv )
+{
+	job_bench_options options;
+	for (int i = 1; i < argc; ++i) {
+		bool has_value = i + 1 < argc;
+		if (std::strcmp( argv[ i ], "--threads" ) == 0 && has_value) {
+			options.max_threads = std::max( ( uint32_t ) std::stoul( argv[ ++i ] ), 1u );
+		} else if (std::strcmp( argv[ i ], "--jobs" ) == 0 && has_value) {
+			options.jobs = std::max( ( uint32_t ) std::stoul( argv[ ++i ] ), 2u );
+		} else if (std::strcmp( argv[ i ], "--items" ) == 0 && has_value) {
+			options.items = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--work" ) == 0 && has_value) {
+			options.work = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--grain" ) == 0 && has_value) {
+			options.grain = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--repeats" ) == 0 && has_value) {
+			options.repeats = std::max( ( uint32_t ) std::stoul( argv[ ++i ] ), 1u );
+		} else if (std::strcmp( argv[ i ], "--out" ) == 0 && has_value) {
+			options.out_path = argv[ ++i ];
+		} else {
+			std::cerr << "usage: " << argv[ 0 ] << " [--threads max] [--jobs N] [--items N] [--work N]\n"
+				<< "\t[--grain N] [--repeats N] [--out job_bench.json]\n";
+			return 1;
+		}
+	}
+
+	std::ofstream out{ options.out_path };
+	if (!out) {
+		std::cerr << "cannot open " << options.out_path << "\n";
+		return 1;
+	}
+
+	// The same workload in a plain loop, as the baseline for speedups.
+	std::vector<uint32_t> results( options.items );
+	double serial_ms = best_ms( options.repeats, [&]() {
+		for (uint32_t i = 0; i < options.items; ++i) {
+			results[ i ] = busy_work( i, options.work );
+		}
+	} );
+
+	out << "{\"jobs\": " << options.jobs << ", \"items\": " << options.items << ", \"work\": " << options.work
+		<< ", \"grain\": " << options.grain << ", \"serial_ms\": " << serial_ms << ", \"results\": [";
+	for (uint32_t threads = 1; threads <= options.max_threads; ++threads) {
+		if (threads > 1) {
+			out << ", ";
+		}
+		run_threads( out, options, threads, serial_ms );
+	}
+	out << "]}" << std::endl;
+	std::cout << "Results written to " << options.out_path << std::endl;
+}
@@ -0,0 +1,406 @@
+#include "job_system.h"
+#include <algorithm>
+
+namespace {
+
+thread_local const job_system *current_system = nullptr;
+thread_local uint32_t current_index = 0;
+
+// Tries made by an idle worker before it goes to sleep, and by a waiting
+// one before it starts yielding its time slice.
+constexpr uint32_t idle_spins = 64;
+
+// Jobs moved between a worker's free list and the shared one at a time; a
+// worker keeps at most twice as many.
+constexpr size_t free_batch = 64;
+
+}
+
+struct job_system::job {
+	std::function<void()> fn;
+	job_counter *counter;
+	bool main_only;
+};
+
+// Chase-Lev deque of fixed capacity (Lê et al., "Correct and Efficient
+// Work-Stealing for Weak Memory Models"). The owning worker pushes and pops
+// at the bottom; other workers steal from the top.
+class work_deque {
+public:
+	// Fails when full; owner only.
+	template <typename T>
+	bool
+	push( T *item )
+	{
+		auto bottom = _bottom.load( std::memory_order_relaxed );
+		auto top = _top.load( std::memory_order_acquire );
+		if (bottom - top >= capacity) {
+			return false;
+		}
+		_slots[ bottom & (capacity - 1) ].store( item, std::memory_order_relaxed );
+		// Publishes the item, and the job it points to, to thieves.
+		_bottom.store( bottom + 1, std::memory_order_release );
+		return true;
+	}
+
+	// Owner only.
+	template <typename T>
+	T *
+	pop()
+	{
+		auto bottom = _bottom.load( std::memory_order_relaxed ) - 1;
+		_bottom.store( bottom, std::memory_order_relaxed );
+		std::atomic_thread_fence( std::memory_order_seq_cst );
+		auto top = _top.load( std::memory_order_relaxed );
+		if (top > bottom) {
+			_bottom.store( bottom + 1, std::memory_order_relaxed );
+			return nullptr;
+		}
+		auto item = _slots[ bottom & (capacity - 1) ].load( std::memory_order_relaxed );
+		if (top == bottom) {
+			// The last item: whoever moves top first gets it.
+			if (!_top.compare_exchange_strong( top, top + 1, std::memory_order_seq_cst,
+			                                   std::memory_order_relaxed )) {
+				item = nullptr;
+			}
+			_bottom.store( bottom + 1, std::memory_order_relaxed );
+		}
+		return static_cast<T *>( item );
+	}
+
+	template <typename T>
+	T *
+	steal()
+	{
+		auto top = _top.load( std::memory_order_acquire );
+		std::atomic_thread_fence( std::memory_order_seq_cst );
+		auto bottom = _bottom.load( std::memory_order_acquire );
+		if (top >= bottom) {
+			return nullptr;
+		}
+		auto item = _slots[ top & (capacity - 1) ].load( std::memory_order_relaxed );
+		if (!_top.compare_exchange_strong( top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed )) {
+			return nullptr;
+		}
+		return static_cast<T *>( item );
+	}
+
+private:
+	static constexpr int64_t capacity = 4096;
+
+	// Kept on separate cache lines: thieves write top, the owner bottom.
+	std::atomic<int64_t> _top{ 0 };
+	char _top_padding[ 64 ];
+	std::atomic<int64_t> _bottom{ 0 };
+	char _bottom_padding[ 64 ];
+	std::atomic<void *> _slots[ capacity ] = {};
+};
+
+struct job_system::worker {
+	work_deque deque;
+	std::vector<job_system::job *> free_jobs;
+	std::atomic<uint64_t> jobs{ 0 };
+	std::atomic<uint64_t> steals{ 0 };
+	// Where the next steal attempt starts.
+	uint32_t victim = 0;
+};
+
+job_system::job_system( uint32_t thread_count )
+{
+	if (thread_count == 0) {
+		thread_count = 1;
+	}
+	for (uint32_t i = 0; i < thread_count; ++i) {
+		_workers.emplace_back( new worker() );
+		_workers.back()->victim = (i + 1) % thread_count;
+		_workers.back()->free_jobs.reserve( 2 * free_batch + 1 );
+	}
+	current_system = this;
+	current_index = 0;
+	for (uint32_t i = 1; i < thread_count; ++i) {
+		_threads.emplace_back( &job_system::worker_main, this, i );
+	}
+}
+
+job_system::~job_system()
+{
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		_quit = true;
+	}
+	_wake.notify_all();
+	for (auto &thread : _threads) {
+		thread.join();
+	}
+	if (current_system == this) {
+		current_system = nullptr;
+	}
+
+	// Jobs nobody waited for are dropped.
+	for (auto &w : _workers) {
+		while (auto j = w->deque.pop<job>()) {
+			delete j;
+		}
+	}
+	for (auto j : _injected) {
+		delete j;
+	}
+	for (auto j : _main_jobs) {
+		delete j;
+	}
+	for (auto &w : _workers) {
+		for (auto j : w->free_jobs) {
+			delete j;
+		}
+	}
+	for (auto j : _free_jobs) {
+		delete j;
+	}
+}
+
+uint32_t
+job_system::current_worker() const
+{
+	return current_system == this ? current_index : thread_count();
+}
+
+void
+job_system::run( std::function<void()> fn, job_counter *counter )
+{
+	if (counter) {
+		counter->_count.fetch_add( 1, std::memory_order_relaxed );
+	}
+	auto index = current_worker();
+	auto j = allocate_job( index );
+	j->fn = std::move( fn );
+	j->counter = counter;
+	j->main_only = false;
+	push( j, index );
+}
+
+void
+job_system::run_on_main( std::function<void()> fn, job_counter *counter )
+{
+	if (counter) {
+		counter->_count.fetch_add( 1, std::memory_order_relaxed );
+	}
+	auto j = allocate_job( current_worker() );
+	j->fn = std::move( fn );
+	j->counter = counter;
+	j->main_only = true;
+	std::lock_guard<std::mutex> lock( _mutex );
+	_main_jobs.push_back( j );
+	_main_job_count.fetch_add( 1, std::memory_order_release );
+}
+
+void
+job_system::wait( job_counter &counter )
+{
+	auto index = current_worker();
+	uint32_t idle = 0;
+	while (!counter.done()) {
+		if (index < thread_count() && run_one( index )) {
+			idle = 0;
+		} else if (++idle > idle_spins) {
+			std::this_thread::yield();
+		}
+	}
+}
+
+void
+job_system::run_main_jobs()
+{
+	while (_main_job_count.load( std::memory_order_acquire ) > 0) {
+		job *j;
+		{
+			std::lock_guard<std::mutex> lock( _mutex );
+			if (_main_jobs.empty()) {
+				return;
+			}
+			j = _main_jobs.front();
+			_main_jobs.pop_front();
+			_main_job_count.fetch_sub( 1, std::memory_order_relaxed );
+		}
+		execute( j, 0 );
+	}
+}
+
+job_system::statistics
+job_system::stats() const
+{
+	statistics result;
+	for (auto &w : _workers) {
+		result.jobs += w->jobs.load( std::memory_order_relaxed );
+		result.steals += w->steals.load( std::memory_order_relaxed );
+	}
+	result.main_jobs = _main_jobs_run.load( std::memory_order_relaxed );
+	result.injected = _injected_count.load( std::memory_order_relaxed );
+	result.sleeps = _sleeps.load( std::memory_order_relaxed );
+	return result;
+}
+
+void
+job_system::print_statistics( std::ostream &out ) const
+{
+	auto s = stats();
+	out << "Jobs: " << s.jobs << " on " << thread_count() << " threads (" << s.main_jobs << " main-thread only), "
+		<< s.steals << " stolen, " << s.injected << " through the shared queue, " << s.sleeps << " worker sleeps"
+		<< std::endl;
+}
+
+void
+job_system::worker_main( uint32_t index )
+{
+	current_system = this;
+	current_index = index;
+	uint32_t idle = 0;
+	for (;;) {
+		if (run_one( index )) {
+			idle = 0;
+			continue;
+		}
+		if (++idle < idle_spins) {
+			continue;
+		}
+		idle = 0;
+
+		std::unique_lock<std::mutex> lock( _mutex );
+		_sleeping.fetch_add( 1 );
+		if (_quit) {
+			return;
+		}
+		if (_queued.load() <= 0) {
+			_sleeps.fetch_add( 1, std::memory_order_relaxed );
+			_wake.wait( lock, [this]() {
+				return _quit || _queued.load() > 0;
+			} );
+		}
+		_sleeping.fetch_sub( 1 );
+		if (_quit) {
+			return;
+		}
+	}
+}
+
+void
+job_system::push( job *j, uint32_t index )
+{
+	if (index >= thread_count() || !_workers[ index ]->deque.push( j )) {
+		std::lock_guard<std::mutex> lock( _mutex );
+		_injected.push_back( j );
+		_injected_size.fetch_add( 1, std::memory_order_release );
+		_injected_count.fetch_add( 1, std::memory_order_relaxed );
+	}
+	_queued.fetch_add( 1 );
+	if (_sleeping.load() > 0) {
+		// Under the lock, so that a worker between its check of _queued and
+		// its wait cannot miss the notification.
+		std::lock_guard<std::mutex> lock( _mutex );
+		_wake.notify_one();
+	}
+}
+
+bool
+job_system::run_one( uint32_t index )
+{
+	auto j = find_job( index );
+	if (!j) {
+		return false;
+	}
+	execute( j, index );
+	return true;
+}
+
+job_system::job *
+job_system::find_job( uint32_t index )
+{
+	auto &self = *_workers[ index ];
+	if (auto j = self.deque.pop<job>()) {
+		_queued.fetch_sub( 1 );
+		return j;
+	}
+	if (index == 0 && _main_job_count.load( std::memory_order_acquire ) > 0) {
+		std::lock_guard<std::mutex> lock( _mutex );
+		if (!_main_jobs.empty()) {
+			auto j = _main_jobs.front();
+			_main_jobs.pop_front();
+			_main_job_count.fetch_sub( 1, std::memory_order_relaxed );
+			return j;
+		}
+	}
+	auto count = thread_count();
+	auto start = self.victim;
+	for (uint32_t i = 0; i < count; ++i) {
+		auto victim = (start + i) % count;
+		if (victim == index) {
+			continue;
+		}
+		if (auto j = _workers[ victim ]->deque.steal<job>()) {
+			// Start there again next time: it may have more.
+			self.victim = victim;
+			self.steals.fetch_add( 1, std::memory_order_relaxed );
+			_queued.fetch_sub( 1 );
+			return j;
+		}
+	}
+	if (_injected_size.load( std::memory_order_acquire ) > 0) {
+		std::lock_guard<std::mutex> lock( _mutex );
+		if (!_injected.empty()) {
+			auto j = _injected.front();
+			_injected.pop_front();
+			_injected_size.fetch_sub( 1, std::memory_order_relaxed );
+			_queued.fetch_sub( 1 );
+			return j;
+		}
+	}
+	return nullptr;
+}
+
+void
+job_system::execute( job *j, uint32_t index )
+{
+	j->fn();
+	if (j->counter) {
+		j->counter->_count.fetch_sub( 1, std::memory_order_release );
+	}
+	_workers[ index ]->jobs.fetch_add( 1, std::memory_order_relaxed );
+	if (j->main_only) {
+		_main_jobs_run.fetch_add( 1, std::memory_order_relaxed );
+	}
+	free_job( j, index );
+}
+
+job_system::job *
+job_system::allocate_job( uint32_t index )
+{
+	if (index >= thread_count()) {
+		return new job();
+	}
+	auto &free_jobs = _workers[ index ]->free_jobs;
+	if (free_jobs.empty()) {
+		std::lock_guard<std::mutex> lock( _mutex );
+		auto take = std::min( free_batch, _free_jobs.size() );
+		free_jobs.insert( free_jobs.end(), _free_jobs.end() - take, _free_jobs.end() );
+		_free_jobs.resize( _free_jobs.size() - take );
+	}
+	if (free_jobs.empty()) {
+		return new job();
+	}
+	auto j = free_jobs.back();
+	free_jobs.pop_back();
+	return j;
+}
+
+void
+job_system::free_job( job *j, uint32_t index )
+{
+	// Drops what the function captured now rather than on reuse.
+	j->fn = nullptr;
+	auto &free_jobs = _workers[ index ]->free_jobs;
+	free_jobs.push_back( j );
+	if (free_jobs.size() > 2 * free_batch) {
+		std::lock_guard<std::mutex> lock( _mutex );
+		_free_jobs.insert( _free_jobs.end(), free_jobs.end() - free_batch, free_jobs.end() );
+		free_jobs.resize( free_jobs.size() - free_batch );
+	}
+}
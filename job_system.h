@@ -0,0 +1,155 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+// Counts the unfinished jobs started with it; see job_system::wait().
+class job_counter {
+public:
+	job_counter() = default;
+
+	job_counter( const job_counter & ) = delete;
+
+	job_counter &operator=( const job_counter & ) = delete;
+
+	bool done() const { return _count.load( std::memory_order_acquire ) == 0; }
+
+private:
+	friend class job_system;
+
+	std::atomic<uint32_t> _count{ 0 };
+};
+
+// Runs small jobs on a fixed set of threads with work stealing.
+//  - The thread that creates the system is worker 0, the main thread; it
+//    runs jobs only while it waits. The others block when idle.
+//  - Every worker pushes the jobs it starts onto its own Chase-Lev deque
+//    and pops them newest first; idle workers steal the oldest job from
+//    another worker's deque. Threads outside the system, and full deques,
+//    go through a shared locked queue instead.
+//  - Jobs started with run_on_main() only ever run on the main thread, for
+//    calls such as GLFW's that are tied to it.
+//  - Dependencies are expressed with counters: wait() for a counter runs
+//    other jobs, on any worker, until the counter's jobs have finished.
+class job_system {
+public:
+	struct statistics {
+		// Jobs run, of which main_jobs were main-thread only.
+		uint64_t jobs = 0;
+		uint64_t main_jobs = 0;
+		uint64_t steals = 0;
+		// Jobs that went through the shared queue.
+		uint64_t injected = 0;
+		// Times a worker went to sleep for lack of work.
+		uint64_t sleeps = 0;
+	};
+
+	explicit job_system( uint32_t thread_count );
+
+	~job_system();
+
+	job_system( const job_system & ) = delete;
+
+	job_system &operator=( const job_system & ) = delete;
+
+	uint32_t thread_count() const { return ( uint32_t ) _workers.size(); }
+
+	// Index of the calling thread in [0, thread_count()), or thread_count()
+	// for threads outside of the system.
+	uint32_t current_worker() const;
+
+	// Starts `fn`, on any worker; `counter`, if given, is incremented now
+	// and decremented once `fn` has returned.
+	void run( std::function<void()> fn, job_counter *counter = nullptr );
+
+	void run_on_main( std::function<void()> fn, job_counter *counter = nullptr );
+
+	// Calls fn( begin, end ) for consecutive ranges of at most `grain`
+	// items covering [0, count), as jobs, and waits for them.
+	template <typename Fn>
+	void parallel_for( uint32_t count, uint32_t grain, const Fn &fn );
+
+	// Runs jobs until the counter's jobs are done. On a thread outside of
+	// the system, blocks without running any.
+	void wait( job_counter &counter );
+
+	// Runs the main-thread jobs queued so far; call from the main thread.
+	void run_main_jobs();
+
+	statistics stats() const;
+
+	void print_statistics( std::ostream &out ) const;
+
+private:
+	struct job;
+
+	struct worker;
+
+	void worker_main( uint32_t index );
+
+	void push( job *j, uint32_t index );
+
+	// Pops, steals or dequeues one job for the worker and runs it; returns
+	// false if there was none.
+	bool run_one( uint32_t index );
+
+	job *find_job( uint32_t index );
+
+	void execute( job *j, uint32_t index );
+
+	// Jobs are recycled through per-worker free lists, which trade batches
+	// with a shared one, so that steady-state frames do not allocate.
+	job *allocate_job( uint32_t index );
+
+	void free_job( job *j, uint32_t index );
+
+	std::vector<std::unique_ptr<worker>> _workers;
+	std::vector<std::thread> _threads;
+
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::deque<job *> _injected;
+	std::deque<job *> _main_jobs;
+	std::vector<job *> _free_jobs;
+	// Jobs pushed but not yet taken, and workers asleep on _wake; each side
+	// checks the other's after changing its own, so a push cannot miss a
+	// worker that is about to sleep.
+	std::atomic<int64_t> _queued{ 0 };
+	std::atomic<uint32_t> _sleeping{ 0 };
+	// Sizes of _main_jobs and _injected, checked before taking the lock.
+	std::atomic<size_t> _main_job_count{ 0 };
+	std::atomic<size_t> _injected_size{ 0 };
+	bool _quit = false;
+	std::atomic<uint64_t> _main_jobs_run{ 0 };
+	std::atomic<uint64_t> _injected_count{ 0 };
+	std::atomic<uint64_t> _sleeps{ 0 };
+};
+
+template <typename Fn>
+void
+job_system::parallel_for( uint32_t count, uint32_t grain, const Fn &fn )
+{
+	if (grain == 0) {
+		grain = 1;
+	}
+	job_counter counter;
+	// The first range runs on the calling thread, which would otherwise
+	// only wait. The jobs capture little enough for std::function to store
+	// them without allocating.
+	for (uint32_t begin = grain; begin < count; begin += grain) {
+		auto end = count - begin > grain ? begin + grain : count;
+		run( [&fn, begin, end]() {
+			fn( begin, end );
+		}, &counter );
+	}
+	fn( 0, count < grain ? count : grain );
+	wait( counter );
+}
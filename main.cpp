@@ -1,10 +1,78 @@
 #include <iostream>
+#include <cstring>
+#include <string>
 #include "window.h"
 
 int
-main()
-{ {
-		window window{ 800, 600, "Vulkan Test" };
+main( int argc, char **argv )
+{
+	window_config config;
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp( argv[ i ], "--frames-in-flight" ) == 0 && i + 1 < argc) {
+			config.frames_in_flight = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--headless" ) == 0) {
+			config.headless = true;
+		} else if (std::strcmp( argv[ i ], "--frames" ) == 0 && i + 1 < argc) {
+			config.max_frames = std::stoull( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--threads" ) == 0 && i + 1 < argc) {
+			config.record_threads = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--draws" ) == 0 && i + 1 < argc) {
+			config.draw_count = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--watch-shaders" ) == 0 && i + 1 < argc) {
+			config.watch_shader_dir = argv[ ++i ];
+		} else if (std::strcmp( argv[ i ], "--shader-dir" ) == 0 && i + 1 < argc) {
+			config.shader_dir = argv[ ++i ];
+		} else if (std::strcmp( argv[ i ], "--mesh" ) == 0 && i + 1 < argc) {
+			config.mesh_path = argv[ ++i ];
+		} else if (std::strcmp( argv[ i ], "--vertex-layout" ) == 0 && i + 1 < argc) {
+			if (!parse_vertex_layout( argv[ ++i ], config.vertex_layout )) {
+				std::cout << "unknown vertex layout: " << argv[ i ] << "\n";
+				return 1;
+			}
+		} else if (std::strcmp( argv[ i ], "--depth-prepass" ) == 0) {
+			config.depth_prepass = true;
+		} else if (std::strcmp( argv[ i ], "--cull" ) == 0) {
+			config.gpu_culling = true;
+		} else if (std::strcmp( argv[ i ], "--instances" ) == 0 && i + 1 < argc) {
+			config.instances_per_draw = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--variants" ) == 0 && i + 1 < argc) {
+			config.pipeline_variants = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--layers" ) == 0 && i + 1 < argc) {
+			config.depth_layers = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--no-sort" ) == 0) {
+			config.sort_draws = false;
+		} else if (std::strcmp( argv[ i ], "--texture" ) == 0 && i + 1 < argc) {
+			config.texture_paths.push_back( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--texture-budget" ) == 0 && i + 1 < argc) {
+			config.texture_budget = std::stoull( argv[ ++i ] ) << 20;
+		} else if (std::strcmp( argv[ i ], "--low-latency" ) == 0) {
+			config.low_latency = true;
+		} else if (std::strcmp( argv[ i ], "--max-queued" ) == 0 && i + 1 < argc) {
+			config.max_queued_frames = ( uint32_t ) std::stoul( argv[ ++i ] );
+		} else if (std::strcmp( argv[ i ], "--latency-sleep" ) == 0) {
+			config.latency_sleep = true;
+		} else {
+			std::cout << "usage: " << argv[ 0 ] << " [--frames-in-flight N] [--headless] [--frames N]\n"
+			          << "\t[--threads N] [--draws N] [--instances N] [--cull] [--mesh file.mesh]\n"
+			          << "\t[--vertex-layout interleaved|split|packed] [--depth-prepass]\n"
+			          << "\t[--shader-dir dir] [--watch-shaders glsl-dir] [--variants N] [--layers N] [--no-sort]\n"
+			          << "\t[--texture file.ktx2|file.png]... [--texture-budget MiB]\n"
+			          << "\t[--low-latency [--max-queued N] [--latency-sleep]]\n";
+			return 1;
+		}
+	}
+
+	if (config.latency_sleep && !config.low_latency) {
+		std::cout << "--latency-sleep requires --low-latency\n";
+		return 1;
+	}
+	if (config.headless && config.max_frames == 0) {
+		std::cout << "--headless requires --frames N\n";
+		return 1;
+	}
+
+	{
+		window window{ 800, 600, "Vulkan Test", config };
 
 		window.run();
 	}
@@ -0,0 +1,135 @@
+#include "mesh.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+uint32_t
+mesh_format_size( mesh_format format )
+{
+	switch (format) {
+	case mesh_format::float32x2:
+		return 8;
+	case mesh_format::float32x3:
+		return 12;
+	case mesh_format::float32x4:
+		return 16;
+	case mesh_format::unorm8x4:
+		return 4;
+	}
+	return 0;
+}
+
+static uint64_t
+align_blob( uint64_t offset )
+{
+	return (offset + mesh_blob_alignment - 1) / mesh_blob_alignment * mesh_blob_alignment;
+}
+
+mesh_file::mesh_file( const char *path )
+	: _file( path )
+{
+	auto fail = [&]( const char *what ) {
+		throw std::runtime_error( std::string( path ) + ": " + what );
+	};
+	if (_file.size() < sizeof(mesh_header)) {
+		fail( "too small for a mesh header" );
+	}
+	auto &h = header();
+	if (h.magic != mesh_magic || h.version != mesh_version) {
+		fail( "not a version 1 mesh file" );
+	}
+	if (h.index_size != 2 && h.index_size != 4) {
+		fail( "index size must be 2 or 4" );
+	}
+	if (sizeof(mesh_header) + ( uint64_t ) h.attribute_count * sizeof(mesh_attribute) > _file.size()) {
+		fail( "truncated attribute table" );
+	}
+	for (uint32_t i = 0; i < h.attribute_count; ++i) {
+		auto &attribute = attributes()[ i ];
+		auto size = mesh_format_size( attribute.format );
+		if (size == 0 || ( uint64_t ) attribute.offset + size > h.vertex_stride) {
+			fail( "attribute outside of the vertex" );
+		}
+	}
+
+	// Both end up in GPU buffers, which cannot be empty.
+	if (h.vertex_count == 0 || h.index_count == 0) {
+		fail( "mesh without vertices or indices" );
+	}
+
+	// Divisions instead of multiplications so huge counts cannot overflow.
+	auto fits = [&]( uint64_t offset, uint64_t count, uint64_t element_size ) {
+		return offset % mesh_blob_alignment == 0 && offset <= _file.size()
+			&& (element_size == 0 || count <= (_file.size() - offset) / element_size);
+	};
+	if (!fits( h.vertex_offset, h.vertex_count, h.vertex_stride )) {
+		fail( "vertex blob outside of the file" );
+	}
+	if (!fits( h.index_offset, h.index_count, h.index_size )) {
+		fail( "index blob outside of the file" );
+	}
+}
+
+const mesh_attribute *
+mesh_file::find_attribute( mesh_semantic semantic ) const
+{
+	for (uint32_t i = 0; i < header().attribute_count; ++i) {
+		if (attributes()[ i ].semantic == semantic) {
+			return &attributes()[ i ];
+		}
+	}
+	return nullptr;
+}
+
+float
+mesh_file::bounding_radius() const
+{
+	float squared = 0;
+	for (int corner = 0; corner < 8; ++corner) {
+		float d = 0;
+		for (int axis = 0; axis < 3; ++axis) {
+			float v = (corner >> axis) & 1 ? header().bounds_max[ axis ] : header().bounds_min[ axis ];
+			d += v * v;
+		}
+		squared = std::max( squared, d );
+	}
+	return std::sqrt( squared );
+}
+
+void
+write_mesh( const char *path, const mesh_attribute *attributes, uint32_t attribute_count, uint32_t vertex_stride,
+            const void *vertices, uint64_t vertex_count, const void *indices, uint64_t index_count,
+            uint32_t index_size, const float bounds_min[3], const float bounds_max[3] )
+{
+	mesh_header h = {};
+	h.magic = mesh_magic;
+	h.version = mesh_version;
+	h.attribute_count = attribute_count;
+	h.vertex_stride = vertex_stride;
+	h.vertex_count = vertex_count;
+	h.vertex_offset = align_blob( sizeof(mesh_header) + attribute_count * sizeof(mesh_attribute) );
+	h.index_count = index_count;
+	h.index_size = index_size;
+	h.index_offset = align_blob( h.vertex_offset + vertex_count * vertex_stride );
+	std::copy( bounds_min, bounds_min + 3, h.bounds_min );
+	std::copy( bounds_max, bounds_max + 3, h.bounds_max );
+
+	std::ofstream file{ path, std::ios::binary | std::ios::trunc };
+	const char padding[ mesh_blob_alignment ] = {};
+	auto pad_to = [&]( uint64_t offset ) {
+		file.write( padding, offset - ( uint64_t ) file.tellp() );
+	};
+	file.write( reinterpret_cast<const char *>( &h ), sizeof(h) );
+	file.write( reinterpret_cast<const char *>( attributes ), attribute_count * sizeof(mesh_attribute) );
+	pad_to( h.vertex_offset );
+	file.write( static_cast<const char *>( vertices ), vertex_count * vertex_stride );
+	pad_to( h.index_offset );
+	file.write( static_cast<const char *>( indices ), index_count * index_size );
+	file.flush();
+	if (!file) {
+		throw std::runtime_error( std::string( "failed to write " ) + path );
+	}
+}
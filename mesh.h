@@ -0,0 +1,92 @@
+#pragma once
+
+#include "utils.h"
+#include <cstdint>
+
+// Binary mesh files (.mesh). All fields are little-endian; the blobs can be
+// handed to the GPU as they are, without per-vertex parsing:
+//
+//   mesh_header
+//   mesh_attribute[ attribute_count ]
+//   vertex blob: vertex_count * vertex_stride bytes at vertex_offset
+//   index blob: index_count * index_size bytes at index_offset
+//
+// Both blob offsets are multiples of mesh_blob_alignment.
+constexpr uint32_t mesh_magic = 0x314d4b56; // "VKM1"
+constexpr uint32_t mesh_version = 1;
+constexpr uint64_t mesh_blob_alignment = 16;
+
+enum class mesh_semantic : uint32_t {
+	position = 0,
+	color = 1,
+	normal = 2,
+	texcoord = 3,
+};
+
+enum class mesh_format : uint32_t {
+	float32x2 = 0,
+	float32x3 = 1,
+	float32x4 = 2,
+	unorm8x4 = 3,
+};
+
+struct mesh_attribute {
+	mesh_semantic semantic;
+	mesh_format format;
+	uint32_t offset;
+	uint32_t reserved;
+};
+
+struct mesh_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t attribute_count;
+	uint32_t vertex_stride;
+	uint64_t vertex_count;
+	uint64_t vertex_offset;
+	uint64_t index_count;
+	uint64_t index_offset;
+	// 2 or 4 bytes; 16-bit indices are used whenever the vertex count allows.
+	uint32_t index_size;
+	uint32_t reserved;
+	float bounds_min[3];
+	float bounds_max[3];
+};
+
+uint32_t mesh_format_size( mesh_format format );
+
+// A mesh file mapped into memory. The constructor validates the header and
+// blob ranges and throws std::runtime_error on a malformed file.
+class mesh_file {
+public:
+	explicit mesh_file( const char *path );
+
+	const mesh_header &header() const { return *reinterpret_cast<const mesh_header *>( _file.data() ); }
+
+	const mesh_attribute *attributes() const
+	{
+		return reinterpret_cast<const mesh_attribute *>( _file.data() + sizeof(mesh_header) );
+	}
+
+	// Returns nullptr if the mesh has no attribute with this semantic.
+	const mesh_attribute *find_attribute( mesh_semantic semantic ) const;
+
+	const void *vertex_data() const { return _file.data() + header().vertex_offset; }
+
+	uint64_t vertex_bytes() const { return header().vertex_count * header().vertex_stride; }
+
+	const void *index_data() const { return _file.data() + header().index_offset; }
+
+	uint64_t index_bytes() const { return header().index_count * header().index_size; }
+
+	// Distance from the origin to the farthest corner of the bounds.
+	float bounding_radius() const;
+
+private:
+	mapped_file _file;
+};
+
+// Writes a mesh file from tightly packed vertex and index data.
+void write_mesh( const char *path, const mesh_attribute *attributes, uint32_t attribute_count,
+                 uint32_t vertex_stride, const void *vertices, uint64_t vertex_count, const void *indices,
+                 uint64_t index_count, uint32_t index_size, const float bounds_min[3], const float bounds_max[3] );
@@ -0,0 +1,210 @@
+#include "pso_cache.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+namespace {
+
+// FNV-1a.
+struct hasher {
+	uint64_t value = 14695981039346656037ull;
+
+	void add( const void *data, size_t size )
+	{
+		auto bytes = static_cast<const uint8_t *>( data );
+		for (size_t i = 0; i < size; ++i) {
+			value = (value ^ bytes[ i ]) * 1099511628211ull;
+		}
+	}
+
+	template<typename T>
+	void add( const T &value )
+	{
+		add( &value, sizeof(value) );
+	}
+
+	void add( const std::string &value )
+	{
+		add( value.size() );
+		add( value.data(), value.size() );
+	}
+};
+
+}
+
+uint64_t
+pipeline_description::hash() const
+{
+	hasher h;
+	h.add( vertex_shader );
+	h.add( fragment_shader );
+	h.add( shader_override_dir );
+	h.add( shader_generation );
+	for (auto &binding : vertex_bindings) {
+		h.add( binding.binding );
+		h.add( binding.stride );
+		h.add( binding.inputRate );
+	}
+	for (auto &attribute : vertex_attributes) {
+		h.add( attribute.location );
+		h.add( attribute.binding );
+		h.add( attribute.format );
+		h.add( attribute.offset );
+	}
+	h.add( topology );
+	h.add( polygon_mode );
+	h.add( static_cast<VkCullModeFlags>( cull_mode ) );
+	h.add( front_face );
+	h.add( color_write );
+	h.add( blend_enable );
+	h.add( src_color_blend );
+	h.add( dst_color_blend );
+	h.add( depth_test );
+	h.add( depth_write );
+	h.add( depth_compare );
+	h.add( color_format );
+	h.add( depth_format );
+	return h.value;
+}
+
+bool
+pipeline_description::operator==( const pipeline_description &other ) const
+{
+	return vertex_shader == other.vertex_shader && fragment_shader == other.fragment_shader
+		&& shader_override_dir == other.shader_override_dir && shader_generation == other.shader_generation
+		&& vertex_bindings == other.vertex_bindings && vertex_attributes == other.vertex_attributes
+		&& topology == other.topology && polygon_mode == other.polygon_mode && cull_mode == other.cull_mode
+		&& front_face == other.front_face && color_write == other.color_write && blend_enable == other.blend_enable
+		&& src_color_blend == other.src_color_blend && dst_color_blend == other.dst_color_blend
+		&& depth_test == other.depth_test && depth_write == other.depth_write && depth_compare == other.depth_compare
+		&& color_format == other.color_format && depth_format == other.depth_format;
+}
+
+void
+pso_cache::create( vk::Device device, uint32_t thread_count, builder build )
+{
+	_device = device;
+	_build = std::move( build );
+	_quit = false;
+	for (uint32_t i = 0; i < thread_count; ++i) {
+		_threads.emplace_back( &pso_cache::worker_main, this );
+	}
+}
+
+void
+pso_cache::destroy()
+{
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		_quit = true;
+		_queue.clear();
+	}
+	_work.notify_all();
+	for (auto &thread : _threads) {
+		thread.join();
+	}
+	_threads.clear();
+	for (auto &e : _entries) {
+		if (e.second->pipeline) {
+			_device.destroyPipeline( e.second->pipeline );
+		}
+	}
+	_entries.clear();
+}
+
+vk::Pipeline
+pso_cache::request( const pipeline_description &description )
+{
+	auto key = description.hash();
+	std::lock_guard<std::mutex> lock( _mutex );
+	auto range = _entries.equal_range( key );
+	for (auto it = range.first; it != range.second; ++it) {
+		auto &e = *it->second;
+		if (e.description == description) {
+			if (e.state == entry_state::ready) {
+				_stats.hits++;
+				return e.pipeline;
+			}
+			if (e.state == entry_state::queued) {
+				_stats.pending++;
+			}
+			return vk::Pipeline();
+		}
+	}
+
+	_stats.misses++;
+	std::unique_ptr<entry> e( new entry );
+	e->description = description;
+	_queue.push_back( e.get() );
+	_entries.emplace( key, std::move( e ) );
+	_work.notify_one();
+	return vk::Pipeline();
+}
+
+void
+pso_cache::wait_idle()
+{
+	std::unique_lock<std::mutex> lock( _mutex );
+	_idle.wait( lock, [this]() {
+		return _queue.empty() && _busy == 0;
+	} );
+}
+
+void
+pso_cache::worker_main()
+{
+	std::unique_lock<std::mutex> lock( _mutex );
+	for (;;) {
+		_work.wait( lock, [this]() {
+			return _quit || !_queue.empty();
+		} );
+		if (_quit) {
+			return;
+		}
+		auto e = _queue.front();
+		_queue.pop_front();
+		_busy++;
+
+		// Entries are never removed while the workers run, so `e` stays
+		// valid without the lock; its description is immutable.
+		lock.unlock();
+		const auto start = std::chrono::steady_clock::now();
+		vk::Pipeline pipeline;
+		try {
+			pipeline = _build( e->description );
+		} catch (const std::exception &ex) {
+			std::cout << "Pipeline compile failed: " << ex.what() << std::endl;
+		}
+		double ms = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+		lock.lock();
+
+		e->pipeline = pipeline;
+		e->state = pipeline ? entry_state::ready : entry_state::failed;
+		if (pipeline) {
+			_stats.compiled++;
+			_stats.compile_ms_total += ms;
+			_stats.compile_ms_max = std::max( _stats.compile_ms_max, ms );
+		} else {
+			_stats.failed++;
+		}
+		if (--_busy == 0 && _queue.empty()) {
+			_idle.notify_all();
+		}
+	}
+}
+
+pso_cache::statistics
+pso_cache::stats() const
+{
+	std::lock_guard<std::mutex> lock( _mutex );
+	return _stats;
+}
+
+void
+pso_cache::print_statistics( std::ostream &out ) const
+{
+	auto s = stats();
+	out << "PSO cache: " << s.hits << " hits, " << s.misses << " misses, " << s.pending << " requests while compiling, "
+		<< s.compiled << " compiled (" << s.compile_ms_total << " ms total, " << s.compile_ms_max << " ms max), "
+		<< s.failed << " failed\n";
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "vulkan.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Everything that decides which graphics pipeline a draw needs. Render pass
+// compatibility is reduced to the attachment formats.
+struct pipeline_description {
+	std::string vertex_shader;
+	// Empty for a depth-only pipeline.
+	std::string fragment_shader;
+	// Directory searched for the modules before the regular shader path.
+	std::string shader_override_dir;
+	// Bumped on shader hot reload so stale pipelines are not reused.
+	uint32_t shader_generation = 0;
+
+	std::vector<vk::VertexInputBindingDescription> vertex_bindings;
+	std::vector<vk::VertexInputAttributeDescription> vertex_attributes;
+	vk::PrimitiveTopology topology = vk::PrimitiveTopology::eTriangleList;
+
+	vk::PolygonMode polygon_mode = vk::PolygonMode::eFill;
+	vk::CullModeFlags cull_mode = vk::CullModeFlagBits::eBack;
+	vk::FrontFace front_face = vk::FrontFace::eClockwise;
+
+	bool color_write = true;
+	bool blend_enable = false;
+	vk::BlendFactor src_color_blend = vk::BlendFactor::eOne;
+	vk::BlendFactor dst_color_blend = vk::BlendFactor::eZero;
+
+	bool depth_test = true;
+	bool depth_write = true;
+	vk::CompareOp depth_compare = vk::CompareOp::eLess;
+
+	vk::Format color_format = vk::Format::eUndefined;
+	vk::Format depth_format = vk::Format::eUndefined;
+
+	uint64_t hash() const;
+
+	bool operator==( const pipeline_description &other ) const;
+};
+
+// In-memory cache of graphics pipelines keyed by pipeline_description.
+// Misses are compiled on worker threads; identical requests share one
+// compile. request() never blocks on a compile.
+class pso_cache {
+public:
+	struct statistics {
+		// Requests answered with a ready pipeline.
+		uint64_t hits = 0;
+		// First requests for a description, which queue a compile.
+		uint64_t misses = 0;
+		// Requests for a description that is still compiling.
+		uint64_t pending = 0;
+		uint64_t compiled = 0;
+		uint64_t failed = 0;
+		double compile_ms_total = 0;
+		double compile_ms_max = 0;
+	};
+
+	// Builds a pipeline; called on the worker threads and may throw.
+	using builder = std::function<vk::Pipeline( const pipeline_description & )>;
+
+	void create( vk::Device device, uint32_t thread_count, builder build );
+
+	// Joins the workers and destroys every cached pipeline; the device must
+	// be idle.
+	void destroy();
+
+	// Returns the pipeline, or a null handle while it is compiling or if
+	// its compile failed.
+	vk::Pipeline request( const pipeline_description &description );
+
+	// Blocks until every queued compile has finished.
+	void wait_idle();
+
+	statistics stats() const;
+
+	void print_statistics( std::ostream &out ) const;
+
+private:
+	enum class entry_state {
+		queued,
+		ready,
+		failed,
+	};
+
+	struct entry {
+		pipeline_description description;
+		entry_state state = entry_state::queued;
+		vk::Pipeline pipeline;
+	};
+
+	void worker_main();
+
+	vk::Device _device;
+	builder _build;
+	mutable std::mutex _mutex;
+	std::condition_variable _work;
+	std::condition_variable _idle;
+	std::unordered_multimap<uint64_t, std::unique_ptr<entry>> _entries;
+	std::deque<entry *> _queue;
+	std::vector<std::thread> _threads;
+	// Compiles taken off the queue and not finished yet.
+	uint32_t _busy = 0;
+	bool _quit = false;
+	statistics _stats;
+};
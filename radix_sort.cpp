@@ -0,0 +1,42 @@
+#include "radix_sort.h"
+#include <utility>
+
+void
+radix_sort( std::vector<uint64_t> &keys, std::vector<uint64_t> &scratch )
+{
+	constexpr int digits = 8;
+	const size_t count = keys.size();
+	scratch.resize( count );
+
+	// All histograms in one read over the keys; 16 KiB on the stack, as
+	// this runs every frame.
+	size_t histograms[digits * 256] = {};
+	for (auto key : keys) {
+		for (int d = 0; d < digits; ++d) {
+			histograms[ d * 256 + ((key >> (d * 8)) & 0xff) ]++;
+		}
+	}
+
+	auto *src = &keys;
+	auto *dst = &scratch;
+	for (int d = 0; d < digits; ++d) {
+		size_t *histogram = &histograms[ d * 256 ];
+		if (count == 0 || histogram[ (( *src )[ 0 ] >> (d * 8)) & 0xff ] == count) {
+			continue;
+		}
+
+		size_t offset = 0;
+		for (int b = 0; b < 256; ++b) {
+			size_t n = histogram[ b ];
+			histogram[ b ] = offset;
+			offset += n;
+		}
+		for (auto key : *src) {
+			( *dst )[ histogram[ (key >> (d * 8)) & 0xff ]++ ] = key;
+		}
+		std::swap( src, dst );
+	}
+	if (src != &keys) {
+		keys.swap( scratch );
+	}
+}
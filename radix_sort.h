@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Sorts 64-bit keys ascending with an LSD radix sort over 8-bit digits.
+// Digits that are the same in every key are skipped, so keys that only use
+// their low bits cost fewer passes. `scratch` is resized as needed; once it
+// has grown to the key count, a call does not allocate.
+void radix_sort( std::vector<uint64_t> &keys, std::vector<uint64_t> &scratch );
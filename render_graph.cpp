@@ -0,0 +1,837 @@
+#include "render_graph.h"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+static vk::ImageAspectFlags
+aspect_of( vk::Format format )
+{
+	switch (format) {
+	case vk::Format::eD16Unorm:
+	case vk::Format::eX8D24UnormPack32:
+	case vk::Format::eD32Sfloat:
+		return vk::ImageAspectFlagBits::eDepth;
+	case vk::Format::eD16UnormS8Uint:
+	case vk::Format::eD24UnormS8Uint:
+	case vk::Format::eD32SfloatS8Uint:
+		return vk::ImageAspectFlagBits::eDepth | vk::ImageAspectFlagBits::eStencil;
+	default:
+		return vk::ImageAspectFlagBits::eColor;
+	}
+}
+
+static vk::ImageUsageFlags
+usage_of( vk::ImageLayout layout )
+{
+	switch (layout) {
+	case vk::ImageLayout::eShaderReadOnlyOptimal:
+	case vk::ImageLayout::eDepthStencilReadOnlyOptimal:
+		return vk::ImageUsageFlagBits::eSampled;
+	case vk::ImageLayout::eGeneral:
+		return vk::ImageUsageFlagBits::eStorage;
+	case vk::ImageLayout::eTransferSrcOptimal:
+		return vk::ImageUsageFlagBits::eTransferSrc;
+	case vk::ImageLayout::eTransferDstOptimal:
+		return vk::ImageUsageFlagBits::eTransferDst;
+	default:
+		return vk::ImageUsageFlags();
+	}
+}
+
+static bool
+contains( vk::PipelineStageFlags set, vk::PipelineStageFlags flags )
+{
+	return (set & flags) == flags;
+}
+
+static bool
+contains( vk::AccessFlags set, vk::AccessFlags flags )
+{
+	return (set & flags) == flags;
+}
+
+render_graph::pass_builder &
+render_graph::pass_builder::color_attachment( resource image )
+{
+	access a;
+	a.id = image;
+	a.stages = vk::PipelineStageFlagBits::eColorAttachmentOutput;
+	a.access_mask = vk::AccessFlagBits::eColorAttachmentRead | vk::AccessFlagBits::eColorAttachmentWrite;
+	a.layout = vk::ImageLayout::eColorAttachmentOptimal;
+	a.write = true;
+	a.attachment = attachment_kind::color;
+	return _graph.add_access( *this, a );
+}
+
+render_graph::pass_builder &
+render_graph::pass_builder::color_attachment( resource image, vk::ClearColorValue clear )
+{
+	color_attachment( image );
+	auto &a = _graph._passes[ _pass ].accesses.back();
+	a.clear = true;
+	a.clear_value.setColor( clear );
+	return *this;
+}
+
+render_graph::pass_builder &
+render_graph::pass_builder::depth_attachment( resource image )
+{
+	access a;
+	a.id = image;
+	a.stages = vk::PipelineStageFlagBits::eEarlyFragmentTests | vk::PipelineStageFlagBits::eLateFragmentTests;
+	a.access_mask = vk::AccessFlagBits::eDepthStencilAttachmentRead
+		| vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+	a.layout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
+	a.write = true;
+	a.attachment = attachment_kind::depth;
+	return _graph.add_access( *this, a );
+}
+
+render_graph::pass_builder &
+render_graph::pass_builder::depth_attachment( resource image, vk::ClearDepthStencilValue clear )
+{
+	depth_attachment( image );
+	auto &a = _graph._passes[ _pass ].accesses.back();
+	a.clear = true;
+	a.clear_value.setDepthStencil( clear );
+	return *this;
+}
+
+render_graph::pass_builder &
+render_graph::pass_builder::read_buffer( resource buffer, vk::PipelineStageFlags stages, vk::AccessFlags access_mask )
+{
+	access a;
+	a.id = buffer;
+	a.stages = stages;
+	a.access_mask = access_mask;
+	return _graph.add_access( *this, a );
+}
+
+render_graph::pass_builder &
+render_graph::pass_builder::write_buffer( resource buffer, vk::PipelineStageFlags stages, vk::AccessFlags access_mask )
+{
+	access a;
+	a.id = buffer;
+	a.stages = stages;
+	a.access_mask = access_mask;
+	a.write = true;
+	return _graph.add_access( *this, a );
+}
+
+render_graph::pass_builder &
+render_graph::pass_builder::read_image( resource image, vk::PipelineStageFlags stages, vk::AccessFlags access_mask,
+                                        vk::ImageLayout layout )
+{
+	access a;
+	a.id = image;
+	a.stages = stages;
+	a.access_mask = access_mask;
+	a.layout = layout;
+	return _graph.add_access( *this, a );
+}
+
+render_graph::pass_builder &
+render_graph::pass_builder::write_image( resource image, vk::PipelineStageFlags stages, vk::AccessFlags access_mask,
+                                         vk::ImageLayout layout )
+{
+	access a;
+	a.id = image;
+	a.stages = stages;
+	a.access_mask = access_mask;
+	a.layout = layout;
+	a.write = true;
+	return _graph.add_access( *this, a );
+}
+
+render_graph::pass_builder &
+render_graph::pass_builder::side_effects()
+{
+	_graph._passes[ _pass ].side_effects = true;
+	return *this;
+}
+
+render_graph::pass_builder &
+render_graph::pass_builder::secondary_command_buffers()
+{
+	_graph._passes[ _pass ].secondary = true;
+	return *this;
+}
+
+render_graph::pass_builder &
+render_graph::add_access( pass_builder &builder, const access &a )
+{
+	if (a.id >= _resources.size()) {
+		throw std::runtime_error( std::string( "render graph: pass " ) + _passes[ builder._pass ].name
+		                          + " uses an unknown resource" );
+	}
+	if (_resources[ a.id ].is_image != (a.layout != vk::ImageLayout::eUndefined)) {
+		throw std::runtime_error( std::string( "render graph: pass " ) + _passes[ builder._pass ].name + " uses "
+		                          + _resources[ a.id ].name + " as the wrong kind of resource" );
+	}
+	_passes[ builder._pass ].accesses.push_back( a );
+	return builder;
+}
+
+void
+render_graph::create( vk::PhysicalDevice physical_device, vk::Device device, device_allocator &allocator )
+{
+	_device = device;
+	_allocator = &allocator;
+	_memory_properties = physical_device.getMemoryProperties();
+}
+
+void
+render_graph::destroy()
+{
+	for (auto &render_pass : _render_passes) {
+		_device.destroyRenderPass( render_pass.second );
+	}
+	_render_passes.clear();
+}
+
+render_graph::resource
+render_graph::import_image( std::string name, vk::Format format, vk::Extent2D extent, vk::ImageLayout initial_layout,
+                            vk::ImageLayout final_layout, vk::PipelineStageFlags initial_stages )
+{
+	resource_info r;
+	r.name = std::move( name );
+	r.is_image = true;
+	r.imported = true;
+	r.format = format;
+	r.extent = extent;
+	r.initial_layout = initial_layout;
+	r.final_layout = final_layout;
+	r.initial_stages = initial_stages;
+	_resources.push_back( r );
+	return ( resource ) _resources.size() - 1;
+}
+
+render_graph::resource
+render_graph::import_buffer( std::string name, vk::PipelineStageFlags final_stages, vk::AccessFlags final_access )
+{
+	resource_info r;
+	r.name = std::move( name );
+	r.imported = true;
+	r.final_stages = final_stages;
+	r.final_access = final_access;
+	_resources.push_back( r );
+	return ( resource ) _resources.size() - 1;
+}
+
+render_graph::resource
+render_graph::create_image( std::string name, vk::Format format, vk::Extent2D extent )
+{
+	resource_info r;
+	r.name = std::move( name );
+	r.is_image = true;
+	r.format = format;
+	r.extent = extent;
+	_resources.push_back( r );
+	return ( resource ) _resources.size() - 1;
+}
+
+render_graph::pass_builder
+render_graph::add_pass( const char *name, vk::PipelineBindPoint bind_point, record_fn record )
+{
+	pass p;
+	p.name = name;
+	p.bind_point = bind_point;
+	p.record = std::move( record );
+	_passes.push_back( std::move( p ) );
+	return pass_builder( *this, ( uint32_t ) _passes.size() - 1 );
+}
+
+void
+render_graph::set_pass_hooks( begin_hook begin, end_hook end )
+{
+	_begin_hook = std::move( begin );
+	_end_hook = std::move( end );
+}
+
+void
+render_graph::compile()
+{
+	_stats = statistics();
+	_stats.passes = ( uint32_t ) _passes.size();
+	cull_passes();
+	create_transient_images();
+	place_barriers();
+}
+
+void
+render_graph::cull_passes()
+{
+	// Walk backwards: a pass survives if it writes something that outlives
+	// the frame or that a surviving pass reads.
+	std::vector<bool> needed( _resources.size(), false );
+	for (uint32_t i = ( uint32_t ) _passes.size(); i-- > 0;) {
+		auto &p = _passes[ i ];
+		bool alive = p.side_effects;
+		for (auto &a : p.accesses) {
+			if (a.write && (_resources[ a.id ].imported || needed[ a.id ])) {
+				alive = true;
+			}
+		}
+		p.culled = !alive;
+		if (!alive) {
+			_stats.culled_passes++;
+			continue;
+		}
+		for (auto &a : p.accesses) {
+			// Attachments that are not cleared load what earlier passes wrote.
+			if (!a.write || (a.attachment != attachment_kind::none && !a.clear)) {
+				needed[ a.id ] = true;
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < _passes.size(); ++i) {
+		if (_passes[ i ].culled) {
+			continue;
+		}
+		for (auto &a : _passes[ i ].accesses) {
+			auto &r = _resources[ a.id ];
+			r.first_use = std::min( r.first_use, i );
+			r.last_use = std::max( r.last_use, i );
+		}
+	}
+}
+
+uint32_t
+render_graph::find_memory_type( uint32_t type_bits, bool lazy ) const
+{
+	auto wanted = vk::MemoryPropertyFlags( vk::MemoryPropertyFlagBits::eDeviceLocal );
+	if (lazy) {
+		wanted |= vk::MemoryPropertyFlagBits::eLazilyAllocated;
+	}
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		for (uint32_t i = 0; i < _memory_properties.memoryTypeCount; ++i) {
+			if ((type_bits & (1u << i)) && (_memory_properties.memoryTypes[ i ].propertyFlags & wanted) == wanted) {
+				return i;
+			}
+		}
+		wanted = vk::MemoryPropertyFlagBits::eDeviceLocal;
+	}
+	throw std::runtime_error( "render graph: no device-local memory type for a transient image" );
+}
+
+void
+render_graph::create_transient_images()
+{
+	std::vector<resource> images;
+	for (resource id = 0; id < _resources.size(); ++id) {
+		auto &r = _resources[ id ];
+		if (r.imported || !r.is_image || r.first_use == ~0u) {
+			continue;
+		}
+
+		bool attachment_only = true;
+		for (uint32_t i = r.first_use; i <= r.last_use; ++i) {
+			if (_passes[ i ].culled) {
+				continue;
+			}
+			for (auto &a : _passes[ i ].accesses) {
+				if (a.id != id) {
+					continue;
+				}
+				if (a.attachment == attachment_kind::color) {
+					r.usage |= vk::ImageUsageFlagBits::eColorAttachment;
+				} else if (a.attachment == attachment_kind::depth) {
+					r.usage |= vk::ImageUsageFlagBits::eDepthStencilAttachment;
+				} else {
+					r.usage |= usage_of( a.layout );
+					attachment_only = false;
+				}
+			}
+		}
+		if (attachment_only) {
+			// Never leaves tile memory on GPUs that support lazy allocation.
+			r.usage |= vk::ImageUsageFlagBits::eTransientAttachment;
+		}
+
+		vk::ImageCreateInfo image_create_info;
+		image_create_info.setImageType( vk::ImageType::e2D )
+		                 .setFormat( r.format )
+		                 .setExtent( { r.extent.width, r.extent.height, 1 } )
+		                 .setMipLevels( 1 )
+		                 .setArrayLayers( 1 )
+		                 .setSamples( vk::SampleCountFlagBits::e1 )
+		                 .setTiling( vk::ImageTiling::eOptimal )
+		                 .setUsage( r.usage )
+		                 .setSharingMode( vk::SharingMode::eExclusive )
+		                 .setInitialLayout( vk::ImageLayout::eUndefined );
+		r.image = _device.createImage( image_create_info );
+		r.requirements = _device.getImageMemoryRequirements( r.image );
+		_stats.transient_images++;
+		_stats.unaliased_bytes += r.requirements.size;
+		images.push_back( id );
+	}
+
+	// Largest first, each into the first slot whose images are all dead
+	// before it is born or born after it dies.
+	std::sort( images.begin(), images.end(), [this]( resource a, resource b ) {
+		return _resources[ a ].requirements.size > _resources[ b ].requirements.size;
+	} );
+	for (auto id : images) {
+		auto &r = _resources[ id ];
+		bool lazy = (r.usage & vk::ImageUsageFlagBits::eTransientAttachment) ? true : false;
+		for (uint32_t s = 0; s < _slots.size() && r.slot == ~0u; ++s) {
+			auto &slot = _slots[ s ];
+			if (!(slot.requirements.memoryTypeBits & r.requirements.memoryTypeBits)) {
+				continue;
+			}
+			bool disjoint = true;
+			for (auto other : slot.images) {
+				auto &o = _resources[ other ];
+				bool other_lazy = (o.usage & vk::ImageUsageFlagBits::eTransientAttachment) ? true : false;
+				if (other_lazy != lazy || !(o.last_use < r.first_use || r.last_use < o.first_use)) {
+					disjoint = false;
+					break;
+				}
+			}
+			if (disjoint) {
+				r.slot = s;
+			}
+		}
+		if (r.slot == ~0u) {
+			r.slot = ( uint32_t ) _slots.size();
+			_slots.emplace_back();
+			_slots.back().requirements.memoryTypeBits = ~0u;
+		}
+		auto &slot = _slots[ r.slot ];
+		slot.images.push_back( id );
+		slot.requirements.size = std::max( slot.requirements.size, r.requirements.size );
+		slot.requirements.alignment = std::max( slot.requirements.alignment, r.requirements.alignment );
+		slot.requirements.memoryTypeBits &= r.requirements.memoryTypeBits;
+	}
+
+	for (auto &slot : _slots) {
+		auto &first = _resources[ slot.images.front() ];
+		bool lazy = (first.usage & vk::ImageUsageFlagBits::eTransientAttachment) ? true : false;
+		slot.memory = _allocator->allocate( slot.requirements, find_memory_type( slot.requirements.memoryTypeBits, lazy ),
+		                                    device_allocator::resource_kind::optimal );
+		_stats.transient_bytes += slot.requirements.size;
+		for (auto id : slot.images) {
+			auto &r = _resources[ id ];
+			_device.bindImageMemory( r.image, slot.memory.memory, slot.memory.offset );
+
+			vk::ImageViewCreateInfo view_create_info;
+			view_create_info.setImage( r.image )
+			                .setViewType( vk::ImageViewType::e2D )
+			                .setFormat( r.format )
+			                .setSubresourceRange( { aspect_of( r.format ), 0, 1, 0, 1 } );
+			r.view = _device.createImageView( view_create_info );
+		}
+	}
+}
+
+render_graph::sync_state &
+render_graph::use_state( std::vector<sync_state> &states, resource id, uint32_t pass_index )
+{
+	auto &state = states[ id ];
+	auto &r = _resources[ id ];
+	if (r.slot != ~0u && r.first_use == pass_index) {
+		// The memory still holds the previous image of the slot; wait for
+		// its last use before overwriting it.
+		state.write_stages = _slots[ r.slot ].stages;
+		state.write_access = _slots[ r.slot ].write_access;
+	}
+	return state;
+}
+
+void
+render_graph::end_use( const sync_state &state, resource id )
+{
+	auto &r = _resources[ id ];
+	if (r.slot != ~0u) {
+		_slots[ r.slot ].stages = state.write_stages | state.read_stages;
+		_slots[ r.slot ].write_access = state.write_access;
+	}
+}
+
+void
+render_graph::place_barriers()
+{
+	std::vector<sync_state> states( _resources.size() );
+	for (resource id = 0; id < _resources.size(); ++id) {
+		if (_resources[ id ].imported && _resources[ id ].is_image) {
+			states[ id ].layout = _resources[ id ].initial_layout;
+			states[ id ].write_stages = _resources[ id ].initial_stages;
+		}
+	}
+
+	// Transient memory is reused by the next frame, which may already be
+	// recorded while this one runs; each slot starts out waiting for the
+	// last use of its images in the previous frame.
+	for (auto &slot : _slots) {
+		resource last = slot.images.front();
+		for (auto id : slot.images) {
+			if (_resources[ id ].last_use > _resources[ last ].last_use) {
+				last = id;
+			}
+		}
+		slot.stages = vk::PipelineStageFlags();
+		slot.write_access = vk::AccessFlags();
+		for (auto &a : _passes[ _resources[ last ].last_use ].accesses) {
+			if (a.id != last) {
+				continue;
+			}
+			slot.stages |= a.stages;
+			if (a.write || a.attachment != attachment_kind::none) {
+				slot.write_access |= a.access_mask;
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < _passes.size(); ++i) {
+		auto &p = _passes[ i ];
+		p.before = barrier_batch();
+		if (p.culled) {
+			continue;
+		}
+		for (auto &a : p.accesses) {
+			if (a.attachment != attachment_kind::none) {
+				continue;
+			}
+			auto &state = use_state( states, a.id, i );
+			bool transition = _resources[ a.id ].is_image && state.layout != a.layout;
+
+			vk::PipelineStageFlags src_stages;
+			vk::AccessFlags src_access;
+			if (transition || a.write) {
+				// Layout transitions are writes too, so both wait for
+				// earlier reads as well as writes.
+				src_stages = state.write_stages | state.read_stages;
+				src_access = state.write_access;
+			} else if (state.write_stages
+			           && !(contains( state.visible_stages, a.stages )
+			                && contains( state.visible_access, a.access_mask ))) {
+				src_stages = state.write_stages;
+				src_access = state.write_access;
+			}
+			if (transition || src_stages) {
+				p.before.src_stages |= src_stages;
+				p.before.dst_stages |= a.stages;
+				p.before.barriers.push_back( barrier{ a.id, src_access, a.access_mask, state.layout, a.layout } );
+			}
+
+			if (transition || a.write) {
+				state.write_stages = a.stages;
+				state.write_access = a.write ? a.access_mask : vk::AccessFlags();
+				state.read_stages = a.write ? vk::PipelineStageFlags() : a.stages;
+				state.visible_stages = a.write ? vk::PipelineStageFlags() : a.stages;
+				state.visible_access = a.write ? vk::AccessFlags() : a.access_mask;
+			} else {
+				state.read_stages |= a.stages;
+				state.visible_stages |= a.stages;
+				state.visible_access |= a.access_mask;
+			}
+			state.layout = a.layout;
+			end_use( state, a.id );
+		}
+		if (p.bind_point == vk::PipelineBindPoint::eGraphics) {
+			create_render_pass( i, states );
+		}
+	}
+
+	// Hand imported resources over in the state their owner expects.
+	_final = barrier_batch();
+	for (resource id = 0; id < _resources.size(); ++id) {
+		auto &r = _resources[ id ];
+		auto &state = states[ id ];
+		if (!r.imported || r.first_use == ~0u) {
+			continue;
+		}
+		if (r.is_image && r.final_layout != vk::ImageLayout::eUndefined && state.layout != r.final_layout) {
+			_final.src_stages |= state.write_stages | state.read_stages;
+			_final.dst_stages |= vk::PipelineStageFlagBits::eBottomOfPipe;
+			_final.barriers.push_back( barrier{ id, state.write_access, vk::AccessFlags(), state.layout,
+			                                    r.final_layout } );
+		} else if (!r.is_image && r.final_stages && state.write_stages) {
+			_final.src_stages |= state.write_stages;
+			_final.dst_stages |= r.final_stages;
+			_final.barriers.push_back( barrier{ id, state.write_access, r.final_access, vk::ImageLayout::eUndefined,
+			                                    vk::ImageLayout::eUndefined } );
+		}
+	}
+}
+
+void
+render_graph::create_render_pass( uint32_t pass_index, std::vector<sync_state> &states )
+{
+	auto &p = _passes[ pass_index ];
+	p.attachments.clear();
+	p.clear_values.clear();
+
+	std::vector<vk::AttachmentDescription> descriptions;
+	std::vector<vk::AttachmentReference> color_refs;
+	vk::AttachmentReference depth_ref;
+	bool has_depth = false;
+	vk::SubpassDependency dependency;
+	dependency.setSrcSubpass( VK_SUBPASS_EXTERNAL ).setDstSubpass( 0 );
+	std::vector<uint32_t> key;
+
+	for (auto &a : p.accesses) {
+		if (a.attachment == attachment_kind::none) {
+			continue;
+		}
+		auto &r = _resources[ a.id ];
+		auto &state = use_state( states, a.id, pass_index );
+		// Contents exist if an earlier pass or the previous frame wrote them;
+		// a transient image's first use only waits for what used its memory.
+		bool has_contents = r.imported || (r.first_use != pass_index && state.write_access);
+		auto load_op = a.clear ? vk::AttachmentLoadOp::eClear
+		                       : has_contents ? vk::AttachmentLoadOp::eLoad : vk::AttachmentLoadOp::eDontCare;
+		auto store_op = r.imported || r.last_use > pass_index ? vk::AttachmentStoreOp::eStore
+		                                                      : vk::AttachmentStoreOp::eDontCare;
+		auto initial_layout = load_op == vk::AttachmentLoadOp::eLoad ? state.layout : vk::ImageLayout::eUndefined;
+		auto final_layout = r.imported && r.last_use == pass_index && r.final_layout != vk::ImageLayout::eUndefined
+		                    ? r.final_layout : a.layout;
+
+		vk::AttachmentDescription description;
+		description.setFormat( r.format )
+		           .setSamples( vk::SampleCountFlagBits::e1 )
+		           .setLoadOp( load_op )
+		           .setStoreOp( store_op )
+		           .setStencilLoadOp( vk::AttachmentLoadOp::eDontCare )
+		           .setStencilStoreOp( vk::AttachmentStoreOp::eDontCare )
+		           .setInitialLayout( initial_layout )
+		           .setFinalLayout( final_layout );
+		vk::AttachmentReference reference( ( uint32_t ) descriptions.size(), a.layout );
+		if (a.attachment == attachment_kind::depth) {
+			depth_ref = reference;
+			has_depth = true;
+		} else {
+			color_refs.push_back( reference );
+		}
+		descriptions.push_back( description );
+		p.attachments.push_back( a.id );
+		p.clear_values.push_back( a.clear_value );
+		p.extent = r.extent;
+
+		dependency.srcStageMask |= state.write_stages | state.read_stages;
+		dependency.srcAccessMask |= state.write_access;
+		dependency.dstStageMask |= a.stages;
+		dependency.dstAccessMask |= a.access_mask;
+
+		key.insert( key.end(), { ( uint32_t ) a.attachment, ( uint32_t ) r.format, ( uint32_t ) load_op,
+		                         ( uint32_t ) store_op, ( uint32_t ) initial_layout, ( uint32_t ) final_layout } );
+
+		state.write_stages = a.stages;
+		state.write_access = a.access_mask;
+		state.read_stages = vk::PipelineStageFlags();
+		state.visible_stages = vk::PipelineStageFlags();
+		state.visible_access = vk::AccessFlags();
+		state.layout = final_layout;
+		end_use( state, a.id );
+	}
+
+	bool has_dependency = dependency.srcStageMask ? true : false;
+	key.insert( key.end(), { has_dependency ? 1u : 0u, ( VkPipelineStageFlags ) dependency.srcStageMask,
+	                         ( VkAccessFlags ) dependency.srcAccessMask, ( VkPipelineStageFlags ) dependency.dstStageMask,
+	                         ( VkAccessFlags ) dependency.dstAccessMask } );
+	auto cached = _render_passes.find( key );
+	if (cached != _render_passes.end()) {
+		p.render_pass = cached->second;
+		return;
+	}
+
+	vk::SubpassDescription subpass;
+	subpass.setPipelineBindPoint( vk::PipelineBindPoint::eGraphics )
+	       .setColorAttachmentCount( ( uint32_t ) color_refs.size() )
+	       .setPColorAttachments( color_refs.data() )
+	       .setPDepthStencilAttachment( has_depth ? &depth_ref : nullptr );
+
+	vk::RenderPassCreateInfo renderpass_create_info;
+	renderpass_create_info.setAttachmentCount( ( uint32_t ) descriptions.size() )
+	                      .setPAttachments( descriptions.data() )
+	                      .setSubpassCount( 1 )
+	                      .setPSubpasses( &subpass )
+	                      .setDependencyCount( has_dependency ? 1 : 0 )
+	                      .setPDependencies( &dependency );
+
+	p.render_pass = _device.createRenderPass( renderpass_create_info );
+	_render_passes.emplace( key, p.render_pass );
+}
+
+std::function<void()>
+render_graph::reset()
+{
+	std::vector<vk::Image> images;
+	std::vector<vk::ImageView> views;
+	for (auto &r : _resources) {
+		if (!r.imported && r.image) {
+			images.push_back( r.image );
+			views.push_back( r.view );
+		}
+	}
+	std::vector<device_allocation> memory;
+	for (auto &slot : _slots) {
+		memory.push_back( slot.memory );
+	}
+	std::vector<vk::Framebuffer> framebuffers;
+	for (auto &framebuffer : _framebuffers) {
+		framebuffers.push_back( framebuffer.second );
+	}
+
+	_resources.clear();
+	_passes.clear();
+	_slots.clear();
+	_framebuffers.clear();
+	_final = barrier_batch();
+	_stats = statistics();
+
+	auto device = _device;
+	auto allocator = _allocator;
+	return [device, allocator, images, views, memory, framebuffers]() mutable {
+		for (auto framebuffer : framebuffers) {
+			device.destroyFramebuffer( framebuffer );
+		}
+		for (auto view : views) {
+			device.destroyImageView( view );
+		}
+		for (auto image : images) {
+			device.destroyImage( image );
+		}
+		for (auto &allocation : memory) {
+			allocator->free( allocation );
+		}
+	};
+}
+
+void
+render_graph::bind_image( resource image, vk::Image handle, vk::ImageView view )
+{
+	_resources[ image ].image = handle;
+	_resources[ image ].view = view;
+}
+
+void
+render_graph::bind_buffer( resource buffer, vk::Buffer handle, vk::DeviceSize offset, vk::DeviceSize size )
+{
+	_resources[ buffer ].buffer = handle;
+	_resources[ buffer ].offset = offset;
+	_resources[ buffer ].size = size;
+}
+
+vk::Framebuffer
+render_graph::framebuffer( uint32_t pass_index, frame_arena &arena )
+{
+	auto &p = _passes[ pass_index ];
+	arena_vector<uint64_t> key{ arena };
+	arena_vector<vk::ImageView> views{ arena };
+	key.reserve( p.attachments.size() + 1 );
+	views.reserve( p.attachments.size() );
+	key.push_back( ( uint64_t ) static_cast<VkRenderPass>( p.render_pass ) );
+	for (auto id : p.attachments) {
+		views.push_back( _resources[ id ].view );
+		key.push_back( ( uint64_t ) static_cast<VkImageView>( views.back() ) );
+	}
+	auto cached = _framebuffers.find( key );
+	if (cached != _framebuffers.end()) {
+		return cached->second;
+	}
+
+	vk::FramebufferCreateInfo framebuffer_create_info;
+	framebuffer_create_info.setRenderPass( p.render_pass )
+	                       .setAttachmentCount( ( uint32_t ) views.size() )
+	                       .setPAttachments( views.data() )
+	                       .setWidth( p.extent.width )
+	                       .setHeight( p.extent.height )
+	                       .setLayers( 1 );
+	auto framebuffer = _device.createFramebuffer( framebuffer_create_info );
+	_framebuffers.emplace( std::vector<uint64_t>( key.begin(), key.end() ), framebuffer );
+	return framebuffer;
+}
+
+void
+render_graph::record_barriers( vk::CommandBuffer cmd, const barrier_batch &batch, frame_arena &arena )
+{
+	if (batch.barriers.empty()) {
+		return;
+	}
+	arena_vector<vk::BufferMemoryBarrier> buffer_barriers{ arena };
+	arena_vector<vk::ImageMemoryBarrier> image_barriers{ arena };
+	buffer_barriers.reserve( batch.barriers.size() );
+	image_barriers.reserve( batch.barriers.size() );
+	for (auto &b : batch.barriers) {
+		auto &r = _resources[ b.id ];
+		if (r.is_image) {
+			vk::ImageMemoryBarrier barrier;
+			barrier.setSrcAccessMask( b.src_access )
+			       .setDstAccessMask( b.dst_access )
+			       .setOldLayout( b.old_layout )
+			       .setNewLayout( b.new_layout )
+			       .setSrcQueueFamilyIndex( VK_QUEUE_FAMILY_IGNORED )
+			       .setDstQueueFamilyIndex( VK_QUEUE_FAMILY_IGNORED )
+			       .setImage( r.image )
+			       .setSubresourceRange( { aspect_of( r.format ), 0, 1, 0, 1 } );
+			image_barriers.push_back( barrier );
+		} else {
+			vk::BufferMemoryBarrier barrier;
+			barrier.setSrcAccessMask( b.src_access )
+			       .setDstAccessMask( b.dst_access )
+			       .setSrcQueueFamilyIndex( VK_QUEUE_FAMILY_IGNORED )
+			       .setDstQueueFamilyIndex( VK_QUEUE_FAMILY_IGNORED )
+			       .setBuffer( r.buffer )
+			       .setOffset( r.offset )
+			       .setSize( r.size );
+			buffer_barriers.push_back( barrier );
+		}
+	}
+	auto src_stages = batch.src_stages ? batch.src_stages : vk::PipelineStageFlagBits::eTopOfPipe;
+	cmd.pipelineBarrier( src_stages, batch.dst_stages, vk::DependencyFlags(), nullptr,
+	                     { ( uint32_t ) buffer_barriers.size(), buffer_barriers.data() },
+	                     { ( uint32_t ) image_barriers.size(), image_barriers.data() } );
+}
+
+void
+render_graph::execute( vk::CommandBuffer cmd, uint32_t frame, frame_arena &arena )
+{
+	for (uint32_t i = 0; i < _passes.size(); ++i) {
+		auto &p = _passes[ i ];
+		if (p.culled) {
+			continue;
+		}
+		record_barriers( cmd, p.before, arena );
+		if (_begin_hook) {
+			_begin_hook( cmd, p.name );
+		}
+
+		pass_context context;
+		context.frame = frame;
+		context.arena = &arena;
+		if (p.bind_point != vk::PipelineBindPoint::eGraphics) {
+			p.record( cmd, context );
+			if (_end_hook) {
+				_end_hook( cmd );
+			}
+			continue;
+		}
+		context.render_pass = p.render_pass;
+		context.framebuffer = framebuffer( i, arena );
+		context.extent = p.extent;
+		vk::RenderPassBeginInfo render_pass_begin_info;
+		render_pass_begin_info.setRenderPass( context.render_pass )
+		                      .setFramebuffer( context.framebuffer )
+		                      .setRenderArea( { { 0, 0 }, context.extent } )
+		                      .setClearValueCount( ( uint32_t ) p.clear_values.size() )
+		                      .setPClearValues( p.clear_values.data() );
+		cmd.beginRenderPass( render_pass_begin_info, p.secondary ? vk::SubpassContents::eSecondaryCommandBuffers
+		                                                         : vk::SubpassContents::eInline );
+		p.record( cmd, context );
+		cmd.endRenderPass();
+		if (_end_hook) {
+			_end_hook( cmd );
+		}
+	}
+	record_barriers( cmd, _final, arena );
+}
+
+void
+render_graph::print_statistics( std::ostream &out ) const
+{
+	out << "Render graph: " << _stats.passes << " passes (" << _stats.culled_passes << " culled), "
+		<< _stats.transient_images << " transient images in " << _slots.size() << " allocations, "
+		<< _stats.transient_bytes << " bytes (" << _stats.unaliased_bytes << " without aliasing)\n";
+}
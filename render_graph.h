@@ -0,0 +1,285 @@
+#pragma once
+
+#include "vulkan.h"
+#include "device_allocator.h"
+#include "frame_arena.h"
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Frame graph: passes declare the images and buffers they read and write,
+// and compile() derives everything that is otherwise written by hand from
+// that.
+//  - Passes whose results reach no imported resource are culled.
+//  - Pipeline barriers and image layout transitions are placed between
+//    passes; attachments are transitioned by the render passes themselves,
+//    with external subpass dependencies.
+//  - Each graphics pass gets a render pass, reused across compiles while
+//    its attachment formats and operations stay the same.
+//  - Transient images are created by the graph, and those whose lifetimes
+//    do not overlap share memory.
+// Passes run in declaration order on a single queue.
+class render_graph {
+public:
+	using resource = uint32_t;
+
+	struct pass_context {
+		vk::RenderPass render_pass;
+		vk::Framebuffer framebuffer;
+		vk::Extent2D extent;
+		// Values handed to execute(); the arena is for the recording
+		// thread only.
+		uint32_t frame = 0;
+		frame_arena *arena = nullptr;
+	};
+
+	using record_fn = std::function<void( vk::CommandBuffer cmd, const pass_context &context )>;
+
+	// Run around every executed pass, outside of its render pass.
+	using begin_hook = std::function<void( vk::CommandBuffer cmd, const char *pass_name )>;
+	using end_hook = std::function<void( vk::CommandBuffer cmd )>;
+
+	struct statistics {
+		uint32_t passes = 0;
+		uint32_t culled_passes = 0;
+		uint32_t transient_images = 0;
+		// Device memory behind the transient images, and what it would be
+		// without aliasing.
+		vk::DeviceSize transient_bytes = 0;
+		vk::DeviceSize unaliased_bytes = 0;
+	};
+
+	class pass_builder {
+	public:
+		pass_builder &color_attachment( resource image );
+		pass_builder &color_attachment( resource image, vk::ClearColorValue clear );
+		pass_builder &depth_attachment( resource image );
+		pass_builder &depth_attachment( resource image, vk::ClearDepthStencilValue clear );
+
+		pass_builder &read_buffer( resource buffer, vk::PipelineStageFlags stages, vk::AccessFlags access );
+		pass_builder &write_buffer( resource buffer, vk::PipelineStageFlags stages, vk::AccessFlags access );
+		pass_builder &read_image( resource image, vk::PipelineStageFlags stages, vk::AccessFlags access,
+		                          vk::ImageLayout layout );
+		pass_builder &write_image( resource image, vk::PipelineStageFlags stages, vk::AccessFlags access,
+		                           vk::ImageLayout layout );
+
+		// The pass is kept even when nothing reads its results.
+		pass_builder &side_effects();
+
+		// The render pass is begun for secondary command buffers.
+		pass_builder &secondary_command_buffers();
+
+		uint32_t index() const { return _pass; }
+
+	private:
+		friend class render_graph;
+
+		pass_builder( render_graph &graph, uint32_t pass ) : _graph( graph ), _pass( pass ) {}
+
+		render_graph &_graph;
+		uint32_t _pass;
+	};
+
+	void create( vk::PhysicalDevice physical_device, vk::Device device, device_allocator &allocator );
+
+	// Destroys the cached render passes; reset() must have run and the
+	// resources it returned must be gone.
+	void destroy();
+
+	// An image owned outside the graph whose contents outlive the frame.
+	// It is bound with bind_image() before every execute(); `initial_stages`
+	// is where its previous use, e.g. a semaphore wait, is synchronized.
+	resource import_image( std::string name, vk::Format format, vk::Extent2D extent, vk::ImageLayout initial_layout,
+	                       vk::ImageLayout final_layout, vk::PipelineStageFlags initial_stages );
+
+	// A buffer owned outside the graph. Its last writes are made visible to
+	// `final_stages`; pass empty flags when the host synchronizes on its own.
+	resource import_buffer( std::string name, vk::PipelineStageFlags final_stages = vk::PipelineStageFlags(),
+	                        vk::AccessFlags final_access = vk::AccessFlags() );
+
+	// An image created by compile() whose contents do not outlive the frame.
+	resource create_image( std::string name, vk::Format format, vk::Extent2D extent );
+
+	// `name` must outlive the graph.
+	pass_builder add_pass( const char *name, vk::PipelineBindPoint bind_point, record_fn record );
+
+	// E.g. for GPU timestamps, which may not be written into a render pass
+	// that executes secondary command buffers.
+	void set_pass_hooks( begin_hook begin, end_hook end );
+
+	void compile();
+
+	// Clears the declarations. The returned function destroys what the last
+	// compile created, which frames in flight may still be using.
+	std::function<void()> reset();
+
+	vk::RenderPass render_pass( uint32_t pass ) const { return _passes[ pass ].render_pass; }
+
+	vk::ImageView image_view( resource image ) const { return _resources[ image ].view; }
+
+	void bind_image( resource image, vk::Image handle, vk::ImageView view );
+
+	void bind_buffer( resource buffer, vk::Buffer handle, vk::DeviceSize offset, vk::DeviceSize size );
+
+	// Temporaries of the recording come from `arena`.
+	void execute( vk::CommandBuffer cmd, uint32_t frame, frame_arena &arena );
+
+	const statistics &stats() const { return _stats; }
+
+	void print_statistics( std::ostream &out ) const;
+
+private:
+	enum class attachment_kind {
+		none,
+		color,
+		depth,
+	};
+
+	struct access {
+		resource id;
+		vk::PipelineStageFlags stages;
+		vk::AccessFlags access_mask;
+		vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+		bool write = false;
+		attachment_kind attachment = attachment_kind::none;
+		bool clear = false;
+		vk::ClearValue clear_value;
+	};
+
+	// Barrier template; handles are filled in at execute().
+	struct barrier {
+		resource id;
+		vk::AccessFlags src_access;
+		vk::AccessFlags dst_access;
+		vk::ImageLayout old_layout;
+		vk::ImageLayout new_layout;
+	};
+
+	struct barrier_batch {
+		vk::PipelineStageFlags src_stages;
+		vk::PipelineStageFlags dst_stages;
+		std::vector<barrier> barriers;
+	};
+
+	struct resource_info {
+		std::string name;
+		bool is_image = false;
+		bool imported = false;
+		vk::Format format = vk::Format::eUndefined;
+		vk::Extent2D extent;
+		vk::ImageLayout initial_layout = vk::ImageLayout::eUndefined;
+		vk::ImageLayout final_layout = vk::ImageLayout::eUndefined;
+		vk::PipelineStageFlags initial_stages;
+		vk::PipelineStageFlags final_stages;
+		vk::AccessFlags final_access;
+
+		vk::Image image;
+		vk::ImageView view;
+		vk::Buffer buffer;
+		vk::DeviceSize offset = 0;
+		vk::DeviceSize size = VK_WHOLE_SIZE;
+
+		// Transient images only.
+		vk::ImageUsageFlags usage;
+		vk::MemoryRequirements requirements;
+
+		// Surviving passes using the resource, and its memory slot if
+		// transient.
+		uint32_t first_use = ~0u;
+		uint32_t last_use = 0;
+		uint32_t slot = ~0u;
+	};
+
+	struct pass {
+		const char *name;
+		vk::PipelineBindPoint bind_point;
+		record_fn record;
+		std::vector<access> accesses;
+		bool side_effects = false;
+		bool secondary = false;
+		bool culled = false;
+
+		barrier_batch before;
+		vk::RenderPass render_pass;
+		std::vector<resource> attachments;
+		std::vector<vk::ClearValue> clear_values;
+		vk::Extent2D extent;
+	};
+
+	// Synchronization state of a resource while barriers are placed.
+	struct sync_state {
+		vk::PipelineStageFlags write_stages;
+		vk::AccessFlags write_access;
+		vk::PipelineStageFlags read_stages;
+		// Stages and accesses that already saw the last write.
+		vk::PipelineStageFlags visible_stages;
+		vk::AccessFlags visible_access;
+		vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+	};
+
+	// Transient images sharing one allocation.
+	struct memory_slot {
+		std::vector<resource> images;
+		vk::MemoryRequirements requirements;
+		device_allocation memory;
+		// Last stages and writes of any image in the slot, so the next
+		// image placed there waits for them.
+		vk::PipelineStageFlags stages;
+		vk::AccessFlags write_access;
+	};
+
+	pass_builder &add_access( pass_builder &builder, const access &a );
+
+	void cull_passes();
+
+	void create_transient_images();
+
+	void place_barriers();
+
+	// Returns the state of `id` at its next use; a transient image's first
+	// use starts from what the previous image in its slot left behind.
+	sync_state &use_state( std::vector<sync_state> &states, resource id, uint32_t pass_index );
+
+	void end_use( const sync_state &state, resource id );
+
+	void create_render_pass( uint32_t pass_index, std::vector<sync_state> &states );
+
+	vk::Framebuffer framebuffer( uint32_t pass_index, frame_arena &arena );
+
+	void record_barriers( vk::CommandBuffer cmd, const barrier_batch &batch, frame_arena &arena );
+
+	uint32_t find_memory_type( uint32_t type_bits, bool lazy ) const;
+
+	vk::Device _device;
+	device_allocator *_allocator = nullptr;
+	begin_hook _begin_hook;
+	end_hook _end_hook;
+	vk::PhysicalDeviceMemoryProperties _memory_properties;
+
+	std::vector<resource_info> _resources;
+	std::vector<pass> _passes;
+	std::vector<memory_slot> _slots;
+	barrier_batch _final;
+	statistics _stats;
+
+	// Keyed by attachment formats, operations and layouts.
+	std::map<std::vector<uint32_t>, vk::RenderPass> _render_passes;
+	// Orders keys regardless of their allocator, so that lookups can use
+	// keys built in a frame arena.
+	struct key_less {
+		using is_transparent = void;
+
+		template <typename A, typename B>
+		bool
+		operator()( const A &a, const B &b ) const
+		{
+			return std::lexicographical_compare( a.begin(), a.end(), b.begin(), b.end() );
+		}
+	};
+
+	// Keyed by render pass and attachment views.
+	std::map<std::vector<uint64_t>, vk::Framebuffer, key_less> _framebuffers;
+};
@@ -0,0 +1,131 @@
+#include "shader_watcher.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+static int64_t
+modified_time( const std::string &path )
+{
+	struct stat st;
+	return stat( path.c_str(), &st ) == 0 ? ( int64_t ) st.st_mtime : -1;
+}
+
+shader_watcher::shader_watcher( std::string source_dir, std::vector<std::string> sources, std::string compiler,
+                                std::function<void( const std::string & )> on_compiled )
+	: _source_dir( std::move( source_dir ) )
+	, _sources( std::move( sources ) )
+	, _compiler( std::move( compiler ) )
+	, _on_compiled( std::move( on_compiled ) )
+{
+#ifdef __linux__
+	_inotify_fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+	if (_inotify_fd >= 0 && inotify_add_watch( _inotify_fd, _source_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO ) < 0) {
+		close( _inotify_fd );
+		_inotify_fd = -1;
+	}
+#endif
+	if (_inotify_fd < 0) {
+		for (auto &source : _sources) {
+			_modified_times.push_back( modified_time( _source_dir + "/" + source ) );
+		}
+	}
+	std::cout << "Watching " << _source_dir << " for shader changes"
+		<< (_inotify_fd >= 0 ? "" : " (polling)") << std::endl;
+	_thread = std::thread( &shader_watcher::thread_main, this );
+}
+
+shader_watcher::~shader_watcher()
+{
+	_quit = true;
+	_thread.join();
+#ifdef __linux__
+	if (_inotify_fd >= 0) {
+		close( _inotify_fd );
+	}
+#endif
+}
+
+void
+shader_watcher::thread_main()
+{
+	while (!_quit) {
+		for (auto &source : wait_for_changes()) {
+			compile( source );
+		}
+	}
+}
+
+std::vector<std::string>
+shader_watcher::wait_for_changes()
+{
+	// Both paths wake up at least every 250 ms to notice _quit.
+	std::vector<std::string> changed;
+#ifdef __linux__
+	if (_inotify_fd >= 0) {
+		pollfd fd = { _inotify_fd, POLLIN, 0 };
+		if (poll( &fd, 1, 250 ) <= 0) {
+			return changed;
+		}
+		// Editors often save in several steps; let them settle and take all
+		// events of the burst at once.
+		std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) );
+		alignas(inotify_event) char buffer[4096];
+		ssize_t length;
+		while ((length = read( _inotify_fd, buffer, sizeof(buffer) )) > 0) {
+			for (ssize_t offset = 0; offset < length;) {
+				auto event = reinterpret_cast<const inotify_event *>( buffer + offset );
+				if (event->len > 0 && std::find( _sources.begin(), _sources.end(), event->name ) != _sources.end()
+					&& std::find( changed.begin(), changed.end(), event->name ) == changed.end()) {
+					changed.push_back( event->name );
+				}
+				offset += sizeof(inotify_event) + event->len;
+			}
+		}
+		return changed;
+	}
+#endif
+	std::this_thread::sleep_for( std::chrono::milliseconds( 250 ) );
+	for (size_t i = 0; i < _sources.size(); ++i) {
+		auto time = modified_time( _source_dir + "/" + _sources[ i ] );
+		if (time != _modified_times[ i ]) {
+			_modified_times[ i ] = time;
+			changed.push_back( _sources[ i ] );
+		}
+	}
+	return changed;
+}
+
+void
+shader_watcher::compile( const std::string &source )
+{
+	// Compile to a temporary file and rename it into place, so a reader
+	// never picks up a partially written module.
+	auto input = _source_dir + "/" + source;
+	auto output = input + ".spv";
+	auto temporary = output + ".tmp";
+	auto command = _compiler + " -V \"" + input + "\" -o \"" + temporary + "\"";
+	const auto start = std::chrono::steady_clock::now();
+	if (std::system( command.c_str() ) != 0) {
+		std::cout << "Shader " << source << " failed to compile; keeping the current pipeline" << std::endl;
+		std::remove( temporary.c_str() );
+		return;
+	}
+	std::remove( output.c_str() );
+	if (std::rename( temporary.c_str(), output.c_str() ) != 0) {
+		std::cout << "Could not replace " << output << std::endl;
+		return;
+	}
+	std::cout << "Shader " << source << " compiled in "
+		<< std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count() << " ms"
+		<< std::endl;
+	_on_compiled( source + ".spv" );
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Watches GLSL sources in a directory and recompiles changed ones to SPIR-V
+// on a background thread, writing <source>.spv next to the source. Uses
+// inotify on Linux and polls modification times elsewhere.
+class shader_watcher {
+public:
+	// `sources` are file names inside `source_dir` (e.g. "shader.frag").
+	// `on_compiled` runs on the watcher thread with the SPIR-V file name
+	// (e.g. "shader.frag.spv") after every successful compile.
+	shader_watcher( std::string source_dir, std::vector<std::string> sources, std::string compiler,
+	                std::function<void( const std::string & )> on_compiled );
+
+	// Stops and joins the watcher thread; a compile in progress finishes
+	// first.
+	~shader_watcher();
+
+	shader_watcher( const shader_watcher & ) = delete;
+
+	shader_watcher &operator=( const shader_watcher & ) = delete;
+
+	const std::string &source_dir() const { return _source_dir; }
+
+private:
+	void thread_main();
+
+	// Blocks until some sources changed or the watcher is stopped.
+	std::vector<std::string> wait_for_changes();
+
+	void compile( const std::string &source );
+
+	std::string _source_dir;
+	std::vector<std::string> _sources;
+	std::string _compiler;
+	std::function<void( const std::string & )> _on_compiled;
+	std::atomic<bool> _quit{ false };
+	int _inotify_fd = -1;
+	std::vector<int64_t> _modified_times;
+	std::thread _thread;
+};
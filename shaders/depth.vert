@@ -0,0 +1,30 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Depth pre-pass: shader.vert's position math, reading nothing but the
+// position stream and the instance data.
+layout(location = 0) in vec2 inPosition;
+
+layout(location = 2) in vec4 inTransform;
+
+layout(set = 0, binding = 0) uniform FrameUniforms {
+    mat4 viewProj;
+    vec4 positionDecode;
+} frame;
+
+layout(push_constant) uniform ObjectConstants {
+    mat4 model;
+} object;
+
+out gl_PerVertex {
+    vec4 gl_Position;
+};
+invariant gl_Position;
+
+void main() {
+    vec2 modelPosition = inPosition * frame.positionDecode.xy + frame.positionDecode.zw;
+    float c = cos(inTransform.w);
+    float s = sin(inTransform.w);
+    vec2 position = mat2(c, s, -s, c) * modelPosition * inTransform.z + inTransform.xy;
+    gl_Position = frame.viewProj * object.model * vec4(position, 0.0, 1.0);
+}
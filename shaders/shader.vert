@@ -1,16 +1,40 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 
+// Stored positions, mapped back to model space by frame.positionDecode.
 layout(location = 0) in vec2 inPosition;
 layout(location = 1) in vec3 inColor;
 
+// Per instance: xy offset, z scale, w rotation.
+layout(location = 2) in vec4 inTransform;
+layout(location = 3) in vec4 inInstanceColor;
+
+layout(set = 0, binding = 0) uniform FrameUniforms {
+    mat4 viewProj;
+    // xy scale, zw bias.
+    vec4 positionDecode;
+} frame;
+
+layout(push_constant) uniform ObjectConstants {
+    mat4 model;
+} object;
+
 layout(location = 0) out vec3 fragColor;
+layout(location = 1) out vec2 fragTexCoord;
 
+// shaders/depth.vert lays down the same depth in the pre-pass.
 out gl_PerVertex {
     vec4 gl_Position;
 };
+invariant gl_Position;
 
 void main() {
-    gl_Position = vec4(inPosition, 0.0, 1.0);
-    fragColor = inColor;
+    vec2 modelPosition = inPosition * frame.positionDecode.xy + frame.positionDecode.zw;
+    float c = cos(inTransform.w);
+    float s = sin(inTransform.w);
+    vec2 position = mat2(c, s, -s, c) * modelPosition * inTransform.z + inTransform.xy;
+    gl_Position = frame.viewProj * object.model * vec4(position, 0.0, 1.0);
+    fragColor = inColor * inInstanceColor.rgb;
+    // Planar mapping of the model's xy; covers the built-in quad once.
+    fragTexCoord = modelPosition + 0.5;
 }
\ No newline at end of file
@@ -0,0 +1,42 @@
+#include "staging_ring.h"
+#include <algorithm>
+
+void
+staging_ring::create( vk::Buffer buffer, void *mapped, vk::DeviceSize capacity )
+{
+	_buffer = buffer;
+	_mapped = static_cast<char *>( mapped );
+	_capacity = capacity;
+	_head = 0;
+	_tail = 0;
+}
+
+bool
+staging_ring::try_reserve( vk::DeviceSize size, vk::DeviceSize alignment, region &out )
+{
+	vk::DeviceSize position = (_head + alignment - 1) / alignment * alignment;
+	if (position % _capacity + size > _capacity) {
+		// Does not fit before the end of the buffer: skip to its start.
+		position = (position / _capacity + 1) * _capacity;
+	}
+	if (_head == _tail) {
+		// Nothing is in flight, so the skipped bytes need not be waited for.
+		_tail = position - position % _capacity;
+	}
+	if (position + size - _tail > _capacity) {
+		return false;
+	}
+
+	_head = position + size;
+	out.buffer = _buffer;
+	out.offset = position % _capacity;
+	out.size = size;
+	out.data = _mapped + out.offset;
+	return true;
+}
+
+void
+staging_ring::release( vk::DeviceSize position )
+{
+	_tail = std::max( _tail, position );
+}
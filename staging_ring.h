@@ -0,0 +1,38 @@
+#pragma once
+
+#include "vulkan.h"
+
+// Sub-allocates upload space out of one persistently mapped host-visible
+// buffer, first in first out. Positions grow monotonically; a caller records
+// head() after the reservations of a submission and passes it to release()
+// once that submission's fence has signaled.
+class staging_ring {
+public:
+	struct region {
+		vk::Buffer buffer;
+		vk::DeviceSize offset = 0;
+		vk::DeviceSize size = 0;
+		void *data = nullptr;
+	};
+
+	void create( vk::Buffer buffer, void *mapped, vk::DeviceSize capacity );
+
+	// Fails when the space is still held by uploads that have not been
+	// released; `size` must not exceed capacity().
+	bool try_reserve( vk::DeviceSize size, vk::DeviceSize alignment, region &out );
+
+	void release( vk::DeviceSize position );
+
+	vk::DeviceSize head() const { return _head; }
+
+	vk::DeviceSize capacity() const { return _capacity; }
+
+	vk::DeviceSize in_use() const { return _head - _tail; }
+
+private:
+	vk::Buffer _buffer;
+	char *_mapped = nullptr;
+	vk::DeviceSize _capacity = 0;
+	vk::DeviceSize _head = 0;
+	vk::DeviceSize _tail = 0;
+};
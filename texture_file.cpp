@@ -0,0 +1,265 @@
+#include "texture_file.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#ifdef TEXTURE_PNG
+#include <png.h>
+#endif
+
+namespace {
+
+const uint8_t ktx2_identifier[ 12 ] = { 0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n' };
+const uint8_t png_signature[ 8 ] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+// File header and index of the KTX2 container, little-endian.
+struct ktx2_header {
+	uint8_t identifier[ 12 ];
+	uint32_t vk_format;
+	uint32_t type_size;
+	uint32_t pixel_width;
+	uint32_t pixel_height;
+	uint32_t pixel_depth;
+	uint32_t layer_count;
+	uint32_t face_count;
+	uint32_t level_count;
+	uint32_t supercompression_scheme;
+	uint32_t dfd_byte_offset;
+	uint32_t dfd_byte_length;
+	uint32_t kvd_byte_offset;
+	uint32_t kvd_byte_length;
+	uint64_t sgd_byte_offset;
+	uint64_t sgd_byte_length;
+};
+
+static_assert( sizeof(ktx2_header) == 80, "KTX2 header layout" );
+
+struct ktx2_level {
+	uint64_t byte_offset;
+	uint64_t byte_length;
+	uint64_t uncompressed_byte_length;
+};
+
+// Offsets into the basic data format descriptor block, counted from the
+// start of the descriptor (which begins with its total size).
+constexpr uint32_t dfd_texel_block_dimensions = 16;
+constexpr uint32_t dfd_bytes_plane0 = 20;
+
+float srgb_to_linear_table[ 256 ];
+
+const float *
+srgb_to_linear()
+{
+	static bool initialized = [] {
+		for (int i = 0; i < 256; ++i) {
+			float c = i / 255.0f;
+			srgb_to_linear_table[ i ] = c <= 0.04045f ? c / 12.92f : std::pow( (c + 0.055f) / 1.055f, 2.4f );
+		}
+		return true;
+	}();
+	(void) initialized;
+	return srgb_to_linear_table;
+}
+
+uint8_t
+linear_to_srgb( float c )
+{
+	c = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow( c, 1.0f / 2.4f ) - 0.055f;
+	return ( uint8_t ) std::min( 255.0f, std::max( 0.0f, c * 255.0f + 0.5f ) );
+}
+
+}
+
+texture_file::texture_file( const char *path )
+	: _file( path )
+{
+	if (_file.size() >= sizeof(ktx2_identifier)
+	    && std::memcmp( _file.data(), ktx2_identifier, sizeof(ktx2_identifier) ) == 0) {
+		load_ktx2( path );
+	} else if (_file.size() >= sizeof(png_signature)
+	           && std::memcmp( _file.data(), png_signature, sizeof(png_signature) ) == 0) {
+		load_png( path );
+	} else {
+		throw std::runtime_error( std::string( path ) + ": neither a KTX2 nor a PNG file" );
+	}
+}
+
+texture_file::texture_file( uint32_t width, uint32_t height, std::vector<uint8_t> pixels )
+	: _pixels( std::move( pixels ) )
+{
+	if (width == 0 || height == 0 || _pixels.size() != ( size_t ) width * height * 4) {
+		throw std::runtime_error( "texture pixels do not match its size" );
+	}
+	generate_mips( width, height );
+}
+
+void
+texture_file::load_ktx2( const char *path )
+{
+	auto fail = [&]( const char *what ) {
+		throw std::runtime_error( std::string( path ) + ": " + what );
+	};
+	if (_file.size() < sizeof(ktx2_header)) {
+		fail( "truncated KTX2 header" );
+	}
+	ktx2_header header;
+	std::memcpy( &header, _file.data(), sizeof(header) );
+	if (header.vk_format == VK_FORMAT_UNDEFINED) {
+		fail( "KTX2 file without a Vulkan format (Basis Universal) is not supported" );
+	}
+	if (header.supercompression_scheme != 0) {
+		fail( "supercompressed KTX2 is not supported" );
+	}
+	if (header.pixel_width == 0 || header.pixel_height == 0 || header.pixel_depth != 0) {
+		fail( "only 2D KTX2 textures are supported" );
+	}
+	if (header.layer_count > 1 || header.face_count != 1) {
+		fail( "KTX2 arrays and cube maps are not supported" );
+	}
+
+	if (header.dfd_byte_length < dfd_bytes_plane0 + 1
+	    || ( uint64_t ) header.dfd_byte_offset + header.dfd_byte_length > _file.size()) {
+		fail( "KTX2 data format descriptor outside of the file" );
+	}
+	auto dfd = _file.data() + header.dfd_byte_offset;
+	_block_width = dfd[ dfd_texel_block_dimensions ] + 1u;
+	_block_height = dfd[ dfd_texel_block_dimensions + 1 ] + 1u;
+	_block_bytes = dfd[ dfd_bytes_plane0 ];
+	if (_block_bytes == 0) {
+		fail( "KTX2 data format descriptor without a block size" );
+	}
+
+	// A level count of 0 asks the loader to generate mips, which is only
+	// possible for formats the GPU can blit; the texture keeps one level.
+	uint32_t level_count = std::max( header.level_count, 1u );
+	// Levels in a chain down to 1x1; more would be an invalid mipLevels.
+	uint32_t full_chain = 1;
+	while (full_chain < 32 && (std::max( header.pixel_width, header.pixel_height ) >> full_chain) > 0) {
+		full_chain++;
+	}
+	if (level_count > full_chain) {
+		fail( "KTX2 file has more levels than a full mip chain" );
+	}
+	if (sizeof(ktx2_header) + ( uint64_t ) level_count * sizeof(ktx2_level) > _file.size()) {
+		fail( "truncated KTX2 level index" );
+	}
+	_format = static_cast<vk::Format>( header.vk_format );
+	_levels.resize( level_count );
+	for (uint32_t i = 0; i < level_count; ++i) {
+		ktx2_level index;
+		std::memcpy( &index, _file.data() + sizeof(ktx2_header) + i * sizeof(ktx2_level), sizeof(index) );
+		auto &l = _levels[ i ];
+		l.width = std::max( header.pixel_width >> i, 1u );
+		l.height = std::max( header.pixel_height >> i, 1u );
+		uint64_t expected = ( uint64_t ) ((l.width + _block_width - 1) / _block_width)
+			* ((l.height + _block_height - 1) / _block_height) * _block_bytes;
+		if (index.byte_length != expected) {
+			fail( "KTX2 level size does not match its extent" );
+		}
+		if (index.byte_offset > _file.size() || index.byte_length > _file.size() - index.byte_offset) {
+			fail( "KTX2 level outside of the file" );
+		}
+		l.data = _file.data() + index.byte_offset;
+		l.size = index.byte_length;
+	}
+}
+
+void
+texture_file::load_png( const char *path )
+{
+#ifdef TEXTURE_PNG
+	png_image image;
+	std::memset( &image, 0, sizeof(image) );
+	image.version = PNG_IMAGE_VERSION;
+	if (!png_image_begin_read_from_memory( &image, _file.data(), _file.size() )) {
+		throw std::runtime_error( std::string( path ) + ": " + image.message );
+	}
+	image.format = PNG_FORMAT_RGBA;
+	_pixels.resize( PNG_IMAGE_SIZE( image ) );
+	if (!png_image_finish_read( &image, nullptr, _pixels.data(), 0, nullptr )) {
+		png_image_free( &image );
+		throw std::runtime_error( std::string( path ) + ": " + image.message );
+	}
+	// Everything lives in _pixels from here on.
+	_file = mapped_file();
+	generate_mips( image.width, image.height );
+#else
+	throw std::runtime_error( std::string( path ) + ": built without PNG support" );
+#endif
+}
+
+void
+texture_file::generate_mips( uint32_t width, uint32_t height )
+{
+	_format = vk::Format::eR8G8B8A8Srgb;
+	_block_width = 1;
+	_block_height = 1;
+	_block_bytes = 4;
+
+	_levels.clear();
+	uint64_t total = 0;
+	for (uint32_t w = width, h = height;; w = std::max( w / 2, 1u ), h = std::max( h / 2, 1u )) {
+		level l;
+		l.width = w;
+		l.height = h;
+		l.size = ( uint64_t ) w * h * 4;
+		total += l.size;
+		_levels.push_back( l );
+		if (w == 1 && h == 1) {
+			break;
+		}
+	}
+	_pixels.resize( ( size_t ) total );
+
+	auto to_linear = srgb_to_linear();
+	uint64_t offset = 0;
+	for (uint32_t i = 0; i < _levels.size(); ++i) {
+		auto &l = _levels[ i ];
+		l.data = _pixels.data() + offset;
+		offset += l.size;
+		if (i == 0) {
+			continue;
+		}
+		// Averages the 2x2 footprint, clamped at the edges of odd-sized
+		// levels; color is filtered in linear space, alpha as stored.
+		auto &src = _levels[ i - 1 ];
+		auto dst = const_cast<uint8_t *>( l.data );
+		for (uint32_t y = 0; y < l.height; ++y) {
+			const uint8_t *rows[ 2 ] = {
+				src.data + ( size_t ) std::min( 2 * y, src.height - 1 ) * src.width * 4,
+				src.data + ( size_t ) std::min( 2 * y + 1, src.height - 1 ) * src.width * 4,
+			};
+			for (uint32_t x = 0; x < l.width; ++x) {
+				uint32_t columns[ 2 ] = { std::min( 2 * x, src.width - 1 ) * 4, std::min( 2 * x + 1, src.width - 1 ) * 4 };
+				float color[ 3 ] = {};
+				uint32_t alpha = 0;
+				for (auto row : rows) {
+					for (auto column : columns) {
+						for (int c = 0; c < 3; ++c) {
+							color[ c ] += to_linear[ row[ column + c ] ];
+						}
+						alpha += row[ column + 3 ];
+					}
+				}
+				auto out = dst + (( size_t ) y * l.width + x) * 4;
+				for (int c = 0; c < 3; ++c) {
+					out[ c ] = linear_to_srgb( color[ c ] * 0.25f );
+				}
+				out[ 3 ] = ( uint8_t ) ((alpha + 2) / 4);
+			}
+		}
+	}
+}
+
+void
+texture_file::prefault() const
+{
+	volatile uint8_t sink = 0;
+	for (auto &l : _levels) {
+		for (uint64_t i = 0; i < l.size; i += 4096) {
+			sink += l.data[ i ];
+		}
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "vulkan.h"
+#include "utils.h"
+#include <cstdint>
+#include <vector>
+
+// A 2D texture and its mip chain, level 0 first, decoded into the layout
+// vkCmdCopyBufferToImage expects: every level tightly packed, row after
+// row of texel blocks.
+//  - KTX2 files are mapped and their levels used in place. Only 2D,
+//    single-layer, non-supercompressed files with a Vulkan format are
+//    accepted; a file without mip levels is used as a single level.
+//  - PNG files are decoded to RGBA8 (sRGB) and their mips generated with a
+//    box filter in linear space. PNG support needs libpng at build time
+//    (TEXTURE_PNG).
+// The constructors throw std::runtime_error on files they cannot use.
+class texture_file {
+public:
+	struct level {
+		uint32_t width = 0;
+		uint32_t height = 0;
+		const uint8_t *data = nullptr;
+		uint64_t size = 0;
+	};
+
+	explicit texture_file( const char *path );
+
+	// An RGBA8 (sRGB) texture with generated mips; `pixels` holds
+	// width * height texels.
+	texture_file( uint32_t width, uint32_t height, std::vector<uint8_t> pixels );
+
+	vk::Format format() const { return _format; }
+
+	uint32_t level_count() const { return ( uint32_t ) _levels.size(); }
+
+	const level &level_at( uint32_t index ) const { return _levels[ index ]; }
+
+	// Texel block size in texels and bytes; 1x1 for uncompressed formats.
+	uint32_t block_width() const { return _block_width; }
+
+	uint32_t block_height() const { return _block_height; }
+
+	uint32_t block_bytes() const { return _block_bytes; }
+
+	// Reads every page of the level data, so later copies out of a mapped
+	// file do not wait for the disk.
+	void prefault() const;
+
+private:
+	void load_ktx2( const char *path );
+
+	void load_png( const char *path );
+
+	// Builds levels 1.. from the RGBA8 level 0 in _pixels.
+	void generate_mips( uint32_t width, uint32_t height );
+
+	mapped_file _file;
+	// Decoded levels, back to back, when they do not come from _file.
+	std::vector<uint8_t> _pixels;
+	vk::Format _format = vk::Format::eUndefined;
+	std::vector<level> _levels;
+	uint32_t _block_width = 1;
+	uint32_t _block_height = 1;
+	uint32_t _block_bytes = 4;
+};
@@ -0,0 +1,537 @@
+#include "texture_streamer.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+constexpr texture_streamer::texture texture_streamer::no_texture;
+
+namespace {
+
+constexpr uint32_t sets_per_pool = 64;
+
+}
+
+void
+texture_streamer::create( vk::PhysicalDevice physical_device, vk::Device device, device_allocator &allocator,
+                          const settings &settings, upload_hooks hooks, defer_fn defer )
+{
+	_physical_device = physical_device;
+	_device = device;
+	_allocator = &allocator;
+	_memory_properties = physical_device.getMemoryProperties();
+	_settings = settings;
+	_hooks = std::move( hooks );
+	_defer = std::move( defer );
+
+	vk::DescriptorSetLayoutBinding binding;
+	binding.setBinding( 0 )
+	       .setDescriptorType( vk::DescriptorType::eCombinedImageSampler )
+	       .setDescriptorCount( 1 )
+	       .setStageFlags( vk::ShaderStageFlagBits::eFragment );
+	vk::DescriptorSetLayoutCreateInfo set_layout_create_info;
+	set_layout_create_info.setBindingCount( 1 ).setPBindings( &binding );
+	_set_layout = _device.createDescriptorSetLayout( set_layout_create_info );
+
+	// Levels are limited by each image's view, not by the sampler.
+	auto features = physical_device.getFeatures();
+	auto limits = physical_device.getProperties().limits;
+	vk::SamplerCreateInfo sampler_create_info;
+	sampler_create_info.setMagFilter( vk::Filter::eLinear )
+	                   .setMinFilter( vk::Filter::eLinear )
+	                   .setMipmapMode( vk::SamplerMipmapMode::eLinear )
+	                   .setAddressModeU( vk::SamplerAddressMode::eRepeat )
+	                   .setAddressModeV( vk::SamplerAddressMode::eRepeat )
+	                   .setAddressModeW( vk::SamplerAddressMode::eRepeat )
+	                   .setAnisotropyEnable( features.samplerAnisotropy )
+	                   .setMaxAnisotropy( std::min( 8.0f, limits.maxSamplerAnisotropy ) )
+	                   .setMinLod( 0 )
+	                   .setMaxLod( VK_LOD_CLAMP_NONE );
+	_sampler = _device.createSampler( sampler_create_info );
+
+	texture_file white( 1, 1, { 255, 255, 255, 255 } );
+	_fallback = create_image( white, 0 );
+	vk::BufferImageCopy region;
+	region.setImageSubresource( { vk::ImageAspectFlagBits::eColor, 0, 0, 1 } )
+	      .setImageExtent( { 1, 1, 1 } );
+	_hooks.begin_image( _fallback.handle, 1 );
+	if (!_hooks.copy( _fallback.handle, white.level_at( 0 ).data, 4, 4, region )) {
+		throw std::runtime_error( "no staging space for the fallback texture" );
+	}
+	_hooks.end_image( _fallback.handle, 1 );
+	create_descriptor_set( _fallback );
+
+	_quit = false;
+	for (uint32_t i = 0; i < _settings.thread_count; ++i) {
+		_threads.emplace_back( &texture_streamer::worker_main, this );
+	}
+}
+
+void
+texture_streamer::destroy()
+{
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		_quit = true;
+		_decode_queue.clear();
+	}
+	_work.notify_all();
+	for (auto &thread : _threads) {
+		thread.join();
+	}
+	_threads.clear();
+	_decoded.clear();
+
+	for (auto &u : _uploads) {
+		destroy_image( u.target, false );
+	}
+	_uploads.clear();
+	for (auto &e : _entries) {
+		destroy_image( e.tail, false );
+		destroy_image( e.streamed, false );
+	}
+	_entries.clear();
+	_lru.clear();
+	destroy_image( _fallback, false );
+	for (auto &p : _set_pools) {
+		_device.destroyDescriptorPool( p.pool );
+	}
+	_set_pools.clear();
+	_device.destroySampler( _sampler );
+	_device.destroyDescriptorSetLayout( _set_layout );
+}
+
+texture_streamer::texture
+texture_streamer::add( std::string path )
+{
+	auto t = ( texture ) _entries.size();
+	_entries.emplace_back();
+	auto &e = _entries.back();
+	e.path = path;
+	e.decoding = true;
+	e.lru = _lru.insert( _lru.end(), t );
+	_stats.textures++;
+
+	std::lock_guard<std::mutex> lock( _mutex );
+	_decode_queue.emplace_back( t, std::move( path ) );
+	_work.notify_one();
+	return t;
+}
+
+void
+texture_streamer::request( texture t, uint32_t screen_size )
+{
+	if (t >= _entries.size()) {
+		return;
+	}
+	auto &e = _entries[ t ];
+	e.requested_size = std::max( e.requested_size, screen_size );
+	if (e.last_request != _update_serial) {
+		e.last_request = _update_serial;
+		_lru.splice( _lru.begin(), _lru, e.lru );
+	}
+}
+
+void
+texture_streamer::update()
+{
+	take_decoded();
+
+	for (auto &e : _entries) {
+		if (e.level_count == 0) {
+			continue;
+		}
+		// The finest level still at least as large as the texture appears.
+		e.wanted_level = e.tail_level;
+		if (e.last_request == _update_serial) {
+			e.wanted_level = 0;
+			while (e.wanted_level + 1 < e.level_count && e.level_extents[ e.wanted_level + 1 ] >= e.requested_size) {
+				e.wanted_level++;
+			}
+		}
+		e.requested_size = 0;
+
+		uint32_t resident = e.streamed.handle ? e.streamed.first_level : e.tail_level;
+		if (e.file && !e.uploading && resident <= e.wanted_level && e.tail.handle) {
+			e.file.reset();
+		}
+	}
+
+	schedule_upgrades();
+
+	auto bytes_left = _settings.upload_bytes_per_update;
+	while (!_uploads.empty() && advance( _uploads.front(), bytes_left )) {
+		finish( _uploads.front() );
+		_uploads.pop_front();
+	}
+	_update_serial++;
+}
+
+vk::DescriptorSet
+texture_streamer::descriptor_set( texture t ) const
+{
+	if (t >= _entries.size()) {
+		return _fallback.set;
+	}
+	auto &e = _entries[ t ];
+	if (e.streamed.set) {
+		return e.streamed.set;
+	}
+	return e.tail.set ? e.tail.set : _fallback.set;
+}
+
+void
+texture_streamer::worker_main()
+{
+	std::unique_lock<std::mutex> lock( _mutex );
+	for (;;) {
+		_work.wait( lock, [this]() {
+			return _quit || !_decode_queue.empty();
+		} );
+		if (_quit) {
+			return;
+		}
+		auto job = std::move( _decode_queue.front() );
+		_decode_queue.pop_front();
+
+		lock.unlock();
+		const auto start = std::chrono::steady_clock::now();
+		decoded result;
+		result.t = job.first;
+		try {
+			result.file.reset( new texture_file( job.second.c_str() ) );
+			// Staging copies out of the file on the frame loop; fault it in
+			// here so they do not wait for the disk.
+			result.file->prefault();
+		} catch (const std::exception &ex) {
+			result.error = ex.what();
+		}
+		result.ms = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+		lock.lock();
+
+		_decoded.push_back( std::move( result ) );
+	}
+}
+
+void
+texture_streamer::take_decoded()
+{
+	std::vector<decoded> results;
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		results.swap( _decoded );
+	}
+	for (auto &result : results) {
+		auto &e = _entries[ result.t ];
+		e.decoding = false;
+		if (result.file && e.level_count == 0) {
+			auto properties = _physical_device.getFormatProperties( result.file->format() );
+			if (!(properties.optimalTilingFeatures & vk::FormatFeatureFlagBits::eSampledImage)) {
+				result.error = e.path + ": format " + to_string( result.file->format() ) + " cannot be sampled";
+				result.file.reset();
+			}
+		}
+		if (!result.file) {
+			std::cout << "Texture failed: " << result.error << std::endl;
+			e.failed = true;
+			_stats.failed++;
+			continue;
+		}
+		_stats.decodes++;
+		_stats.decode_ms_total += result.ms;
+		_stats.decode_ms_max = std::max( _stats.decode_ms_max, result.ms );
+		e.file = std::move( result.file );
+
+		if (e.level_count == 0) {
+			e.level_count = e.file->level_count();
+			e.level_extents.resize( e.level_count );
+			e.tail_level = e.level_count - 1;
+			for (uint32_t i = e.level_count; i-- > 0;) {
+				auto &l = e.file->level_at( i );
+				e.level_extents[ i ] = std::max( l.width, l.height );
+				if (e.level_extents[ i ] <= _settings.tail_size) {
+					e.tail_level = i;
+				}
+			}
+			// Tails go ahead of upgrades: they are small, and until one is
+			// staged the texture shows as plain white.
+			upload u;
+			u.t = result.t;
+			u.target = create_image( *e.file, e.tail_level );
+			u.is_tail = true;
+			u.level = e.tail_level;
+			_stats.tail_bytes += u.target.bytes;
+			e.uploading = true;
+			_uploads.push_front( std::move( u ) );
+		}
+	}
+}
+
+void
+texture_streamer::schedule_upgrades()
+{
+	// One upgrade at a time keeps the staging order coarse to fine and
+	// bounds the memory held by half-staged images.
+	for (auto &u : _uploads) {
+		if (!u.is_tail) {
+			return;
+		}
+	}
+
+	bool stalled = false;
+	for (auto t : _lru) {
+		auto &e = _entries[ t ];
+		if (e.last_request != _update_serial) {
+			// The rest were not requested for this frame either.
+			break;
+		}
+		uint32_t resident = e.streamed.handle ? e.streamed.first_level : e.tail_level;
+		if (e.failed || !e.tail.handle || e.uploading || e.wanted_level >= resident) {
+			continue;
+		}
+		if (!e.file) {
+			if (!e.decoding) {
+				e.decoding = true;
+				std::lock_guard<std::mutex> lock( _mutex );
+				_decode_queue.emplace_back( t, e.path );
+				_work.notify_one();
+			}
+			continue;
+		}
+
+		// The file's bytes stand in for the image size, which is only known
+		// once the image exists.
+		uint32_t next = resident - 1;
+		vk::DeviceSize estimate = 0;
+		for (uint32_t i = next; i < e.level_count; ++i) {
+			estimate += e.file->level_at( i ).size;
+		}
+		vk::DeviceSize needed = estimate > e.streamed.bytes ? estimate - e.streamed.bytes : 0;
+		if (!make_room( needed )) {
+			stalled = true;
+			continue;
+		}
+
+		upload u;
+		u.t = t;
+		u.target = create_image( *e.file, next );
+		u.level = next;
+		_stats.streamed_bytes += u.target.bytes;
+		_stats.peak_streamed_bytes = std::max( _stats.peak_streamed_bytes, _stats.streamed_bytes );
+		e.uploading = true;
+		_uploads.push_back( std::move( u ) );
+		return;
+	}
+	if (stalled) {
+		_stats.budget_stalls++;
+	}
+}
+
+bool
+texture_streamer::make_room( vk::DeviceSize bytes )
+{
+	auto it = _lru.end();
+	while (_stats.streamed_bytes + bytes > _settings.budget && it != _lru.begin()) {
+		--it;
+		auto &e = _entries[ *it ];
+		if (e.last_request == _update_serial) {
+			// Everything from here on is wanted by the next frame.
+			return false;
+		}
+		if (e.streamed.handle && !e.uploading) {
+			evict( *it );
+		}
+	}
+	return _stats.streamed_bytes + bytes <= _settings.budget;
+}
+
+void
+texture_streamer::evict( texture t )
+{
+	auto &e = _entries[ t ];
+	_stats.streamed_bytes -= e.streamed.bytes;
+	destroy_image( e.streamed, true );
+	_stats.evictions++;
+}
+
+bool
+texture_streamer::advance( upload &u, vk::DeviceSize &bytes_left )
+{
+	auto &e = _entries[ u.t ];
+	auto &file = *e.file;
+	uint32_t level_count = file.level_count() - u.target.first_level;
+	if (!u.begun) {
+		_hooks.begin_image( u.target.handle, level_count );
+		u.begun = true;
+	}
+
+	// Copy offsets must be multiples of both 4 and the block size.
+	vk::DeviceSize alignment = file.block_bytes();
+	while (alignment % 4 != 0) {
+		alignment += file.block_bytes();
+	}
+
+	while (u.level < file.level_count()) {
+		if (bytes_left == 0) {
+			return false;
+		}
+		auto &l = file.level_at( u.level );
+		uint32_t block_rows = (l.height + file.block_height() - 1) / file.block_height();
+		vk::DeviceSize row_bytes = l.size / block_rows;
+		// At least one row, even if it overshoots this update's share.
+		auto rows = ( uint32_t ) std::min<vk::DeviceSize>( block_rows - u.row,
+		                                                    std::max<vk::DeviceSize>( bytes_left / row_bytes, 1 ) );
+		uint32_t y = u.row * file.block_height();
+
+		vk::BufferImageCopy region;
+		region.setImageSubresource( { vk::ImageAspectFlagBits::eColor, u.level - u.target.first_level, 0, 1 } )
+		      .setImageOffset( { 0, ( int32_t ) y, 0 } )
+		      .setImageExtent( { l.width, std::min( rows * file.block_height(), l.height - y ), 1 } );
+		auto size = rows * row_bytes;
+		if (!_hooks.copy( u.target.handle, l.data + u.row * row_bytes, size, alignment, region )) {
+			_stats.staging_stalls++;
+			return false;
+		}
+		_stats.uploaded_bytes += size;
+		bytes_left -= std::min( bytes_left, size );
+		u.row += rows;
+		if (u.row == block_rows) {
+			u.level++;
+			u.row = 0;
+		}
+	}
+	return true;
+}
+
+void
+texture_streamer::finish( upload &u )
+{
+	auto &e = _entries[ u.t ];
+	_hooks.end_image( u.target.handle, e.file->level_count() - u.target.first_level );
+	create_descriptor_set( u.target );
+	e.uploading = false;
+	if (u.is_tail) {
+		e.tail = u.target;
+		return;
+	}
+	if (e.streamed.handle) {
+		_stats.streamed_bytes -= e.streamed.bytes;
+		destroy_image( e.streamed, true );
+	}
+	e.streamed = u.target;
+	_stats.upgrades++;
+}
+
+texture_streamer::image
+texture_streamer::create_image( const texture_file &file, uint32_t first_level )
+{
+	auto &top = file.level_at( first_level );
+	vk::ImageCreateInfo image_create_info;
+	image_create_info.setImageType( vk::ImageType::e2D )
+	                 .setFormat( file.format() )
+	                 .setExtent( { top.width, top.height, 1 } )
+	                 .setMipLevels( file.level_count() - first_level )
+	                 .setArrayLayers( 1 )
+	                 .setSamples( vk::SampleCountFlagBits::e1 )
+	                 .setTiling( vk::ImageTiling::eOptimal )
+	                 .setUsage( vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled )
+	                 .setSharingMode( vk::SharingMode::eExclusive )
+	                 .setInitialLayout( vk::ImageLayout::eUndefined );
+
+	image img;
+	img.first_level = first_level;
+	img.handle = _device.createImage( image_create_info );
+	auto requirements = _device.getImageMemoryRequirements( img.handle );
+	img.memory = _allocator->allocate( requirements, find_memory_type( requirements.memoryTypeBits ),
+	                                   device_allocator::resource_kind::optimal );
+	img.bytes = requirements.size;
+	_device.bindImageMemory( img.handle, img.memory.memory, img.memory.offset );
+
+	vk::ImageViewCreateInfo view_create_info;
+	view_create_info.setImage( img.handle )
+	                .setViewType( vk::ImageViewType::e2D )
+	                .setFormat( file.format() )
+	                .setSubresourceRange( { vk::ImageAspectFlagBits::eColor, 0, file.level_count() - first_level, 0, 1 } );
+	img.view = _device.createImageView( view_create_info );
+	return img;
+}
+
+void
+texture_streamer::create_descriptor_set( image &img )
+{
+	uint32_t pool = 0;
+	while (pool < _set_pools.size() && _set_pools[ pool ].live == sets_per_pool) {
+		++pool;
+	}
+	if (pool == _set_pools.size()) {
+		vk::DescriptorPoolSize pool_size( vk::DescriptorType::eCombinedImageSampler, sets_per_pool );
+		vk::DescriptorPoolCreateInfo pool_create_info;
+		pool_create_info.setFlags( vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet )
+		                .setMaxSets( sets_per_pool )
+		                .setPoolSizeCount( 1 )
+		                .setPPoolSizes( &pool_size );
+		_set_pools.push_back( set_pool{ _device.createDescriptorPool( pool_create_info ), 0 } );
+	}
+
+	vk::DescriptorSetAllocateInfo set_allocate_info;
+	set_allocate_info.setDescriptorPool( _set_pools[ pool ].pool )
+	                 .setDescriptorSetCount( 1 )
+	                 .setPSetLayouts( &_set_layout );
+	img.set = _device.allocateDescriptorSets( set_allocate_info )[ 0 ];
+	img.set_pool = pool;
+	_set_pools[ pool ].live++;
+
+	vk::DescriptorImageInfo image_info( _sampler, img.view, vk::ImageLayout::eShaderReadOnlyOptimal );
+	vk::WriteDescriptorSet write;
+	write.setDstSet( img.set )
+	     .setDstBinding( 0 )
+	     .setDescriptorCount( 1 )
+	     .setDescriptorType( vk::DescriptorType::eCombinedImageSampler )
+	     .setPImageInfo( &image_info );
+	_device.updateDescriptorSets( write, nullptr );
+}
+
+void
+texture_streamer::destroy_image( image &img, bool deferred )
+{
+	if (!img.handle) {
+		return;
+	}
+	auto destroy = [this, img]() mutable {
+		if (img.set) {
+			_device.freeDescriptorSets( _set_pools[ img.set_pool ].pool, img.set );
+			_set_pools[ img.set_pool ].live--;
+		}
+		_device.destroyImageView( img.view );
+		_device.destroyImage( img.handle );
+		_allocator->free( img.memory );
+	};
+	if (deferred) {
+		_defer( destroy );
+	} else {
+		destroy();
+	}
+	img = image();
+}
+
+uint32_t
+texture_streamer::find_memory_type( uint32_t type_bits ) const
+{
+	for (uint32_t i = 0; i < _memory_properties.memoryTypeCount; ++i) {
+		if ((type_bits & (1u << i))
+		    && (_memory_properties.memoryTypes[ i ].propertyFlags & vk::MemoryPropertyFlagBits::eDeviceLocal)) {
+			return i;
+		}
+	}
+	throw std::runtime_error( "texture streamer: no device-local memory type" );
+}
+
+void
+texture_streamer::print_statistics( std::ostream &out ) const
+{
+	out << "Textures: " << _stats.textures << " (" << _stats.failed << " failed), " << _stats.decodes << " decodes ("
+		<< _stats.decode_ms_total << " ms total, " << _stats.decode_ms_max << " ms max), " << _stats.upgrades
+		<< " upgrades, " << _stats.evictions << " evictions, " << _stats.uploaded_bytes << " bytes uploaded, "
+		<< _stats.tail_bytes << " bytes of tails, " << _stats.streamed_bytes << " streamed (peak "
+		<< _stats.peak_streamed_bytes << ", budget " << _settings.budget << "), stalled " << _stats.budget_stalls
+		<< " times on the budget and " << _stats.staging_stalls << " on staging space\n";
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include "vulkan.h"
+#include "device_allocator.h"
+#include "texture_file.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Textures decoded on worker threads and streamed into device memory
+// under a budget.
+//  - Once decoded, a texture's mip tail (the levels no larger than
+//    tail_size) stays resident; draws sample it while finer levels are
+//    missing, and a 1x1 white texture until then.
+//  - Finer levels are added one at a time, coarsest first. Each step
+//    stages the texture's chain from that level down into a new image,
+//    which replaces the previous one when complete.
+//  - Streamed images beyond the tail count against the budget; textures
+//    not requested since the last update() are dropped back to their tail,
+//    least recently requested first, to make room. The image being
+//    replaced is not counted, so the peak can exceed the budget by one
+//    texture's previous chain.
+//  - Uploads are split into pieces of at most upload_bytes_per_update and
+//    continue across updates. update() never waits for a decode or for
+//    staging space.
+class texture_streamer {
+public:
+	using texture = uint32_t;
+
+	static constexpr texture no_texture = ~0u;
+
+	struct settings {
+		uint32_t thread_count = 2;
+		vk::DeviceSize budget = 256ull << 20;
+		vk::DeviceSize upload_bytes_per_update = 4ull << 20;
+		uint32_t tail_size = 64;
+	};
+
+	struct statistics {
+		uint32_t textures = 0;
+		uint32_t failed = 0;
+		uint64_t decodes = 0;
+		double decode_ms_total = 0;
+		double decode_ms_max = 0;
+		// Steps that added a finer level, and textures dropped to their tail.
+		uint64_t upgrades = 0;
+		uint64_t evictions = 0;
+		// Updates in which an upgrade waited for the budget or for staging
+		// space.
+		uint64_t budget_stalls = 0;
+		uint64_t staging_stalls = 0;
+		uint64_t uploaded_bytes = 0;
+		vk::DeviceSize tail_bytes = 0;
+		vk::DeviceSize streamed_bytes = 0;
+		vk::DeviceSize peak_streamed_bytes = 0;
+	};
+
+	// Transfer-side recording, done by the renderer into its upload
+	// batches. Images are handed over in undefined layout and expected to
+	// end in shader-read-only layout, owned by the graphics queue and
+	// visible to the frames submitted after end_image.
+	struct upload_hooks {
+		std::function<void( vk::Image image, uint32_t level_count )> begin_image;
+		// Stages `size` bytes and records their copy into `region`. Returns
+		// false, recording nothing, when the staging space is taken.
+		std::function<bool( vk::Image image, const void *data, vk::DeviceSize size, vk::DeviceSize alignment,
+		                    const vk::BufferImageCopy &region )> copy;
+		std::function<void( vk::Image image, uint32_t level_count )> end_image;
+	};
+
+	// Runs the function once the frames using what it destroys are done.
+	using defer_fn = std::function<void( std::function<void()> )>;
+
+	void create( vk::PhysicalDevice physical_device, vk::Device device, device_allocator &allocator,
+	             const settings &settings, upload_hooks hooks, defer_fn defer );
+
+	// Joins the workers and destroys every texture; the device must be idle
+	// and deferred destructions must have run.
+	void destroy();
+
+	// Layout of the sets returned by descriptor_set(): a combined image
+	// sampler at binding 0, for the fragment stage.
+	vk::DescriptorSetLayout set_layout() const { return _set_layout; }
+
+	// Queues the file for decoding; it is not read on the calling thread.
+	texture add( std::string path );
+
+	// Marks the texture as used by the next frame, which draws it at most
+	// `screen_size` pixels wide or high. Call before update().
+	void request( texture t, uint32_t screen_size );
+
+	// Takes finished decodes, evicts, and advances the uploads. Call once
+	// per frame, before its uploads are submitted.
+	void update();
+
+	// Set sampling the finest resident levels of `t`, valid for the frame
+	// after the last update().
+	vk::DescriptorSet descriptor_set( texture t ) const;
+
+	const statistics &stats() const { return _stats; }
+
+	void print_statistics( std::ostream &out ) const;
+
+private:
+	struct image {
+		vk::Image handle;
+		vk::ImageView view;
+		device_allocation memory;
+		vk::DescriptorSet set;
+		uint32_t set_pool = 0;
+		// Level of the file the image starts at.
+		uint32_t first_level = 0;
+		vk::DeviceSize bytes = 0;
+	};
+
+	struct entry {
+		std::string path;
+		// Decoded file, kept while levels are still to be staged.
+		std::unique_ptr<texture_file> file;
+		bool decoding = false;
+		bool failed = false;
+		uint32_t level_count = 0;
+		// First level of the mip tail; 0 until decoded.
+		uint32_t tail_level = 0;
+		// Larger side of every level.
+		std::vector<uint32_t> level_extents;
+		image tail;
+		image streamed;
+		bool uploading = false;
+		// Largest size requested since the last update(), and the finest
+		// level it needs.
+		uint32_t requested_size = 0;
+		uint32_t wanted_level = 0;
+		uint64_t last_request = 0;
+		std::list<texture>::iterator lru;
+	};
+
+	// An image being staged, level by level in pieces.
+	struct upload {
+		texture t;
+		image target;
+		bool is_tail = false;
+		uint32_t level = 0;
+		uint32_t row = 0;
+		bool begun = false;
+	};
+
+	struct set_pool {
+		vk::DescriptorPool pool;
+		uint32_t live = 0;
+	};
+
+	struct decoded {
+		texture t;
+		std::unique_ptr<texture_file> file;
+		std::string error;
+		double ms = 0;
+	};
+
+	void worker_main();
+
+	void take_decoded();
+
+	// Queues the step to the next finer level of textures that want one,
+	// most recently requested first.
+	void schedule_upgrades();
+
+	// Drops unrequested textures, oldest first, until `bytes` more fit in
+	// the budget.
+	bool make_room( vk::DeviceSize bytes );
+
+	void evict( texture t );
+
+	// Returns true once the whole image is staged, false when this update's
+	// upload bytes or the staging space ran out; the upload then resumes on
+	// the next update().
+	bool advance( upload &u, vk::DeviceSize &bytes_left );
+
+	void finish( upload &u );
+
+	image create_image( const texture_file &file, uint32_t first_level );
+
+	void create_descriptor_set( image &img );
+
+	// Destroys now, or through _defer when frames may still sample it.
+	void destroy_image( image &img, bool deferred );
+
+	uint32_t find_memory_type( uint32_t type_bits ) const;
+
+	vk::Device _device;
+	device_allocator *_allocator = nullptr;
+	vk::PhysicalDeviceMemoryProperties _memory_properties;
+	vk::PhysicalDevice _physical_device;
+	settings _settings;
+	upload_hooks _hooks;
+	defer_fn _defer;
+
+	vk::DescriptorSetLayout _set_layout;
+	vk::Sampler _sampler;
+	// Grown by one pool whenever all are full; sets are freed back to the
+	// pool they came from.
+	std::vector<set_pool> _set_pools;
+	image _fallback;
+
+	std::vector<entry> _entries;
+	// Most recently requested first.
+	std::list<texture> _lru;
+	std::deque<upload> _uploads;
+	uint64_t _update_serial = 1;
+	statistics _stats;
+
+	std::mutex _mutex;
+	std::condition_variable _work;
+	std::deque<std::pair<texture, std::string>> _decode_queue;
+	std::vector<decoded> _decoded;
+	std::vector<std::thread> _threads;
+	bool _quit = false;
+};
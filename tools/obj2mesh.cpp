@@ -0,0 +1,154 @@
+// Converts a Wavefront OBJ file into the binary mesh format read by the
+// renderer (see mesh.h). Faces are fan-triangulated; vertices are
+// deduplicated per position/normal pair. Each vertex carries a float3
+// position and a float3 color derived from its normal (white without
+// normals).
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../mesh.h"
+
+namespace {
+
+struct obj_vertex {
+	float position[3];
+	float color[3];
+};
+
+// Resolves a 1-based, possibly negative OBJ index against `count` elements;
+// returns -1 for a missing or out-of-range index.
+long
+resolve_index( long index, size_t count )
+{
+	if (index < 0) {
+		index += ( long ) count;
+	} else {
+		index -= 1;
+	}
+	return index >= 0 && ( size_t ) index < count ? index : -1;
+}
+
+}
+
+int
+main( int argc, char **argv )
+{
+	if (argc != 3) {
+		std::cerr << "usage: " << argv[ 0 ] << " input.obj output.mesh\n";
+		return 1;
+	}
+	std::ifstream in{ argv[ 1 ] };
+	if (!in) {
+		std::cerr << "cannot open " << argv[ 1 ] << "\n";
+		return 1;
+	}
+
+	std::vector<float> positions;
+	std::vector<float> normals;
+	std::vector<obj_vertex> vertices;
+	std::vector<uint32_t> indices;
+	std::unordered_map<uint64_t, uint32_t> vertex_ids;
+	std::vector<uint32_t> face;
+
+	std::string line;
+	uint64_t line_number = 0;
+	while (std::getline( in, line )) {
+		++line_number;
+		const char *p = line.c_str();
+		if (p[ 0 ] == 'v' && (p[ 1 ] == ' ' || p[ 1 ] == 'n')) {
+			auto &target = p[ 1 ] == 'n' ? normals : positions;
+			char *end;
+			p += 2;
+			for (int i = 0; i < 3; ++i) {
+				target.push_back( std::strtof( p, &end ) );
+				p = end;
+			}
+		} else if (p[ 0 ] == 'f' && p[ 1 ] == ' ') {
+			face.clear();
+			p += 2;
+			while (*p) {
+				char *end;
+				long v = std::strtol( p, &end, 10 );
+				if (end == p) {
+					break;
+				}
+				p = end;
+				long vn = 0;
+				if (*p == '/') {
+					++p;
+					std::strtol( p, &end, 10 ); // texture coordinates are not used
+					p = end;
+					if (*p == '/') {
+						++p;
+						vn = std::strtol( p, &end, 10 );
+						p = end;
+					}
+				}
+				while (*p == ' ' || *p == '\t' || *p == '\r') {
+					++p;
+				}
+
+				long position = resolve_index( v, positions.size() / 3 );
+				long normal = vn ? resolve_index( vn, normals.size() / 3 ) : -1;
+				if (position < 0) {
+					std::cerr << argv[ 1 ] << ":" << line_number << ": bad vertex index\n";
+					return 1;
+				}
+				uint64_t key = (( uint64_t ) position << 32) | ( uint32_t ) (normal + 1);
+				auto inserted = vertex_ids.emplace( key, ( uint32_t ) vertices.size() );
+				if (inserted.second) {
+					obj_vertex vertex;
+					std::copy( &positions[ position * 3 ], &positions[ position * 3 ] + 3, vertex.position );
+					for (int i = 0; i < 3; ++i) {
+						vertex.color[ i ] = normal >= 0 ? normals[ normal * 3 + i ] * 0.5f + 0.5f : 1.0f;
+					}
+					vertices.push_back( vertex );
+				}
+				face.push_back( inserted.first->second );
+			}
+			for (size_t i = 2; i < face.size(); ++i) {
+				indices.push_back( face[ 0 ] );
+				indices.push_back( face[ i - 1 ] );
+				indices.push_back( face[ i ] );
+			}
+		}
+	}
+	if (indices.empty()) {
+		std::cerr << argv[ 1 ] << ": no faces\n";
+		return 1;
+	}
+
+	float bounds_min[3] = { vertices[ 0 ].position[ 0 ], vertices[ 0 ].position[ 1 ], vertices[ 0 ].position[ 2 ] };
+	float bounds_max[3] = { bounds_min[ 0 ], bounds_min[ 1 ], bounds_min[ 2 ] };
+	for (auto &vertex : vertices) {
+		for (int i = 0; i < 3; ++i) {
+			bounds_min[ i ] = std::min( bounds_min[ i ], vertex.position[ i ] );
+			bounds_max[ i ] = std::max( bounds_max[ i ], vertex.position[ i ] );
+		}
+	}
+
+	mesh_attribute attributes[2] = {
+		{ mesh_semantic::position, mesh_format::float32x3, offsetof(obj_vertex, position), 0 },
+		{ mesh_semantic::color, mesh_format::float32x3, offsetof(obj_vertex, color), 0 },
+	};
+	try {
+		if (vertices.size() <= 0x10000) {
+			std::vector<uint16_t> narrow( indices.begin(), indices.end() );
+			write_mesh( argv[ 2 ], attributes, 2, sizeof(obj_vertex), vertices.data(), vertices.size(),
+			            narrow.data(), narrow.size(), 2, bounds_min, bounds_max );
+		} else {
+			write_mesh( argv[ 2 ], attributes, 2, sizeof(obj_vertex), vertices.data(), vertices.size(),
+			            indices.data(), indices.size(), 4, bounds_min, bounds_max );
+		}
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << "\n";
+		return 1;
+	}
+	std::cout << argv[ 2 ] << ": " << vertices.size() << " vertices, " << indices.size() / 3 << " triangles\n";
+}
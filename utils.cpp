@@ -1,14 +1,260 @@
 #include "utils.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
 
-std::vector<uint8_t>
-read_file( const char *path )
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bool
+file_exists( const char *path )
+{
+#ifdef _WIN32
+	return GetFileAttributesA( path ) != INVALID_FILE_ATTRIBUTES;
+#else
+	struct stat st;
+	return stat( path, &st ) == 0;
+#endif
+}
+
+#ifndef _WIN32
+// Makes a rename or file creation in the directory of `path` durable.
+static bool
+sync_parent_directory( const std::string &path )
+{
+	auto slash = path.find_last_of( '/' );
+	std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr( 0, slash );
+	int fd = open( dir.c_str(), O_RDONLY );
+	if (fd < 0) {
+		return false;
+	}
+	bool ok = fsync( fd ) == 0;
+	close( fd );
+	return ok;
+}
+#endif
+
+void
+write_file_atomic( const char *path, const void *data, size_t size )
+{
+	std::string tmp_path = std::string( path ) + ".tmp";
+	auto fail = [&]( const std::string &what ) {
+		std::remove( tmp_path.c_str() );
+		throw std::runtime_error( what );
+	};
+	// The contents must be on disk before the rename is: otherwise a crash
+	// can leave `path` replaced by an empty or truncated file.
+#ifdef _WIN32
+	HANDLE file = CreateFileA( tmp_path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+	                           nullptr );
+	if (file == INVALID_HANDLE_VALUE) {
+		throw std::runtime_error( "failed to create " + tmp_path );
+	}
+	DWORD written = 0;
+	bool ok = WriteFile( file, data, ( DWORD ) size, &written, nullptr ) && written == size
+		&& FlushFileBuffers( file );
+	CloseHandle( file );
+	if (!ok) {
+		fail( "failed to write " + tmp_path );
+	}
+	if (!MoveFileExA( tmp_path.c_str(), path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH )) {
+		fail( std::string( "failed to replace " ) + path );
+	}
+#else
+	int fd = open( tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if (fd < 0) {
+		throw std::runtime_error( "failed to create " + tmp_path + ": " + std::strerror( errno ) );
+	}
+	auto bytes = static_cast<const char *>( data );
+	bool ok = true;
+	while (ok && size > 0) {
+		auto n = write( fd, bytes, size );
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		ok = n > 0;
+		if (ok) {
+			bytes += n;
+			size -= ( size_t ) n;
+		}
+	}
+	ok = ok && fsync( fd ) == 0;
+	ok = close( fd ) == 0 && ok;
+	if (!ok) {
+		fail( "failed to write " + tmp_path + ": " + std::strerror( errno ) );
+	}
+	// Syncing the directory before the rename makes the temporary file's
+	// entry durable, and after it the rename itself.
+	if (!sync_parent_directory( tmp_path ) || std::rename( tmp_path.c_str(), path ) != 0) {
+		fail( std::string( "failed to replace " ) + path + ": " + std::strerror( errno ) );
+	}
+	if (!sync_parent_directory( path )) {
+		throw std::runtime_error( std::string( "failed to sync the directory of " ) + path );
+	}
+#endif
+}
+
+mapped_file::mapped_file( const char *path )
+{
+	if (!file_exists( path )) {
+		throw std::runtime_error( std::string( "no such file: " ) + path );
+	}
+	if (!map( path )) {
+		read_stream( path );
+	}
+}
+
+bool
+mapped_file::map( const char *path )
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA( path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+	                           FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+	if (file == INVALID_HANDLE_VALUE) {
+		throw std::runtime_error( std::string( "failed to open " ) + path );
+	}
+	LARGE_INTEGER size;
+	if (GetFileType( file ) != FILE_TYPE_DISK || !GetFileSizeEx( file, &size )) {
+		CloseHandle( file );
+		return false;
+	}
+	_file = file;
+	_size = ( size_t ) size.QuadPart;
+	if (_size > 0) {
+		_mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+		if (_mapping) {
+			_data = static_cast<const uint8_t *>( MapViewOfFile( _mapping, FILE_MAP_READ, 0, 0, 0 ) );
+		}
+		if (!_data) {
+			close();
+			return false;
+		}
+	}
+#else
+	int fd = open( path, O_RDONLY );
+	if (fd < 0) {
+		throw std::runtime_error( std::string( "failed to open " ) + path + ": " + std::strerror( errno ) );
+	}
+	struct stat st;
+	if (fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode )) {
+		::close( fd );
+		return false;
+	}
+	_size = ( size_t ) st.st_size;
+	if (_size > 0) {
+		void *data = mmap( nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if (data == MAP_FAILED) {
+			::close( fd );
+			_size = 0;
+			return false;
+		}
+		// Mapped files are mostly streamed front to back; ask for aggressive
+		// read-ahead.
+		madvise( data, _size, MADV_SEQUENTIAL );
+		_data = static_cast<const uint8_t *>( data );
+	}
+	// The mapping keeps its own reference to the file.
+	::close( fd );
+#endif
+	_mapped = true;
+	return true;
+}
+
+void
+mapped_file::read_stream( const char *path )
+{
+	FILE *file = std::fopen( path, "rb" );
+	if (!file) {
+		throw std::runtime_error( std::string( "failed to open " ) + path );
+	}
+	size_t capacity = 0;
+	size_t size = 0;
+	for (;;) {
+		if (size == capacity) {
+			size_t new_capacity = capacity ? capacity * 2 : 64 << 10;
+			std::unique_ptr<uint32_t[]> grown( new uint32_t[ new_capacity / 4 ] );
+			if (size > 0) {
+				std::memcpy( grown.get(), _buffer.get(), size );
+			}
+			_buffer = std::move( grown );
+			capacity = new_capacity;
+		}
+		auto read = std::fread( reinterpret_cast<uint8_t *>( _buffer.get() ) + size, 1, capacity - size, file );
+		size += read;
+		if (read == 0) {
+			break;
+		}
+	}
+	bool failed = std::ferror( file ) != 0;
+	std::fclose( file );
+	if (failed) {
+		_buffer.reset();
+		throw std::runtime_error( std::string( "failed to read " ) + path );
+	}
+	_size = size;
+	_data = size > 0 ? reinterpret_cast<const uint8_t *>( _buffer.get() ) : nullptr;
+}
+
+mapped_file::~mapped_file()
+{
+	close();
+}
+
+mapped_file::mapped_file( mapped_file &&other )
+{
+	*this = std::move( other );
+}
+
+mapped_file &
+mapped_file::operator=( mapped_file &&other )
+{
+	if (this != &other) {
+		close();
+		std::swap( _data, other._data );
+		std::swap( _size, other._size );
+		std::swap( _mapped, other._mapped );
+		std::swap( _buffer, other._buffer );
+#ifdef _WIN32
+		std::swap( _file, other._file );
+		std::swap( _mapping, other._mapping );
+#endif
+	}
+	return *this;
+}
+
+void
+mapped_file::close()
 {
-	std::ifstream file{ path, std::ios::ate | std::ios::binary };
-	std::vector<uint8_t> result;
-	result.resize( ( unsigned long ) file.tellg() );
-	file.seekg( 0 );
-	file.read( ( char * ) result.data(), result.size() );
-	file.close();
-	return result;
+	_buffer.reset();
+#ifdef _WIN32
+	if (_mapped && _data) {
+		UnmapViewOfFile( _data );
+	}
+	if (_mapping) {
+		CloseHandle( _mapping );
+	}
+	if (_file) {
+		CloseHandle( _file );
+	}
+	_file = nullptr;
+	_mapping = nullptr;
+#else
+	if (_mapped && _data) {
+		munmap( const_cast<uint8_t *>( _data ), _size );
+	}
+#endif
+	_data = nullptr;
+	_size = 0;
+	_mapped = false;
 }
@@ -1,6 +1,68 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
-#include <vector>
+#include <memory>
 
-std::vector<uint8_t> read_file(const char * path);
\ No newline at end of file
+// Writes to a temporary file next to `path`, syncs it to disk and renames it
+// over `path`, so neither readers nor a crash leave a partially written file.
+void write_file_atomic( const char *path, const void *data, size_t size );
+
+// Non-owning view of read-only bytes.
+struct byte_span {
+	const uint8_t *data = nullptr;
+	size_t size = 0;
+};
+
+bool file_exists( const char *path );
+
+// Read-only view of a whole file. Regular files are mapped; anything that
+// cannot be mapped (pipes, character devices) is streamed into an owned
+// buffer instead. Either way data() is at least 4-byte aligned, so SPIR-V
+// can be used in place. Throws std::runtime_error if the file cannot be
+// opened or read; an empty file yields data() == nullptr.
+class mapped_file {
+public:
+	mapped_file() = default;
+
+	explicit mapped_file( const char *path );
+
+	~mapped_file();
+
+	mapped_file( mapped_file &&other );
+
+	mapped_file &operator=( mapped_file &&other );
+
+	mapped_file( const mapped_file & ) = delete;
+
+	mapped_file &operator=( const mapped_file & ) = delete;
+
+	const uint8_t *data() const { return _data; }
+
+	size_t size() const { return _size; }
+
+	byte_span span() const { return { _data, _size }; }
+
+	const uint32_t *words() const { return reinterpret_cast<const uint32_t *>( _data ); }
+
+	bool is_mapped() const { return _mapped; }
+
+private:
+	// Returns false when the file is not something that can be mapped.
+	bool map( const char *path );
+
+	void read_stream( const char *path );
+
+	void close();
+
+	const uint8_t *_data = nullptr;
+	size_t _size = 0;
+	bool _mapped = false;
+	// Backing store of streamed files; words keep the 4-byte alignment and
+	// are not zero-filled before the read.
+	std::unique_ptr<uint32_t[]> _buffer;
+#ifdef _WIN32
+	void *_file = nullptr;
+	void *_mapping = nullptr;
+#endif
+};
@@ -0,0 +1,193 @@
+#include "vertex_layout.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+// Streams are placed in the blob at multiples of this.
+constexpr uint64_t stream_alignment = 16;
+
+vk::Format
+to_vk_format( mesh_format format )
+{
+	switch (format) {
+	case mesh_format::float32x2:
+		return vk::Format::eR32G32Sfloat;
+	case mesh_format::float32x3:
+		return vk::Format::eR32G32B32Sfloat;
+	case mesh_format::float32x4:
+		return vk::Format::eR32G32B32A32Sfloat;
+	case mesh_format::unorm8x4:
+		return vk::Format::eR8G8B8A8Unorm;
+	}
+	throw std::runtime_error( "unknown mesh attribute format" );
+}
+
+// Missing components read as 0, and alpha as 1.
+glm::vec4
+read_attribute( const char *vertex, const mesh_attribute &attribute )
+{
+	glm::vec4 value( 0.0f, 0.0f, 0.0f, 1.0f );
+	if (attribute.format == mesh_format::unorm8x4) {
+		uint8_t bytes[4];
+		std::memcpy( bytes, vertex + attribute.offset, sizeof(bytes) );
+		for (int i = 0; i < 4; ++i) {
+			value[ i ] = bytes[ i ] / 255.0f;
+		}
+	} else {
+		// The source may be unaligned.
+		std::memcpy( &value[ 0 ], vertex + attribute.offset, mesh_format_size( attribute.format ) );
+	}
+	return value;
+}
+
+void
+store( glm::vec2 value, glm::vec2 &out )
+{
+	out = value;
+}
+
+void
+store( glm::vec2 value, snorm16x2 &out )
+{
+	value = glm::clamp( value, -1.0f, 1.0f ) * 32767.0f;
+	out.x = ( int16_t ) std::lround( value.x );
+	out.y = ( int16_t ) std::lround( value.y );
+}
+
+void
+store( glm::vec4 value, glm::vec3 &out )
+{
+	out = glm::vec3( value );
+}
+
+void
+store( glm::vec4 value, unorm8x4 &out )
+{
+	value = glm::clamp( value, 0.0f, 1.0f ) * 255.0f;
+	out.r = ( uint8_t ) std::lround( value.r );
+	out.g = ( uint8_t ) std::lround( value.g );
+	out.b = ( uint8_t ) std::lround( value.b );
+	out.a = ( uint8_t ) std::lround( value.a );
+}
+
+// Half the extent of the bounds in xy and their center in zw; flat axes
+// get a scale of 1.
+glm::vec4
+quantization_box( const vertex_source &source )
+{
+	auto extent = (source.bounds_max - source.bounds_min) * 0.5f;
+	auto center = (source.bounds_max + source.bounds_min) * 0.5f;
+	return glm::vec4( extent.x > 0 ? extent.x : 1.0f, extent.y > 0 ? extent.y : 1.0f, center.x, center.y );
+}
+
+template <typename Layout>
+vertex_streams
+describe( const vertex_source &source )
+{
+	auto streams = describe_vertex_layout<Layout>();
+	if (vertex_format<typename Layout::position_type>::normalized) {
+		streams.position_decode = quantization_box( source );
+	}
+	return streams;
+}
+
+template <typename Layout>
+packed_vertices
+pack( const vertex_source &source )
+{
+	using position_type = typename Layout::position_type;
+	using color_type = typename Layout::color_type;
+	static_assert( Layout::stream_count == 2, "only split layouts are packed" );
+
+	packed_vertices result;
+	auto positions_size = source.count * sizeof(position_type);
+	auto colors_offset = (positions_size + stream_alignment - 1) & ~(stream_alignment - 1);
+	result.offsets = { 0, colors_offset };
+	result.data.resize( ( size_t ) (colors_offset + source.count * sizeof(color_type)) );
+
+	auto box = quantization_box( source );
+	auto positions = reinterpret_cast<position_type *>( result.data.data() );
+	auto colors = reinterpret_cast<color_type *>( result.data.data() + colors_offset );
+	auto vertex = static_cast<const char *>( source.data );
+	for (uint64_t i = 0; i < source.count; ++i, vertex += source.stride) {
+		auto position = glm::vec2( read_attribute( vertex, source.position ) );
+		if (vertex_format<position_type>::normalized) {
+			position = (position - glm::vec2( box.z, box.w )) / glm::vec2( box.x, box.y );
+		}
+		store( position, positions[ i ] );
+		store( read_attribute( vertex, source.color ), colors[ i ] );
+	}
+	return result;
+}
+
+}
+
+const char *
+vertex_layout_name( vertex_layout_kind kind )
+{
+	switch (kind) {
+	case vertex_layout_kind::interleaved:
+		return "interleaved";
+	case vertex_layout_kind::split:
+		return "split";
+	case vertex_layout_kind::packed:
+		return "packed";
+	}
+	return "unknown";
+}
+
+bool
+parse_vertex_layout( const char *name, vertex_layout_kind &kind )
+{
+	for (auto candidate : { vertex_layout_kind::interleaved, vertex_layout_kind::split, vertex_layout_kind::packed }) {
+		if (std::strcmp( name, vertex_layout_name( candidate ) ) == 0) {
+			kind = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+vertex_streams
+describe_vertex_layout( vertex_layout_kind kind, const vertex_source &source )
+{
+	switch (kind) {
+	case vertex_layout_kind::interleaved: {
+		vertex_streams streams;
+		streams.strides.push_back( source.stride );
+		const mesh_attribute *attributes[] = { &source.position, &source.color };
+		for (uint32_t location = 0; location < 2; ++location) {
+			vk::VertexInputAttributeDescription description;
+			description.setBinding( 0 )
+			           .setFormat( to_vk_format( attributes[ location ]->format ) )
+			           .setLocation( location )
+			           .setOffset( attributes[ location ]->offset );
+			streams.attributes.push_back( description );
+		}
+		return streams;
+	}
+	case vertex_layout_kind::split:
+		return describe<split_vertex_layout>( source );
+	case vertex_layout_kind::packed:
+		return describe<packed_vertex_layout>( source );
+	}
+	throw std::runtime_error( "unknown vertex layout" );
+}
+
+packed_vertices
+pack_vertices( vertex_layout_kind kind, const vertex_source &source )
+{
+	switch (kind) {
+	case vertex_layout_kind::interleaved:
+		break;
+	case vertex_layout_kind::split:
+		return pack<split_vertex_layout>( source );
+	case vertex_layout_kind::packed:
+		return pack<packed_vertex_layout>( source );
+	}
+	throw std::runtime_error( std::string( vertex_layout_name( kind ) ) + " vertices are not packed" );
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "vulkan.h"
+#include "mesh.h"
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+// Vertex storage of the mesh, read by shader.vert as a vec2 position at
+// location 0 and a vec3 color at location 1.
+enum class vertex_layout_kind : uint32_t {
+	// The source vertices as they are stored: struct vertex for the
+	// built-in quad, a mesh file's vertex blob without conversion.
+	interleaved,
+	// 32-bit floats, with positions and colors in separate streams.
+	split,
+	// R16G16_SNORM positions, quantized to the mesh bounds, and
+	// R8G8B8A8_UNORM colors, in separate streams.
+	packed,
+};
+
+const char *vertex_layout_name( vertex_layout_kind kind );
+
+// Returns false for an unknown name.
+bool parse_vertex_layout( const char *name, vertex_layout_kind &kind );
+
+struct snorm16x2 {
+	int16_t x, y;
+};
+
+struct unorm8x4 {
+	uint8_t r, g, b, a;
+};
+
+// Vulkan format of a storage type; normalized formats are read by the
+// shader as values in [-1, 1] or [0, 1].
+template <typename T>
+struct vertex_format;
+
+template <>
+struct vertex_format<glm::vec2> {
+	static constexpr vk::Format value = vk::Format::eR32G32Sfloat;
+	static constexpr bool normalized = false;
+};
+
+template <>
+struct vertex_format<glm::vec3> {
+	static constexpr vk::Format value = vk::Format::eR32G32B32Sfloat;
+	static constexpr bool normalized = false;
+};
+
+template <>
+struct vertex_format<snorm16x2> {
+	static constexpr vk::Format value = vk::Format::eR16G16Snorm;
+	static constexpr bool normalized = true;
+};
+
+template <>
+struct vertex_format<unorm8x4> {
+	static constexpr vk::Format value = vk::Format::eR8G8B8A8Unorm;
+	static constexpr bool normalized = true;
+};
+
+// Compile-time vertex layout: how the position and color are stored, and
+// whether they share stream 0 or the color has stream 1 to itself.
+// Positions are always at the start of stream 0, so position-only passes
+// bind that stream alone.
+template <typename Position, typename Color, bool Split>
+struct vertex_layout {
+	using position_type = Position;
+	using color_type = Color;
+
+	static constexpr uint32_t stream_count = Split ? 2 : 1;
+	static constexpr uint32_t color_stream = Split ? 1 : 0;
+	static constexpr uint32_t color_offset = Split ? 0 : sizeof(Position);
+	static constexpr uint32_t position_stride = Split ? sizeof(Position) : sizeof(Position) + sizeof(Color);
+	static constexpr uint32_t color_stride = Split ? sizeof(Color) : position_stride;
+};
+
+using split_vertex_layout = vertex_layout<glm::vec2, glm::vec3, true>;
+using packed_vertex_layout = vertex_layout<snorm16x2, unorm8x4, true>;
+
+// What pipelines and draws need to know of a layout. Stream i is vertex
+// input binding i.
+struct vertex_streams {
+	std::vector<uint32_t> strides;
+	// Locations 0 and 1; the position is attributes[ 0 ].
+	std::vector<vk::VertexInputAttributeDescription> attributes;
+	// Maps stored positions back to model space: xy * scale + bias, with
+	// the scale in xy and the bias in zw.
+	glm::vec4 position_decode = glm::vec4( 1.0f, 1.0f, 0.0f, 0.0f );
+};
+
+template <typename Layout>
+vertex_streams
+describe_vertex_layout()
+{
+	vertex_streams streams;
+	streams.strides.push_back( uint32_t( Layout::position_stride ) );
+	if (Layout::stream_count > 1) {
+		streams.strides.push_back( uint32_t( Layout::color_stride ) );
+	}
+	streams.attributes.resize( 2 );
+	streams.attributes[ 0 ].setBinding( 0 )
+	                       .setFormat( vertex_format<typename Layout::position_type>::value )
+	                       .setLocation( 0 )
+	                       .setOffset( 0 );
+	streams.attributes[ 1 ].setBinding( Layout::color_stream )
+	                       .setFormat( vertex_format<typename Layout::color_type>::value )
+	                       .setLocation( 1 )
+	                       .setOffset( Layout::color_offset );
+	return streams;
+}
+
+// Interleaved source vertices, as found in a mesh file.
+struct vertex_source {
+	const void *data = nullptr;
+	uint32_t stride = 0;
+	uint64_t count = 0;
+	mesh_attribute position;
+	mesh_attribute color;
+	// Positions outside of the bounds are clamped to them when quantized.
+	glm::vec2 bounds_min;
+	glm::vec2 bounds_max;
+};
+
+// Throws std::runtime_error if the source formats cannot be read.
+vertex_streams describe_vertex_layout( vertex_layout_kind kind, const vertex_source &source );
+
+// Converts the source into the layout's streams, stored back to back in
+// one blob from which stream i starts at offsets[ i ]. Not used for the
+// interleaved layout, which is the source itself.
+struct packed_vertices {
+	std::vector<char> data;
+	std::vector<uint64_t> offsets;
+};
+
+packed_vertices pack_vertices( vertex_layout_kind kind, const vertex_source &source );
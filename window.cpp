@@ -1,43 +1,126 @@
+#include <algorithm>
 #include <iostream>
 #include <set>
 #include <complex>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <thread>
 #include "window.h"
 
+#ifdef _WIN32
 #define NOMINMAX
 #include <Windows.h>
+#endif
 
 #define BO
 
 #include <boost/scope_exit.hpp>
+#include "embedded_shaders.h"
+#include "radix_sort.h"
+#include "shader_watcher.h"
 #include "utils.h"
 
 #include <glm/glm.hpp>
 
-static vk::VertexInputBindingDescription
-vertex_binding_description()
+// Built-in quad, drawn when no mesh file is configured.
+static const vertex builtin_vertices[] = {
+	{ { -0.5f, -0.5f },{ 1.0f, 0.0f, 0.0f } },
+	{ { 0.5f, -0.5f },{ 0.0f, 1.0f, 0.0f } },
+	{ { 0.5f, 0.5f },{ 0.0f, 0.0f, 1.0f } },
+	{ { -0.5f, 0.5f },{ 1.0f, 1.0f, 1.0f } }
+};
+
+static const uint16_t builtin_indices[] = {
+	0, 1, 2, 2, 3, 0
+};
+
+// The mesh's vertex streams followed by the instance data.
+static std::vector<vk::VertexInputBindingDescription>
+vertex_binding_descriptions( const std::vector<uint32_t> &strides )
 {
-	vk::VertexInputBindingDescription input_binding_description;
-	input_binding_description.setInputRate( vk::VertexInputRate::eVertex )
-	                         .setBinding( 0 )
-	                         .setStride( sizeof(vertex) );
-	return input_binding_description;
+	std::vector<vk::VertexInputBindingDescription> res( strides.size() + 1 );
+	for (uint32_t i = 0; i < strides.size(); ++i) {
+		res[ i ].setInputRate( vk::VertexInputRate::eVertex )
+		        .setBinding( i )
+		        .setStride( strides[ i ] );
+	}
+	res.back().setInputRate( vk::VertexInputRate::eInstance )
+	          .setBinding( ( uint32_t ) strides.size() )
+	          .setStride( sizeof(instance_data) );
+	return res;
 }
 
-static std::array<vk::VertexInputAttributeDescription, 2>
-vertex_attribute_descriptions()
+// Mesh attributes (locations 0 and 1) followed by the instance attributes.
+static std::vector<vk::VertexInputAttributeDescription>
+vertex_attribute_descriptions( const std::vector<vk::VertexInputAttributeDescription> &mesh_attributes,
+                               uint32_t instance_binding )
 {
-	std::array<vk::VertexInputAttributeDescription, 2> res;
-	res[ 0 ].setBinding( 0 )
-	        .setFormat( vk::Format::eR32G32Sfloat )
-	        .setLocation( 0 )
-	        .setOffset( offsetof(vertex, pos) );
-	res[ 1 ].setBinding( 0 )
-	        .setFormat( vk::Format::eR32G32B32Sfloat )
-	        .setLocation( 1 )
-	        .setOffset( offsetof(vertex, color) );
+	std::vector<vk::VertexInputAttributeDescription> res( mesh_attributes );
+	res.resize( mesh_attributes.size() + 2 );
+	auto instance = res.begin() + mesh_attributes.size();
+	instance[ 0 ].setBinding( instance_binding )
+	             .setFormat( vk::Format::eR32G32B32A32Sfloat )
+	             .setLocation( 2 )
+	             .setOffset( offsetof(instance_data, transform) );
+	instance[ 1 ].setBinding( instance_binding )
+	             .setFormat( vk::Format::eR32G32B32A32Sfloat )
+	             .setLocation( 3 )
+	             .setOffset( offsetof(instance_data, color) );
 	return res;
 }
 
+// Push constants of shaders/cull.comp.
+struct cull_params {
+	glm::vec4 planes[6];
+	uint32_t object_count;
+	uint32_t index_count;
+	uint32_t first_index;
+	int32_t vertex_offset;
+	float radius;
+	uint32_t compact;
+};
+
+// vkCmdDrawIndexedIndirectCountKHR and its AMD predecessor share this
+// signature.
+typedef void (VKAPI_PTR *draw_indexed_indirect_count_fn)( VkCommandBuffer command_buffer, VkBuffer buffer,
+                                                           VkDeviceSize offset, VkBuffer count_buffer,
+                                                           VkDeviceSize count_offset, uint32_t max_draw_count,
+                                                           uint32_t stride );
+
+// Frustum planes of a view-projection matrix with Vulkan's [0, 1] depth
+// range, pointing inwards as (normal, distance).
+static std::array<glm::vec4, 6>
+frustum_planes( const glm::mat4 &view_proj )
+{
+	auto row = [&]( int i ) {
+		return glm::vec4( view_proj[ 0 ][ i ], view_proj[ 1 ][ i ], view_proj[ 2 ][ i ], view_proj[ 3 ][ i ] );
+	};
+	std::array<glm::vec4, 6> planes = {
+		row( 3 ) + row( 0 ), row( 3 ) - row( 0 ),
+		row( 3 ) + row( 1 ), row( 3 ) - row( 1 ),
+		row( 2 ), row( 3 ) - row( 2 ),
+	};
+	for (auto &plane : planes) {
+		plane /= glm::length( glm::vec3( plane ) );
+	}
+	return planes;
+}
+
+static vk::DeviceSize
+align_up( vk::DeviceSize value, vk::DeviceSize alignment )
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+static double
+elapsed_ms( std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end )
+{
+	return std::chrono::duration<double, std::milli>( end - start ).count();
+}
+
 static void
 glfw_error_callback( int error, const char *error_msg )
 {
@@ -48,76 +131,188 @@ static vk::Bool32
 vulkan_debug_callback( vk::DebugReportFlagBitsEXT flags, vk::DebugReportObjectTypeEXT objType, uint64_t obj,
                        size_t location, int32_t code, const char *layerPrefix, const char *msg, void *userData )
 {
-	std::ostringstream ss;
-	ss << "VK: ";
+	// Written without building a string, which would allocate on every
+	// message of a chatty layer.
+	const char *severity = "";
 	switch (flags) {
 	case vk::DebugReportFlagBitsEXT::eInformation:
-		ss << "Information: ";
+		severity = "Information: ";
 		break;
 	case vk::DebugReportFlagBitsEXT::eWarning:
-		ss << "Warning: ";
+		severity = "Warning: ";
 		break;
 	case vk::DebugReportFlagBitsEXT::ePerformanceWarning:
-		ss << "PerformanceWarning: ";
+		severity = "PerformanceWarning: ";
 		break;
 	case vk::DebugReportFlagBitsEXT::eError:
-		ss << "Error: ";
+		severity = "Error: ";
 		break;
 	case vk::DebugReportFlagBitsEXT::eDebug:
-		ss << "Debug: ";
+		severity = "Debug: ";
 		break;
 	}
-	ss << "[" << layerPrefix << "] " << msg << std::endl;
-	OutputDebugString( ss.str().c_str() );
+#ifdef _WIN32
+	for (auto part : { "VK: ", severity, "[", layerPrefix, "] ", msg, "\n" }) {
+		OutputDebugString( part );
+	}
+#else
+	std::fprintf( stderr, "VK: %s[%s] %s\n", severity, layerPrefix, msg );
+#endif
 	if (flags == vk::DebugReportFlagBitsEXT::eError) {
+#ifdef _WIN32
 		DebugBreak();
+#endif
 		return VK_TRUE;
 	} else {
 		return VK_FALSE;
 	}
 }
 
-window::window( uint32_t width, uint32_t height, std::string name )
+window::window( uint32_t width, uint32_t height, std::string name, window_config config )
 	: _width( width )
 	, _height( height )
 	, _name( std::move( name ) )
+	, _config( config )
 {
+	const auto startup_start = std::chrono::steady_clock::now();
+	if (_config.frames_in_flight == 0) {
+		throw std::runtime_error( "at least one frame in flight is required" );
+	}
+	if (_config.pipeline_variants == 0 || _config.pipeline_variants > 8) {
+		throw std::runtime_error( "pipeline_variants must be between 1 and 8" );
+	}
+	if (_config.depth_layers == 0 || _config.draw_count % _config.depth_layers != 0) {
+		throw std::runtime_error( "draw_count must be a multiple of depth_layers" );
+	}
+	if (_config.texture_upload_per_frame == 0 || _config.texture_upload_per_frame > _config.staging_ring_size / 2) {
+		throw std::runtime_error( "texture_upload_per_frame must be between 1 and half of staging_ring_size" );
+	}
+	if (_config.low_latency
+	    && (_config.max_queued_frames == 0 || _config.max_queued_frames > _config.frames_in_flight)) {
+		throw std::runtime_error( "max_queued_frames must be between 1 and frames_in_flight" );
+	}
+
 	_instance._necessary_layers.emplace_back( "VK_LAYER_LUNARG_standard_validation" );
-	create_window();
+	if (!_config.headless) {
+		create_window();
+	}
 	check_layers();
 
 	init_vulkan();
 	install_debug_callback();
-	create_surface();
+	if (!_config.headless) {
+		create_surface();
+	}
 	choose_physical_device();
 	create_logical_device();
-	create_swapchain();
+	_allocator.create( _gpu._physical_device, _gpu._logical_device );
+	create_pipeline_cache();
+	const bool pipeline_cache_loaded = _pipeline_cache_warm;
+	load_mesh();
+	if (_config.headless) {
+		create_offscreen_targets();
+	} else {
+		create_swapchain();
+	}
 	create_image_views();
-	create_renderpass();
-	create_graphics_pipeline();
-	create_framebuffers();
+	choose_depth_format();
+	_frame_graph.create( _gpu._physical_device, _gpu._logical_device, _allocator );
+	_frame_graph.set_pass_hooks( [this]( vk::CommandBuffer cmd, const char *pass_name ) {
+		                             _profiler.begin_pass( cmd, pass_name );
+	                             }, [this]( vk::CommandBuffer cmd ) {
+		                             _profiler.end_pass( cmd );
+	                             } );
+	create_frame_graph();
 	create_commandpool();
+	create_upload_resources();
+	// Before the pipeline layout, which includes the texture set layout.
+	create_textures();
+	create_pipeline_layout();
+	create_graphics_pipeline();
+	_pso_cache.create( _gpu._logical_device, _config.pso_threads,
+	                   [this]( const pipeline_description &description ) {
+		                   // _renderpass only changes while the cache is idle.
+		                   return build_graphics_pipeline( description, _renderpass );
+	                   } );
+	create_pipeline_variants();
 	create_vertex_buffer();
 	create_index_buffer();
+	if (_mesh_file) {
+		// Both blobs are in the staging ring now; the mapping can go.
+		_mesh_file.reset();
+		std::cout << "Mesh " << _config.mesh_path << " staged in "
+			<< elapsed_ms( _mesh_load_start, std::chrono::steady_clock::now() ) << " ms" << std::endl;
+	}
+	create_draw_list();
 	create_command_buffers();
-	create_semaphores();
+	create_uniform_buffers();
+	create_instance_buffer();
+	if (_config.gpu_culling) {
+		create_cull_resources();
+	}
+	create_frame_resources();
+	// The statistics query stays active while the recorded secondaries run,
+	// which needs inheritedQueries.
+	const auto &features = _gpu._physical_device_features;
+	bool pipeline_statistics = features.pipelineStatisticsQuery
+		&& (_config.record_threads == 0 || features.inheritedQueries);
+	_profiler.create( _gpu._logical_device, _gpu._physical_device_properties,
+	                  _gpu._queue_family_properties[ _gpu._graphics_family_index ].timestampValidBits,
+	                  _config.frames_in_flight, pipeline_statistics );
+
+	if (!_config.watch_shader_dir.empty()) {
+		start_shader_watcher();
+	}
+
+	std::cout << "Startup took " << elapsed_ms( startup_start, std::chrono::steady_clock::now() )
+		<< " ms (pipeline cache " << (pipeline_cache_loaded ? "warm" : "cold") << ")" << std::endl;
 }
 
 window::~window()
 {
+	// Joins the watcher thread, so no reload is building from here on.
+	_hot_reload.watcher.reset();
+	_gpu._logical_device.waitIdle();
+	for (auto &reloaded : _hot_reload.ready) {
+		_gpu._logical_device.destroyPipeline( reloaded.pipeline );
+	}
+	run_deletion_queue( true );
+	_pso_cache.print_statistics( std::cout );
+	_pso_cache.destroy();
+	_textures.print_statistics( std::cout );
+	_textures.destroy();
+	_profiler.destroy();
+	if (_config.gpu_culling) {
+		destroy_cull_resources();
+	}
+	destroy_instance_buffer();
+	destroy_uniform_buffers();
 	destroy_buffers();
-	destroy_semaphores();
+	destroy_upload_resources();
+	destroy_command_buffers();
+	destroy_frame_resources();
 	destroy_commandpool();
-	destroy_framebuffers();
 	destroy_graphics_pipeline();
-	destroy_renderpass();
+	destroy_pipeline_layout();
+	destroy_frame_graph();
 	destroy_image_views();
-	destroy_swapchain();
+	if (_config.headless) {
+		destroy_offscreen_targets();
+	} else {
+		destroy_swapchain();
+	}
+	_allocator.print_statistics( std::cout );
+	_allocator.destroy();
+	destroy_pipeline_cache();
 	destroy_logical_device();
-	destroy_surface();
+	if (!_config.headless) {
+		destroy_surface();
+	}
 	uninstall_debug_callback();
 	deinit_vulkan();
-	destroy_window();
+	if (!_config.headless) {
+		destroy_window();
+	}
 }
 
 void
@@ -152,14 +347,19 @@ window::create_window()
 void
 window::destroy_window()
 {
+	glfwDestroyWindow( _glfw_window );
+	glfwTerminate();
 }
 
 void
 window::init_vulkan()
 {
-	uint32_t glfw_ext_count;
-	auto glfw_extension_names = glfwGetRequiredInstanceExtensions( &glfw_ext_count );
-	std::copy_n( glfw_extension_names, glfw_ext_count, std::back_inserter( _instance._necessary_instance_extensions ) );
+	if (!_config.headless) {
+		uint32_t glfw_ext_count;
+		auto glfw_extension_names = glfwGetRequiredInstanceExtensions( &glfw_ext_count );
+		std::copy_n( glfw_extension_names, glfw_ext_count,
+		             std::back_inserter( _instance._necessary_instance_extensions ) );
+	}
 	_instance._necessary_instance_extensions.emplace_back( VK_EXT_DEBUG_REPORT_EXTENSION_NAME );
 	std::sort( _instance._necessary_instance_extensions.begin(), _instance._necessary_instance_extensions.end() );
 	_instance._necessary_instance_extensions
@@ -210,11 +410,94 @@ window::init_vulkan()
 void
 window::run()
 {
-	while (!glfwWindowShouldClose( _glfw_window )) {
-		glfwPollEvents();
+	const auto run_start = std::chrono::steady_clock::now();
+	auto frame_start = run_start;
+	if (_config.record_timings && _config.max_frames > _frame_number) {
+		// Growing it would show up as allocations in the frames measured.
+		_frame_timings.reserve( _config.max_frames );
+	}
+	uint64_t allocations = _config.count_allocations ? _config.count_allocations() : 0;
+	while (_config.max_frames == 0 || _frame_number < _config.max_frames) {
+		if (_config.max_seconds > 0 && elapsed_ms( run_start, frame_start ) >= _config.max_seconds * 1000) {
+			break;
+		}
+		if (_config.low_latency) {
+			pace_frame();
+		}
+		if (!_config.headless) {
+			if (glfwWindowShouldClose( _glfw_window )) {
+				break;
+			}
+			glfwPollEvents();
+		}
+		if (_jobs) {
+			// Jobs that need the main thread, such as GLFW calls.
+			_jobs->run_main_jobs();
+		}
+		_latency.input_time = std::chrono::steady_clock::now();
 		draw_frame();
+
+		auto frame_end = std::chrono::steady_clock::now();
+		if (_config.record_timings) {
+			_frame_timings.back().cpu_frame_ms = elapsed_ms( frame_start, frame_end );
+			if (_config.count_allocations) {
+				auto count = _config.count_allocations();
+				_frame_timings.back().allocations = ( int64_t ) (count - allocations);
+				allocations = count;
+			}
+		}
+		if (_config.latency_sleep) {
+			// Moves the time spent blocked after sampling input in front of
+			// it, in small steps so that jitter does not make it oscillate.
+			double planned = _latency.planned_sleep_ms
+				+ 0.25 * (_latency.blocked_ms - _config.latency_sleep_margin_ms);
+			_latency.planned_sleep_ms = std::max( 0.0, std::min( planned, elapsed_ms( frame_start, frame_end ) ) );
+		}
+		frame_start = frame_end;
 	}
 	_gpu._logical_device.waitIdle();
+
+	// The last ring's worth of frames has not been read back yet.
+	uint64_t first_pending = _frame_number > _frames.size() ? _frame_number - _frames.size() : 0;
+	for (uint64_t f = first_pending; f < _frame_number; ++f) {
+		collect_gpu_timings( ( uint32_t ) (f % _frames.size()), f );
+		if (_config.gpu_culling) {
+			collect_cull_results( ( uint32_t ) (f % _frames.size()), f );
+		}
+	}
+	_profiler.print_summary( std::cout );
+}
+
+void
+window::pace_frame()
+{
+	auto wait_start = std::chrono::steady_clock::now();
+	if (_frame_number >= _config.max_queued_frames) {
+		auto frame_number = _frame_number - _config.max_queued_frames;
+		auto &frame = _frames[ frame_number % _frames.size() ];
+		_gpu._logical_device.waitForFences( frame.in_flight_fence, VK_TRUE, std::numeric_limits<uint64_t>::max() );
+		note_frame_done( frame_number, std::chrono::steady_clock::now() );
+	}
+	auto sleep_start = std::chrono::steady_clock::now();
+	if (_config.latency_sleep && _latency.planned_sleep_ms > 0) {
+		auto sleep = std::chrono::duration<double, std::milli>( _latency.planned_sleep_ms );
+		std::this_thread::sleep_until( sleep_start + sleep );
+	}
+	auto sleep_end = std::chrono::steady_clock::now();
+	_latency.queue_wait_ms = elapsed_ms( wait_start, sleep_start );
+	_latency.sleep_ms = elapsed_ms( sleep_start, sleep_end );
+}
+
+void
+window::note_frame_done( uint64_t frame_number, std::chrono::steady_clock::time_point now )
+{
+	if (!_config.record_timings || frame_number >= _frame_timings.size()) {
+		return;
+	}
+	auto &timing = _frame_timings[ frame_number ];
+	if (timing.input_to_gpu_done_ms < 0) {
+		timing.input_to_gpu_done_ms = elapsed_ms( _frames[ frame_number % _frames.size() ].input_time, now );
+	}
 }
 
 void
@@ -285,7 +568,9 @@ window::deinit_vulkan()
 void
 window::choose_physical_device()
 {
-	_gpu._necessary_device_extensions.push_back( VK_KHR_SWAPCHAIN_EXTENSION_NAME );
+	if (!_config.headless) {
+		_gpu._necessary_device_extensions.push_back( VK_KHR_SWAPCHAIN_EXTENSION_NAME );
+	}
 	std::sort( _gpu._necessary_device_extensions.begin(), _gpu._necessary_device_extensions.end() );
 
 	auto phys_devices = _instance._vulkan_instance.enumeratePhysicalDevices();
@@ -298,7 +583,7 @@ window::choose_physical_device()
 		_gpu._present_family_index = ( uint32_t ) _gpu._queue_family_properties.size();
 		_gpu._graphics_family_index = ( uint32_t ) _gpu._queue_family_properties.size();
 
-		for (uint32_t i = 0; i < _gpu._queue_family_properties.size(); ++i) {
+		for (uint32_t i = 0; i < _gpu._queue_family_properties.size() && !_config.headless; ++i) {
 			if (gpu.getSurfaceSupportKHR( i, _surface )) {
 				_gpu._present_family_index = i;
 				break;
@@ -311,6 +596,10 @@ window::choose_physical_device()
 				break;
 			}
 		}
+		if (_config.headless) {
+			// Nothing is presented; the "present" queue is only used for lookups.
+			_gpu._present_family_index = _gpu._graphics_family_index;
+		}
 		if (_gpu._present_family_index == _gpu._queue_family_properties.size()
 			|| _gpu._graphics_family_index == _gpu._queue_family_properties.size()) {
 			continue;
@@ -330,13 +619,32 @@ window::choose_physical_device()
 			continue;
 		}
 
-		query_swapchain_support( gpu );
-		if (_swapchain.formats.empty() || _swapchain.present_modes.empty()) {
-			continue;
+		if (!_config.headless) {
+			query_swapchain_support( gpu );
+			if (_swapchain.formats.empty() || _swapchain.present_modes.empty()) {
+				continue;
+			}
+		}
+
+		// Prefer a transfer-only family (usually a dedicated DMA engine), then
+		// one without graphics, so uploads run beside rendering.
+		_gpu._transfer_family_index = _gpu._graphics_family_index;
+		int best_transfer_score = 0;
+		for (uint32_t i = 0; i < _gpu._queue_family_properties.size(); ++i) {
+			auto flags = _gpu._queue_family_properties[ i ].queueFlags;
+			if (!(flags & vk::QueueFlagBits::eTransfer) || (flags & vk::QueueFlagBits::eGraphics)) {
+				continue;
+			}
+			int score = (flags & vk::QueueFlagBits::eCompute) ? 1 : 2;
+			if (score > best_transfer_score) {
+				best_transfer_score = score;
+				_gpu._transfer_family_index = i;
+			}
 		}
 
 		found = true;
 		_gpu._physical_device = gpu;
+		break;
 	}
 
 	if (!found) {
@@ -345,13 +653,32 @@ window::choose_physical_device()
 
 	_gpu._physical_device_properties = _gpu._physical_device.getProperties();
 	_gpu._physical_device_features = _gpu._physical_device.getFeatures();
+
+	// Optional: lets the culling pass hand its draw count straight to the
+	// draw instead of submitting one (possibly empty) command per object.
+	for (const char *name : { "VK_KHR_draw_indirect_count", "VK_AMD_draw_indirect_count" }) {
+		auto supported = std::find_if( _gpu._physical_device_extension_properties.begin(),
+		                               _gpu._physical_device_extension_properties.end(),
+		                               [&](const vk::ExtensionProperties &p) {
+			                               return std::strcmp( p.extensionName, name ) == 0;
+		                               } );
+		if (supported != _gpu._physical_device_extension_properties.end()) {
+			_gpu._necessary_device_extensions.push_back( name );
+			_gpu._draw_indirect_count_extension = name;
+			break;
+		}
+	}
 	std::cout << "Found GPU: " << _gpu._physical_device_properties.deviceName << std::endl;
+	std::cout << "Transfer queue family: " << _gpu._transfer_family_index
+		<< (_gpu._transfer_family_index != _gpu._graphics_family_index ? " (dedicated)" : " (shared with graphics)")
+		<< std::endl;
 }
 
 void
 window::create_logical_device()
 {
-	std::set<uint32_t> queues = { _gpu._graphics_family_index, _gpu._present_family_index };
+	std::set<uint32_t> queues = { _gpu._graphics_family_index, _gpu._present_family_index,
+		_gpu._transfer_family_index };
 	std::vector<vk::DeviceQueueCreateInfo> queue_create_info;
 	queue_create_info.reserve( queues.size() );
 	float prio = 1;
@@ -379,6 +706,13 @@ window::create_logical_device()
 
 	_gpu._graphics_queue = _gpu._logical_device.getQueue( _gpu._graphics_family_index, 0 );
 	_gpu._present_queue = _gpu._logical_device.getQueue( _gpu._present_family_index, 0 );
+	_gpu._transfer_queue = _gpu._logical_device.getQueue( _gpu._transfer_family_index, 0 );
+
+	if (_gpu._draw_indirect_count_extension == "VK_KHR_draw_indirect_count") {
+		_culling.draw_indexed_indirect_count = _gpu._logical_device.getProcAddr( "vkCmdDrawIndexedIndirectCountKHR" );
+	} else if (_gpu._draw_indirect_count_extension == "VK_AMD_draw_indirect_count") {
+		_culling.draw_indexed_indirect_count = _gpu._logical_device.getProcAddr( "vkCmdDrawIndexedIndirectCountAMD" );
+	}
 }
 
 void
@@ -430,21 +764,32 @@ window::create_swapchain()
 		{ vk::PresentModeKHR::eImmediate, 2 },
 		{ vk::PresentModeKHR::eFifo, 2 } };
 
+	bool found_present_mode = false;
 	for (auto pm : preferred_present_modes) {
+		if (_config.force_present_mode && pm.present_mode != _config.present_mode) {
+			continue;
+		}
 		auto it = std::find( _swapchain.present_modes.cbegin(), _swapchain.present_modes.cend(), pm.present_mode );
 		if (it == _swapchain.present_modes.cend()) {
 			continue;
 		}
-		if (_swapchain.capabilities.minImageCount < pm.min_image_count) {
+		// Every extra image is a frame that can queue up behind the one on
+		// screen.
+		auto image_count = _config.low_latency ? _swapchain.capabilities.minImageCount : pm.min_image_count;
+		if (_swapchain.capabilities.minImageCount < image_count) {
 			continue;
 		}
-		if (_swapchain.capabilities.maxImageCount > 0 && _swapchain.capabilities.maxImageCount < pm.min_image_count) {
+		if (_swapchain.capabilities.maxImageCount > 0 && _swapchain.capabilities.maxImageCount < image_count) {
 			continue;
 		}
 		_swapchain.chosen_present_mode = pm.present_mode;
-		_swapchain.image_count = pm.min_image_count;
+		_swapchain.image_count = image_count;
+		found_present_mode = true;
 		break;
 	}
+	if (!found_present_mode) {
+		throw std::runtime_error( "no supported present mode" );
+	}
 
 	if (_swapchain.capabilities.currentExtent.width != std::numeric_limits<uint32_t>::max()
 	) {
@@ -465,9 +810,9 @@ window::create_swapchain()
 	std::cout << "Image count: " << _swapchain.image_count << std::endl;
 
 	auto old_swapchain = std::move( _swapchain.swapchain );
+	auto old_semaphores = std::move( _swapchain.render_finished_sems );
 	vk::SwapchainCreateInfoKHR swapchain_create_info;
 	swapchain_create_info.setSurface( _surface )
-	                     .setOldSwapchain( VK_NULL_HANDLE )
 	                     .setPreTransform( _swapchain.capabilities.currentTransform )
 	                     .setClipped( VK_TRUE )
 	                     .setCompositeAlpha( vk::CompositeAlphaFlagBitsKHR::eOpaque )
@@ -492,17 +837,83 @@ window::create_swapchain()
 	_swapchain.swapchain = _gpu._logical_device.createSwapchainKHR( swapchain_create_info );
 	_swapchain.swapchain_images = _gpu._logical_device.getSwapchainImagesKHR( _swapchain.swapchain );
 	assert( _swapchain.swapchain_images.size() == _swapchain.image_count );
+	_swapchain.render_finished_sems.clear();
+	for (size_t i = 0; i < _swapchain.swapchain_images.size(); ++i) {
+		_swapchain.render_finished_sems.push_back( _gpu._logical_device.createSemaphore( vk::SemaphoreCreateInfo() ) );
+	}
 	if (old_swapchain) {
-		_gpu._logical_device.destroySwapchainKHR( old_swapchain );
+		defer_destroy( [this, old_swapchain, old_semaphores]() {
+			_gpu._logical_device.destroySwapchainKHR( old_swapchain );
+			for (auto semaphore : old_semaphores) {
+				_gpu._logical_device.destroySemaphore( semaphore );
+			}
+		} );
 	}
 }
 
 void
 window::destroy_swapchain()
 {
+	for (auto semaphore : _swapchain.render_finished_sems) {
+		_gpu._logical_device.destroySemaphore( semaphore );
+	}
+	_swapchain.render_finished_sems.clear();
 	_gpu._logical_device.destroySwapchainKHR( _swapchain.swapchain );
 }
 
+void
+window::create_offscreen_targets()
+{
+	_swapchain.chosen_format.setFormat( vk::Format::eR8G8B8A8Unorm )
+	                        .setColorSpace( vk::ColorSpaceKHR::eSrgbNonlinear );
+	_swapchain.chosen_extent = vk::Extent2D{ _width, _height };
+	// One target per frame slot: the slot's fence then also guards its image.
+	_swapchain.image_count = _config.frames_in_flight;
+
+	auto format_props = _gpu._physical_device.getFormatProperties( _swapchain.chosen_format.format );
+	if (!(format_props.optimalTilingFeatures & vk::FormatFeatureFlagBits::eColorAttachment)) {
+		throw std::runtime_error( "offscreen format is not usable as a color attachment" );
+	}
+
+	std::cout << "Headless: " << _swapchain.image_count << " targets of " << _swapchain.chosen_extent.width << "x"
+		<< _swapchain.chosen_extent.height << " " << to_string( _swapchain.chosen_format.format ) << std::endl;
+
+	_swapchain.swapchain_images.resize( _swapchain.image_count );
+	_offscreen_memory.resize( _swapchain.image_count );
+	for (uint32_t i = 0; i < _swapchain.image_count; ++i) {
+		vk::ImageCreateInfo image_create_info;
+		image_create_info.setImageType( vk::ImageType::e2D )
+		                 .setFormat( _swapchain.chosen_format.format )
+		                 .setExtent( vk::Extent3D{ _swapchain.chosen_extent.width, _swapchain.chosen_extent.height, 1 } )
+		                 .setMipLevels( 1 )
+		                 .setArrayLayers( 1 )
+		                 .setSamples( vk::SampleCountFlagBits::e1 )
+		                 .setTiling( vk::ImageTiling::eOptimal )
+		                 .setUsage( vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferSrc )
+		                 .setSharingMode( vk::SharingMode::eExclusive )
+		                 .setInitialLayout( vk::ImageLayout::eUndefined );
+		_swapchain.swapchain_images[ i ] = _gpu._logical_device.createImage( image_create_info );
+
+		const auto memory_req = _gpu._logical_device.getImageMemoryRequirements( _swapchain.swapchain_images[ i ] );
+		_offscreen_memory[ i ] = _allocator.allocate( memory_req, find_memory_type( memory_req.memoryTypeBits,
+		                                                                            vk::MemoryPropertyFlagBits::eDeviceLocal ),
+		                                              device_allocator::resource_kind::optimal );
+		_gpu._logical_device.bindImageMemory( _swapchain.swapchain_images[ i ], _offscreen_memory[ i ].memory,
+		                                      _offscreen_memory[ i ].offset );
+	}
+}
+
+void
+window::destroy_offscreen_targets()
+{
+	for (uint32_t i = 0; i < _swapchain.swapchain_images.size(); ++i) {
+		_gpu._logical_device.destroyImage( _swapchain.swapchain_images[ i ] );
+		_allocator.free( _offscreen_memory[ i ] );
+	}
+	_swapchain.swapchain_images.clear();
+	_offscreen_memory.clear();
+}
+
 void
 window::query_swapchain_support( vk::PhysicalDevice gpu )
 {
@@ -539,26 +950,117 @@ window::destroy_image_views()
 	}
 }
 
+static_assert( has_embedded_shader( "shader.vert.spv" ) && has_embedded_shader( "shader.frag.spv" )
+               && has_embedded_shader( "cull.comp.spv" ) && has_embedded_shader( "depth.vert.spv" ),
+               "a shader used by window is not embedded" );
+
+vk::ShaderModule
+window::create_shader_module( const char *name, const std::string &override_dir )
+{
+	const uint32_t *code;
+	size_t size;
+	mapped_file file;
+	auto directory = _config.shader_dir;
+	if (!override_dir.empty() && file_exists( (override_dir + "/" + name).c_str() )) {
+		directory = override_dir;
+	}
+	if (directory.empty()) {
+		auto blob = find_embedded_shader( name );
+		if (!blob) {
+			throw std::runtime_error( std::string( "no embedded shader " ) + name );
+		}
+		code = blob->code;
+		size = blob->size;
+	} else {
+		// The mapping is word aligned, so the code is handed over in place.
+		auto path = directory + "/" + name;
+		file = mapped_file( path.c_str() );
+		if (file.size() == 0 || file.size() % 4 != 0 || file.words()[ 0 ] != 0x07230203) {
+			throw std::runtime_error( path + " is not a SPIR-V module" );
+		}
+		code = file.words();
+		size = file.size();
+	}
+	vk::ShaderModuleCreateInfo shader_module_create_info;
+	shader_module_create_info.setCodeSize( size ).setPCode( code );
+	return _gpu._logical_device.createShaderModule( shader_module_create_info );
+}
+
 void
 window::create_graphics_pipeline()
 {
-	auto vertex_code = read_file( "shaders/shader.vert.spv" );
-	auto shader_code = read_file( "shaders/shader.frag.spv" );
+	const auto compile_start = std::chrono::steady_clock::now();
+	_graphics_pipeline_description = graphics_pipeline_description();
+	_graphics_pipeline = build_graphics_pipeline( _graphics_pipeline_description, _renderpass );
+	if (_config.depth_prepass && !_config.gpu_culling) {
+		_depth_prepass_pipeline = build_graphics_pipeline( depth_prepass_description(), _renderpass );
+	}
+	std::cout << "Graphics pipeline created in " << elapsed_ms( compile_start, std::chrono::steady_clock::now() )
+		<< " ms (pipeline cache " << (_pipeline_cache_warm ? "warm" : "cold") << ")" << std::endl;
+	_pipeline_cache_warm = true;
+}
+
+pipeline_description
+window::graphics_pipeline_description() const
+{
+	pipeline_description description;
+	description.vertex_shader = "shader.vert.spv";
+	description.fragment_shader = "shader.frag.spv";
+	description.vertex_bindings = vertex_binding_descriptions( _mesh.streams.strides );
+	description.vertex_attributes = vertex_attribute_descriptions( _mesh.streams.attributes,
+	                                                               ( uint32_t ) _mesh.streams.strides.size() );
+	description.color_format = _swapchain.chosen_format.format;
+	description.depth_format = _depth_format;
+	if (_config.depth_prepass && !_config.gpu_culling) {
+		// Depth is already there; the opaque draws only pass where it is
+		// their own.
+		description.depth_compare = vk::CompareOp::eLessOrEqual;
+	}
+	return description;
+}
+
+pipeline_description
+window::depth_prepass_description() const
+{
+	auto description = _graphics_pipeline_description;
+	description.vertex_shader = "depth.vert.spv";
+	description.fragment_shader.clear();
+	description.depth_compare = vk::CompareOp::eLess;
+	description.color_write = false;
+
+	// Only the position stream and the instances; the binding numbers stay
+	// those of the default pipeline, so the bound buffers carry over.
+	auto instance_binding = description.vertex_bindings.back();
+	description.vertex_bindings.resize( 1 );
+	description.vertex_bindings.push_back( instance_binding );
+	auto &attributes = description.vertex_attributes;
+	attributes.erase( std::remove_if( attributes.begin(), attributes.end(),
+	                                  []( const vk::VertexInputAttributeDescription &attribute ) {
+		                                  return attribute.location == 1;
+	                                  } ), attributes.end() );
+	return description;
+}
+
+vk::Pipeline
+window::build_graphics_pipeline( const pipeline_description &description, vk::RenderPass render_pass )
+{
+	const auto &override_dir = description.shader_override_dir;
 	vk::ShaderModule vertex_module, fragment_module;
-	vk::ShaderModuleCreateInfo vertex_ci, fragment_ci;
-	vertex_ci.setCodeSize( vertex_code.size() ).setPCode( ( const uint32_t * ) vertex_code.data() );
-	fragment_ci.setCodeSize( shader_code.size() ).setPCode( ( const uint32_t * ) shader_code.data() );
-	vertex_module = _gpu._logical_device.createShaderModule( vertex_ci );
+	vertex_module = create_shader_module( description.vertex_shader.c_str(), override_dir );
 	BOOST_SCOPE_EXIT( vertex_module, &_gpu )
 		{
 			_gpu._logical_device.destroyShaderModule( vertex_module );
 		}
 
 		BOOST_SCOPE_EXIT_END
-	fragment_module = _gpu._logical_device.createShaderModule( fragment_ci );
+	if (!description.fragment_shader.empty()) {
+		fragment_module = create_shader_module( description.fragment_shader.c_str(), override_dir );
+	}
 	BOOST_SCOPE_EXIT( fragment_module, &_gpu )
 		{
-			_gpu._logical_device.destroyShaderModule( fragment_module );
+			if (fragment_module) {
+				_gpu._logical_device.destroyShaderModule( fragment_module );
+			}
 		}
 
 		BOOST_SCOPE_EXIT_END
@@ -567,155 +1069,267 @@ window::create_graphics_pipeline()
 	pstci[ 0 ].setStage( vk::ShaderStageFlagBits::eVertex ).setModule( vertex_module ).setPName( "main" );
 	pstci[ 1 ].setStage( vk::ShaderStageFlagBits::eFragment ).setModule( fragment_module ).setPName( "main" );
 
-	auto binding_description = vertex_binding_description();
-	auto attribute_descriptions = vertex_attribute_descriptions();
+	const auto &binding_descriptions = description.vertex_bindings;
+	const auto &attribute_descriptions = description.vertex_attributes;
 	vk::PipelineVertexInputStateCreateInfo vertex_input_info;
-	vertex_input_info.setVertexBindingDescriptionCount( 1 )
-	                 .setPVertexBindingDescriptions( &binding_description )
-	                 .setVertexAttributeDescriptionCount( attribute_descriptions.size() )
+	vertex_input_info.setVertexBindingDescriptionCount( ( uint32_t ) binding_descriptions.size() )
+	                 .setPVertexBindingDescriptions( binding_descriptions.data() )
+	                 .setVertexAttributeDescriptionCount( ( uint32_t ) attribute_descriptions.size() )
 	                 .setPVertexAttributeDescriptions( attribute_descriptions.data() );
 
 
 	vk::PipelineInputAssemblyStateCreateInfo input_assembly;
-	input_assembly.setTopology( vk::PrimitiveTopology::eTriangleList ).setPrimitiveRestartEnable( VK_FALSE );
-
-	vk::Viewport viewport;
-	viewport.setX( 0 )
-	        .setY( 0 )
-	        .setWidth( _swapchain.chosen_extent.width )
-	        .setHeight( _swapchain.chosen_extent.height )
-	        .setMinDepth( 0 )
-	        .setMaxDepth( 1 );
-
-	vk::Rect2D scissor;
-	scissor.setOffset( { 0, 0 } ).setExtent( _swapchain.chosen_extent );
+	input_assembly.setTopology( description.topology ).setPrimitiveRestartEnable( VK_FALSE );
 
+	// Viewport and scissor are set while recording, so a resize does not
+	// need a new pipeline.
 	vk::PipelineViewportStateCreateInfo viewport_state;
-	viewport_state.setViewportCount( 1 ).setPViewports( &viewport ).setScissorCount( 1 ).setPScissors( &scissor );
+	viewport_state.setViewportCount( 1 ).setScissorCount( 1 );
+
+	vk::DynamicState dynamic_states[] = { vk::DynamicState::eViewport, vk::DynamicState::eScissor };
+	vk::PipelineDynamicStateCreateInfo dynamic_state;
+	dynamic_state.setDynamicStateCount( 2 ).setPDynamicStates( dynamic_states );
 
 	vk::PipelineRasterizationStateCreateInfo rasterizer = {};
 	rasterizer.setRasterizerDiscardEnable( VK_FALSE )
-	          .setPolygonMode( vk::PolygonMode::eFill )
+	          .setPolygonMode( description.polygon_mode )
 	          .setLineWidth( 1 )
-	          .setCullMode( vk::CullModeFlagBits::eBack )
-	          .setFrontFace( vk::FrontFace::eClockwise )
+	          .setCullMode( description.cull_mode )
+	          .setFrontFace( description.front_face )
 	          .setDepthBiasEnable( VK_FALSE );
 
+	vk::PipelineDepthStencilStateCreateInfo depth_stencil;
+	depth_stencil.setDepthTestEnable( description.depth_test ? VK_TRUE : VK_FALSE )
+	             .setDepthWriteEnable( description.depth_write ? VK_TRUE : VK_FALSE )
+	             .setDepthCompareOp( description.depth_compare )
+	             .setDepthBoundsTestEnable( VK_FALSE )
+	             .setStencilTestEnable( VK_FALSE );
+
 	vk::PipelineMultisampleStateCreateInfo multisampling;
 	multisampling.setSampleShadingEnable( VK_FALSE ).setRasterizationSamples( vk::SampleCountFlagBits::e1 );
 
 	vk::PipelineColorBlendAttachmentState color_blend_attachment;
-	color_blend_attachment.setBlendEnable( VK_FALSE )
-	                      .setColorWriteMask( vk::ColorComponentFlagBits::eA | vk::ColorComponentFlagBits::eB
-		                      | vk::ColorComponentFlagBits::eG | vk::ColorComponentFlagBits::eR )
-	                      .setBlendEnable( VK_FALSE );
+	vk::ColorComponentFlags color_write_mask;
+	if (description.color_write) {
+		color_write_mask = vk::ColorComponentFlagBits::eA | vk::ColorComponentFlagBits::eB
+			| vk::ColorComponentFlagBits::eG | vk::ColorComponentFlagBits::eR;
+	}
+	color_blend_attachment.setBlendEnable( description.blend_enable ? VK_TRUE : VK_FALSE )
+	                      .setColorWriteMask( color_write_mask )
+	                      .setSrcColorBlendFactor( description.src_color_blend )
+	                      .setDstColorBlendFactor( description.dst_color_blend )
+	                      .setColorBlendOp( vk::BlendOp::eAdd )
+	                      .setSrcAlphaBlendFactor( vk::BlendFactor::eOne )
+	                      .setDstAlphaBlendFactor( vk::BlendFactor::eZero )
+	                      .setAlphaBlendOp( vk::BlendOp::eAdd );
 
 	vk::PipelineColorBlendStateCreateInfo color_blending;
 	color_blending.setLogicOpEnable( VK_FALSE ).setAttachmentCount( 1 ).setPAttachments( &color_blend_attachment );
 
-	vk::PipelineLayoutCreateInfo pipeline_layout_create_info;
-	vk::PipelineLayout pipeline_layout;
-	pipeline_layout = _gpu._logical_device.createPipelineLayout( pipeline_layout_create_info );
-	BOOST_SCOPE_EXIT( pipeline_layout, &_gpu )
-		{
-			_gpu._logical_device.destroyPipelineLayout( pipeline_layout );
-		}
-
-		BOOST_SCOPE_EXIT_END
-
 	vk::GraphicsPipelineCreateInfo pipeline_create_info;
-	pipeline_create_info.setStageCount( 2 )
+	pipeline_create_info.setStageCount( fragment_module ? 2 : 1 )
 	                    .setPStages( pstci )
 	                    .setPVertexInputState( &vertex_input_info )
 	                    .setPInputAssemblyState( &input_assembly )
 	                    .setPViewportState( &viewport_state )
 	                    .setPRasterizationState( &rasterizer )
 	                    .setPMultisampleState( &multisampling )
+	                    .setPDepthStencilState( &depth_stencil )
 	                    .setPColorBlendState( &color_blending )
-	                    .setLayout( pipeline_layout )
-	                    .setRenderPass( _renderpass )
+	                    .setPDynamicState( &dynamic_state )
+	                    .setLayout( _pipeline_layout )
+	                    .setRenderPass( render_pass )
 	                    .setSubpass( 0 )
 	                    .setBasePipelineHandle( VK_NULL_HANDLE );
 
-	_graphics_pipeline = _gpu._logical_device.createGraphicsPipeline( VK_NULL_HANDLE, pipeline_create_info );
+	return _gpu._logical_device.createGraphicsPipeline( _pipeline_cache, pipeline_create_info );
 }
 
 void
-window::create_renderpass()
+window::create_pipeline_variants()
 {
-	vk::AttachmentDescription color_attachment;
-	color_attachment.setFormat( _swapchain.chosen_format.format )
-	                .setSamples( vk::SampleCountFlagBits::e1 )
-	                .setLoadOp( vk::AttachmentLoadOp::eClear )
-	                .setStoreOp( vk::AttachmentStoreOp::eStore )
-	                .setStencilLoadOp( vk::AttachmentLoadOp::eDontCare )
-	                .setStencilStoreOp( vk::AttachmentStoreOp::eDontCare )
-	                .setInitialLayout( vk::ImageLayout::eUndefined )
-	                .setFinalLayout( vk::ImageLayout::ePresentSrcKHR );
+	// Each bit of the variant index flips one piece of state.
+	_pipeline_variants.assign( _config.pipeline_variants, _graphics_pipeline_description );
+	for (uint32_t i = 1; i < _config.pipeline_variants; ++i) {
+		auto &description = _pipeline_variants[ i ];
+		description.shader_generation = _shader_generation;
+		if (_shader_generation > 0) {
+			description.shader_override_dir = _config.watch_shader_dir;
+		}
+		if (i & 1) {
+			description.cull_mode = vk::CullModeFlagBits::eNone;
+		}
+		if (i & 2) {
+			// Tested against the opaque draws but hidden by none.
+			description.blend_enable = true;
+			description.src_color_blend = vk::BlendFactor::eOne;
+			description.dst_color_blend = vk::BlendFactor::eOne;
+			description.depth_write = false;
+		}
+		if ((i & 4) && _gpu._physical_device_features.fillModeNonSolid) {
+			description.polygon_mode = vk::PolygonMode::eLine;
+		}
+	}
+	_variant_pipelines.assign( _config.pipeline_variants, vk::Pipeline() );
+}
 
-	vk::AttachmentReference color_attachment_ref;
-	color_attachment_ref.setAttachment( 0 ).setLayout( vk::ImageLayout::eColorAttachmentOptimal );
+void
+window::resolve_pipeline_variants()
+{
+	_variant_pipelines[ 0 ] = _graphics_pipeline;
+	for (uint32_t i = 1; i < _pipeline_variants.size(); ++i) {
+		_variant_pipelines[ i ] = _pso_cache.request( _pipeline_variants[ i ] );
+	}
+}
 
-	vk::SubpassDescription subpass;
-	subpass.setPipelineBindPoint( vk::PipelineBindPoint::eGraphics )
-	       .setColorAttachmentCount( 1 )
-	       .setPColorAttachments( &color_attachment_ref );
+void
+window::choose_depth_format()
+{
+	// Without stencil first; D32 is the most precise where it exists.
+	const vk::Format candidates[] = { vk::Format::eD32Sfloat, vk::Format::eX8D24UnormPack32, vk::Format::eD16Unorm,
+	                                  vk::Format::eD32SfloatS8Uint, vk::Format::eD24UnormS8Uint };
+	for (auto format : candidates) {
+		auto properties = _gpu._physical_device.getFormatProperties( format );
+		if (properties.optimalTilingFeatures & vk::FormatFeatureFlagBits::eDepthStencilAttachment) {
+			_depth_format = format;
+			std::cout << "Depth format: " << to_string( format ) << std::endl;
+			return;
+		}
+	}
+	throw std::runtime_error( "no supported depth attachment format" );
+}
 
-	vk::SubpassDependency dependency;
-	dependency.setSrcSubpass( VK_SUBPASS_EXTERNAL )
-	          .setDstSubpass( 0 )
-	          .setSrcStageMask( vk::PipelineStageFlagBits::eBottomOfPipe )
-	          .setSrcAccessMask( vk::AccessFlagBits::eMemoryRead )
-	          .setDstStageMask( vk::PipelineStageFlagBits::eColorAttachmentOutput )
-	          .setDstAccessMask( vk::AccessFlagBits::eColorAttachmentRead | vk::AccessFlagBits::eColorAttachmentWrite );
+void
+window::create_frame_graph()
+{
+	auto &ids = _frame_graph_ids;
+	// The acquire semaphore is waited on at color attachment output, which
+	// is where the swapchain image's previous use is synchronized.
+	ids.backbuffer = _frame_graph.import_image( "backbuffer", _swapchain.chosen_format.format, _swapchain.chosen_extent,
+	                                            vk::ImageLayout::eUndefined,
+	                                            _config.headless ? vk::ImageLayout::eTransferSrcOptimal
+	                                                             : vk::ImageLayout::ePresentSrcKHR,
+	                                            vk::PipelineStageFlagBits::eColorAttachmentOutput );
+
+	if (_config.gpu_culling) {
+		ids.draw_commands = _frame_graph.import_buffer( "draw commands" );
+		// The host reads the count back once the frame's fence has signaled.
+		ids.draw_counts = _frame_graph.import_buffer( "draw counts", vk::PipelineStageFlagBits::eHost,
+		                                              vk::AccessFlagBits::eHostRead );
+		_frame_graph.add_pass( "cull", vk::PipelineBindPoint::eCompute,
+		                       [this]( vk::CommandBuffer cmd, const render_graph::pass_context &context ) {
+			                       record_cull( cmd, context.frame );
+		                       } )
+		            .write_buffer( ids.draw_commands, vk::PipelineStageFlagBits::eComputeShader,
+		                           vk::AccessFlagBits::eShaderWrite )
+		            .write_buffer( ids.draw_counts,
+		                           vk::PipelineStageFlagBits::eTransfer | vk::PipelineStageFlagBits::eComputeShader,
+		                           vk::AccessFlagBits::eTransferWrite | vk::AccessFlagBits::eShaderRead
+			                           | vk::AccessFlagBits::eShaderWrite );
+	}
 
-	vk::RenderPassCreateInfo renderpass_create_info;
-	renderpass_create_info.setAttachmentCount( 1 )
-	                      .setPAttachments( &color_attachment )
-	                      .setSubpassCount( 1 )
-	                      .setPSubpasses( &subpass )
-	                      .setDependencyCount( 1 )
-	                      .setPDependencies( &dependency );
+	// Only the main pass touches it, so it never leaves the render pass.
+	ids.depth = _frame_graph.create_image( "depth", _depth_format, _swapchain.chosen_extent );
+
+	vk::ClearColorValue clear_color_value;
+	clear_color_value.setFloat32( { 0.0f, 0.0f, 0.0f, 1.0f } );
+	auto main_pass = _frame_graph.add_pass( "main", vk::PipelineBindPoint::eGraphics,
+	                                        [this]( vk::CommandBuffer cmd,
+	                                                const render_graph::pass_context &context ) {
+		                                        record_main_pass( cmd, context );
+	                                        } );
+	main_pass.color_attachment( ids.backbuffer, clear_color_value )
+	         .depth_attachment( ids.depth, vk::ClearDepthStencilValue( 1.0f, 0 ) );
+	if (_config.gpu_culling) {
+		main_pass.read_buffer( ids.draw_commands, vk::PipelineStageFlagBits::eDrawIndirect,
+		                       vk::AccessFlagBits::eIndirectCommandRead )
+		         .read_buffer( ids.draw_counts, vk::PipelineStageFlagBits::eDrawIndirect,
+		                       vk::AccessFlagBits::eIndirectCommandRead );
+	} else if (_config.record_threads > 0) {
+		// A culled frame is a handful of indirect draws; not worth splitting.
+		main_pass.secondary_command_buffers();
+	}
+	ids.main_pass = main_pass.index();
 
-	_renderpass = _gpu._logical_device.createRenderPass( renderpass_create_info );
+	_frame_graph.compile();
+	_renderpass = _frame_graph.render_pass( ids.main_pass );
+	_frame_graph.print_statistics( std::cout );
 }
 
 void
-window::destroy_renderpass()
+window::destroy_frame_graph()
 {
-	_gpu._logical_device.destroyRenderPass( _renderpass );
+	_frame_graph.reset()();
+	_frame_graph.destroy();
 }
 
 void
-window::destroy_graphics_pipeline()
+window::create_pipeline_cache()
 {
-	_gpu._logical_device.destroyPipeline( _graphics_pipeline );
+	mapped_file file;
+	byte_span data;
+	if (!_config.pipeline_cache_path.empty() && file_exists( _config.pipeline_cache_path.c_str() )) {
+		// An unreadable cache only costs a cold start.
+		try {
+			file = mapped_file( _config.pipeline_cache_path.c_str() );
+			data = file.span();
+		} catch (const std::exception &e) {
+			std::cout << "Ignoring pipeline cache: " << e.what() << std::endl;
+		}
+	}
+	if (data.size > 0) {
+		// VkPipelineCacheHeaderVersionOne; data written by another driver or
+		// device is dropped instead of being handed to the implementation.
+		struct {
+			uint32_t header_size;
+			uint32_t header_version;
+			uint32_t vendor_id;
+			uint32_t device_id;
+			uint8_t uuid[VK_UUID_SIZE];
+		} header;
+		const auto &props = _gpu._physical_device_properties;
+		bool valid = data.size >= sizeof(header);
+		if (valid) {
+			std::memcpy( &header, data.data, sizeof(header) );
+			valid = header.header_size >= sizeof(header) && header.header_size <= data.size
+				&& header.header_version == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+				&& header.vendor_id == props.vendorID && header.device_id == props.deviceID
+				&& std::memcmp( header.uuid, props.pipelineCacheUUID, VK_UUID_SIZE ) == 0;
+		}
+		if (!valid) {
+			std::cout << "Ignoring pipeline cache " << _config.pipeline_cache_path << ": written by another device"
+				<< std::endl;
+			data = byte_span();
+		}
+	}
+	_pipeline_cache_warm = data.size > 0;
+
+	vk::PipelineCacheCreateInfo pipeline_cache_create_info;
+	pipeline_cache_create_info.setInitialDataSize( data.size )
+	                          .setPInitialData( data.data );
+	_pipeline_cache = _gpu._logical_device.createPipelineCache( pipeline_cache_create_info );
 }
 
 void
-window::create_framebuffers()
+window::destroy_pipeline_cache()
 {
-	_swapchain.framebuffers.clear();
-	_swapchain.framebuffers.reserve( _swapchain.image_count );
-	for (auto &&view : _swapchain.image_views) {
-		vk::FramebufferCreateInfo framebuffer_create_info;
-		framebuffer_create_info.setRenderPass( _renderpass )
-		                       .setAttachmentCount( 1 )
-		                       .setPAttachments( &view )
-		                       .setWidth( _swapchain.chosen_extent.width )
-		                       .setHeight( _swapchain.chosen_extent.height )
-		                       .setLayers( 1 );
-
-		_swapchain.framebuffers.emplace_back( _gpu._logical_device.createFramebuffer( framebuffer_create_info ) );
+	if (!_config.pipeline_cache_path.empty()) {
+		auto data = _gpu._logical_device.getPipelineCacheData( _pipeline_cache );
+		try {
+			write_file_atomic( _config.pipeline_cache_path.c_str(), data.data(), data.size() );
+		} catch (const std::exception &e) {
+			std::cout << "Could not save pipeline cache: " << e.what() << std::endl;
+		}
 	}
+	_gpu._logical_device.destroyPipelineCache( _pipeline_cache );
 }
 
 void
-window::destroy_framebuffers()
+window::destroy_graphics_pipeline()
 {
-	for (auto &&framebuffer : _swapchain.framebuffers) {
-		_gpu._logical_device.destroyFramebuffer( framebuffer );
-		framebuffer = VK_NULL_HANDLE;
+	_gpu._logical_device.destroyPipeline( _graphics_pipeline );
+	if (_depth_prepass_pipeline) {
+		_gpu._logical_device.destroyPipeline( _depth_prepass_pipeline );
 	}
 }
 
@@ -723,7 +1337,8 @@ void
 window::create_commandpool()
 {
 	vk::CommandPoolCreateInfo command_pool_create_info;
-	command_pool_create_info.setQueueFamilyIndex( _gpu._graphics_family_index );
+	command_pool_create_info.setQueueFamilyIndex( _gpu._graphics_family_index )
+	                        .setFlags( vk::CommandPoolCreateFlagBits::eResetCommandBuffer );
 
 	_command_pool = _gpu._logical_device.createCommandPool( command_pool_create_info );
 }
@@ -738,127 +1353,1010 @@ window::destroy_commandpool()
 void
 window::create_command_buffers()
 {
-	if (_command_buffers.size() > 0) {
-		_gpu._logical_device
-		    .freeCommandBuffers( _command_pool, ( uint32_t ) _command_buffers.size(), _command_buffers.data() );
-	}
 	vk::CommandBufferAllocateInfo command_buffer_allocate_info;
-	command_buffer_allocate_info.setCommandBufferCount( ( uint32_t ) _swapchain.framebuffers.size() )
+	command_buffer_allocate_info.setCommandBufferCount( _config.frames_in_flight )
 	                            .setCommandPool( _command_pool )
 	                            .setLevel( vk::CommandBufferLevel::ePrimary );
 
-	_command_buffers = _gpu._logical_device.allocateCommandBuffers( command_buffer_allocate_info );
+	auto command_buffers = _gpu._logical_device.allocateCommandBuffers( command_buffer_allocate_info );
+
+	_frames.resize( _config.frames_in_flight );
+	for (uint32_t i = 0; i < _config.frames_in_flight; ++i) {
+		_frames[ i ].command_buffer = command_buffers[ i ];
+	}
+
+	if (_config.record_threads == 0) {
+		return;
+	}
+	_jobs.reset( new job_system( _config.record_threads ) );
+	for (auto &frame : _frames) {
+		frame.recorders.resize( _jobs->thread_count() );
+		for (auto &recorder : frame.recorders) {
+			vk::CommandPoolCreateInfo command_pool_create_info;
+			command_pool_create_info.setQueueFamilyIndex( _gpu._graphics_family_index )
+			                        .setFlags( vk::CommandPoolCreateFlagBits::eTransient );
+			recorder.pool = _gpu._logical_device.createCommandPool( command_pool_create_info );
+
+			vk::CommandBufferAllocateInfo secondary_allocate_info;
+			secondary_allocate_info.setCommandBufferCount( 1 )
+			                       .setCommandPool( recorder.pool )
+			                       .setLevel( vk::CommandBufferLevel::eSecondary );
+			recorder.secondary = _gpu._logical_device.allocateCommandBuffers( secondary_allocate_info )[ 0 ];
+			frame.secondaries.push_back( recorder.secondary );
+		}
+	}
+}
+
+void
+window::destroy_command_buffers()
+{
+	for (auto &frame : _frames) {
+		for (auto &recorder : frame.recorders) {
+			_gpu._logical_device.destroyCommandPool( recorder.pool );
+		}
+		frame.recorders.clear();
+		frame.secondaries.clear();
+	}
+	if (_jobs) {
+		_jobs->print_statistics( std::cout );
+	}
+	_jobs.reset();
+}
+
+void
+window::record_command_buffer( vk::CommandBuffer cmd, uint32_t slot, uint32_t image_index )
+{
+	vk::CommandBufferBeginInfo begin_info;
+	begin_info.setFlags( vk::CommandBufferUsageFlagBits::eOneTimeSubmit );
+	cmd.begin( begin_info );
+	_profiler.begin_frame( cmd, slot );
+
+	if (!_uploads.pending_acquires.empty() || !_uploads.pending_image_acquires.empty()) {
+		// Take ownership of buffers and images released by the transfer
+		// queue; the submission waits on the uploads' semaphores first.
+		cmd.pipelineBarrier( vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eAllCommands,
+		                     vk::DependencyFlags(), nullptr, _uploads.pending_acquires,
+		                     _uploads.pending_image_acquires );
+		_uploads.pending_acquires.clear();
+		_uploads.pending_image_acquires.clear();
+	}
+
+	// Written once per frame; every draw of the frame binds it at this
+	// dynamic offset.
+	_frames[ slot ].camera_offset = push_uniforms( slot, &_camera, sizeof(_camera) );
+	if (!_config.gpu_culling) {
+		resolve_pipeline_variants();
+		if (_config.sort_draws) {
+			sort_draws();
+		}
+	}
+
+	auto &ids = _frame_graph_ids;
+	_frame_graph.bind_image( ids.backbuffer, _swapchain.swapchain_images[ image_index ],
+	                         _swapchain.image_views[ image_index ] );
+	if (_config.gpu_culling) {
+		_frame_graph.bind_buffer( ids.draw_commands, _culling.commands, slot * _culling.commands_stride,
+		                          _culling.commands_stride );
+		_frame_graph.bind_buffer( ids.draw_counts, _culling.counts, slot * _culling.counts_stride,
+		                          sizeof(uint32_t) );
+	}
+	_frame_graph.execute( cmd, slot, _frames[ slot ].arena );
+	_profiler.end_frame( cmd );
+	cmd.end();
+}
+
+void
+window::record_main_pass( vk::CommandBuffer cmd, const render_graph::pass_context &context )
+{
+	auto slot = context.frame;
+	if (!_jobs || _config.gpu_culling) {
+		record_draws( cmd, slot, 0, ( uint32_t ) _draw_list.size() );
+	} else {
+		auto &frame = _frames[ slot ];
+		auto parts = ( uint32_t ) frame.recorders.size();
+		auto draw_count = ( uint32_t ) _draw_list.size();
+		_jobs->parallel_for( parts, 1, [&]( uint32_t part, uint32_t ) {
+			// Pools are externally synchronized: each one is only touched by
+			// the job recording its part, and the slot's fence has already
+			// signaled.
+			auto &recorder = frame.recorders[ part ];
+			_gpu._logical_device.resetCommandPool( recorder.pool, vk::CommandPoolResetFlags() );
+
+			vk::CommandBufferInheritanceInfo inheritance_info;
+			inheritance_info.setRenderPass( context.render_pass )
+			                .setSubpass( 0 )
+			                .setFramebuffer( context.framebuffer )
+			                .setPipelineStatistics( _profiler.pipeline_statistics() );
+			vk::CommandBufferBeginInfo secondary_begin_info;
+			secondary_begin_info.setFlags( vk::CommandBufferUsageFlagBits::eOneTimeSubmit
+				                           | vk::CommandBufferUsageFlagBits::eRenderPassContinue )
+			                    .setPInheritanceInfo( &inheritance_info );
+			recorder.secondary.begin( secondary_begin_info );
+			record_draws( recorder.secondary, slot, ( uint32_t ) (( uint64_t ) draw_count * part / parts),
+			              ( uint32_t ) (( uint64_t ) draw_count * (part + 1) / parts) );
+			recorder.secondary.end();
+		} );
+
+		// Executed in part order, which keeps the draw list order.
+		cmd.executeCommands( frame.secondaries );
+	}
+}
+
+void
+window::record_draws( vk::CommandBuffer cmd, uint32_t slot, uint32_t first_draw, uint32_t end_draw )
+{
+	cmd.bindPipeline( vk::PipelineBindPoint::eGraphics, _graphics_pipeline );
+
+	vk::Viewport viewport;
+	viewport.setX( 0 )
+	        .setY( 0 )
+	        .setWidth( ( float ) _swapchain.chosen_extent.width )
+	        .setHeight( ( float ) _swapchain.chosen_extent.height )
+	        .setMinDepth( 0 )
+	        .setMaxDepth( 1 );
+	cmd.setViewport( 0, viewport );
+	cmd.setScissor( 0, vk::Rect2D( { 0, 0 }, _swapchain.chosen_extent ) );
+	// Every vertex stream of the mesh is a range of _vertex_buffer.
+	vk::Buffer buffers[3];
+	vk::DeviceSize offsets[3];
+	auto stream_count = ( uint32_t ) _mesh.stream_offsets.size();
+	for (uint32_t i = 0; i < stream_count; ++i) {
+		buffers[ i ] = _vertex_buffer;
+		offsets[ i ] = _mesh.stream_offsets[ i ];
+	}
+	buffers[ stream_count ] = _instances.buffer;
+	offsets[ stream_count ] = _frames[ slot ].instance_offset;
+	cmd.bindVertexBuffers( 0, { stream_count + 1, buffers }, { stream_count + 1, offsets } );
+	cmd.bindIndexBuffer( _index_buffer, 0, _mesh.index_type );
+	cmd.bindDescriptorSets( vk::PipelineBindPoint::eGraphics, _pipeline_layout, 0, _frames[ slot ].uniform_set,
+	                        _frames[ slot ].camera_offset );
+	if (_config.gpu_culling) {
+		auto texture = _draw_list.empty() ? texture_streamer::no_texture : _draw_list[ 0 ].texture;
+		cmd.bindDescriptorSets( vk::PipelineBindPoint::eGraphics, _pipeline_layout, 1,
+		                        _textures.descriptor_set( texture ), nullptr );
+		glm::mat4 identity( 1.0f );
+		cmd.pushConstants( _pipeline_layout, vk::ShaderStageFlagBits::eVertex, 0, sizeof(identity), &identity );
+		auto commands_offset = slot * _culling.commands_stride;
+		auto stride = ( uint32_t ) sizeof(VkDrawIndexedIndirectCommand);
+		if (_culling.draw_indexed_indirect_count) {
+			reinterpret_cast<draw_indexed_indirect_count_fn>( _culling.draw_indexed_indirect_count )(
+				static_cast<VkCommandBuffer>( cmd ), static_cast<VkBuffer>( _culling.commands ), commands_offset,
+				static_cast<VkBuffer>( _culling.counts ), slot * _culling.counts_stride, _instances.count, stride );
+		} else if (_gpu._physical_device_features.multiDrawIndirect) {
+			cmd.drawIndexedIndirect( _culling.commands, commands_offset, _instances.count, stride );
+		} else {
+			for (uint32_t i = 0; i < _instances.count; ++i) {
+				cmd.drawIndexedIndirect( _culling.commands, commands_offset + i * stride, 1, stride );
+			}
+		}
+		return;
+	}
+	if (_depth_prepass_pipeline) {
+		// The depth of the range's opaque draws goes first. With several
+		// recording threads every part has its own pre-pass, so draws see
+		// the depth of the parts before theirs but not of those after.
+		cmd.bindPipeline( vk::PipelineBindPoint::eGraphics, _depth_prepass_pipeline );
+		for (uint32_t i = first_draw; i < end_draw; ++i) {
+			const auto &draw = _draw_list[ _draw_order[ i ] ];
+			const auto &variant = _pipeline_variants[ draw.pipeline_variant ];
+			// Blended draws hide nothing, and wireframe ones only their
+			// edges.
+			if (variant.blend_enable || variant.polygon_mode != vk::PolygonMode::eFill) {
+				continue;
+			}
+			if (!_variant_pipelines[ draw.pipeline_variant ] && _config.skip_pending_pipelines) {
+				continue;
+			}
+			cmd.pushConstants( _pipeline_layout, vk::ShaderStageFlagBits::eVertex, 0, sizeof(draw.transform),
+			                   &draw.transform );
+			cmd.drawIndexed( draw.index_count, draw.instance_count, draw.first_index, draw.vertex_offset,
+			                 draw.first_instance );
+		}
+		cmd.bindPipeline( vk::PipelineBindPoint::eGraphics, _graphics_pipeline );
+	}
+	auto bound_pipeline = _graphics_pipeline;
+	vk::DescriptorSet bound_texture;
+	for (uint32_t i = first_draw; i < end_draw; ++i) {
+		const auto &draw = _draw_list[ _draw_order[ i ] ];
+		auto pipeline = _variant_pipelines[ draw.pipeline_variant ];
+		if (!pipeline) {
+			if (_config.skip_pending_pipelines) {
+				continue;
+			}
+			pipeline = _graphics_pipeline;
+		}
+		if (pipeline != bound_pipeline) {
+			// Viewport and scissor are dynamic in every variant and carry over.
+			cmd.bindPipeline( vk::PipelineBindPoint::eGraphics, pipeline );
+			bound_pipeline = pipeline;
+		}
+		auto texture = _textures.descriptor_set( draw.texture );
+		if (texture != bound_texture) {
+			cmd.bindDescriptorSets( vk::PipelineBindPoint::eGraphics, _pipeline_layout, 1, texture, nullptr );
+			bound_texture = texture;
+		}
+		cmd.pushConstants( _pipeline_layout, vk::ShaderStageFlagBits::eVertex, 0, sizeof(draw.transform),
+		                   &draw.transform );
+		cmd.drawIndexed( draw.index_count, draw.instance_count, draw.first_index, draw.vertex_offset,
+		                 draw.first_instance );
+	}
+}
+
+void
+window::create_draw_list()
+{
+	// Every draw covers its own run of instances, so the same quads are
+	// drawn whether they go out as many draws or as one instanced draw.
+	// With depth layers, each layer repeats the same instance layout one
+	// step closer to the camera, so declaration order is back to front.
+	_draw_list.resize( _config.draw_count );
+	_draw_order.resize( _config.draw_count );
+	auto draws_per_layer = _config.draw_count / _config.depth_layers;
+	for (uint32_t i = 0; i < _config.draw_count; ++i) {
+		_draw_list[ i ].index_count = _mesh.index_count;
+		_draw_list[ i ].instance_count = _config.instances_per_draw;
+		_draw_list[ i ].first_instance = i * _config.instances_per_draw;
+		_draw_list[ i ].pipeline_variant = i % _config.pipeline_variants;
+		if (!_texture_ids.empty()) {
+			_draw_list[ i ].texture = _texture_ids[ i % _texture_ids.size() ];
+		}
+		if (_config.depth_layers > 1) {
+			float depth = 1.0f - (( float ) (i / draws_per_layer) + 0.5f) / _config.depth_layers;
+			_draw_list[ i ].transform[ 3 ][ 2 ] = depth;
+		}
+		_draw_order[ i ] = i;
+	}
+	_instances.count = _config.draw_count * _config.instances_per_draw;
+}
+
+void
+window::create_textures()
+{
+	texture_streamer::settings settings;
+	settings.thread_count = _config.texture_threads;
+	settings.budget = _config.texture_budget;
+	settings.upload_bytes_per_update = _config.texture_upload_per_frame;
+
+	texture_streamer::upload_hooks hooks;
+	hooks.begin_image = [this]( vk::Image image, uint32_t level_count ) {
+		begin_image_upload( image, level_count );
+	};
+	hooks.copy = [this]( vk::Image image, const void *data, vk::DeviceSize size, vk::DeviceSize alignment,
+	                     const vk::BufferImageCopy &region ) {
+		return upload_image_region( image, data, size, alignment, region );
+	};
+	hooks.end_image = [this]( vk::Image image, uint32_t level_count ) {
+		end_image_upload( image, level_count );
+	};
+	_textures.create( _gpu._physical_device, _gpu._logical_device, _allocator, settings, hooks,
+	                  [this]( std::function<void()> destroy ) {
+		                  defer_destroy( std::move( destroy ) );
+	                  } );
+	for (auto &path : _config.texture_paths) {
+		_texture_ids.push_back( _textures.add( path ) );
+	}
+}
+
+void
+window::request_textures()
+{
+	// Same grid as update_instances(); the texture spans the built-in
+	// quad's side, scaled like the instances.
+	auto layer_count = std::max<uint32_t>( _instances.count / _config.depth_layers, 1 );
+	auto columns = ( uint32_t ) std::ceil( std::sqrt( ( double ) layer_count ) );
+	float scale = (layer_count > 1 ? 2.0f / columns : 1.0f) * _mesh.fit_scale;
+	auto screen_size = ( uint32_t ) std::ceil( scale * 0.5f * std::max( _swapchain.chosen_extent.width,
+	                                                                     _swapchain.chosen_extent.height ) );
+	for (auto &draw : _draw_list) {
+		_textures.request( draw.texture, screen_size );
+	}
+}
+
+void
+window::sort_draws()
+{
+	_sort_keys.resize( _draw_list.size() );
+	for (uint32_t i = 0; i < _draw_list.size(); ++i) {
+		const auto &draw = _draw_list[ i ];
+		auto clip = _camera.view_proj * draw.transform * glm::vec4( 0.0f, 0.0f, 0.0f, 1.0f );
+		float depth = clip.w > 0 ? glm::clamp( clip.z / clip.w, 0.0f, 1.0f ) : 1.0f;
+		auto quantized = ( uint64_t ) (depth * 0xffffff);
+		bool blended = _pipeline_variants[ draw.pipeline_variant ].blend_enable;
+		if (blended) {
+			quantized = 0xffffff - quantized;
+		}
+		_sort_keys[ i ] = (( uint64_t ) blended << 63) | (quantized << 39) | (( uint64_t ) draw.pipeline_variant << 32)
+			| i;
+	}
+	radix_sort( _sort_keys, _sort_scratch );
+	for (uint32_t i = 0; i < _draw_list.size(); ++i) {
+		_draw_order[ i ] = ( uint32_t ) _sort_keys[ i ];
+	}
+}
+
+void
+window::create_pipeline_layout()
+{
+	// Set 0 holds the per-frame uniforms, bound with a dynamic offset into
+	// the frame's uniform ring.
+	vk::DescriptorSetLayoutBinding uniform_binding;
+	uniform_binding.setBinding( 0 )
+	               .setDescriptorType( vk::DescriptorType::eUniformBufferDynamic )
+	               .setDescriptorCount( 1 )
+	               .setStageFlags( vk::ShaderStageFlagBits::eVertex );
+	vk::DescriptorSetLayoutCreateInfo set_layout_create_info;
+	set_layout_create_info.setBindingCount( 1 ).setPBindings( &uniform_binding );
+	_uniform_set_layout = _gpu._logical_device.createDescriptorSetLayout( set_layout_create_info );
+
+	// Set 1 is the draw's texture, owned by the texture streamer. Per-object
+	// data goes through push constants.
+	const vk::DescriptorSetLayout set_layouts[] = { _uniform_set_layout, _textures.set_layout() };
+	vk::PushConstantRange push_constant_range( vk::ShaderStageFlagBits::eVertex, 0, sizeof(glm::mat4) );
+	vk::PipelineLayoutCreateInfo pipeline_layout_create_info;
+	pipeline_layout_create_info.setSetLayoutCount( 2 )
+	                           .setPSetLayouts( set_layouts )
+	                           .setPushConstantRangeCount( 1 )
+	                           .setPPushConstantRanges( &push_constant_range );
+	_pipeline_layout = _gpu._logical_device.createPipelineLayout( pipeline_layout_create_info );
+}
 
-	for (int i = 0; i < _command_buffers.size(); ++i) {
-		vk::CommandBufferBeginInfo begin_info;
-		begin_info.setFlags( vk::CommandBufferUsageFlagBits::eSimultaneousUse );
-		_command_buffers[ i ].begin( begin_info );
+void
+window::destroy_pipeline_layout()
+{
+	_gpu._logical_device.destroyPipelineLayout( _pipeline_layout );
+	_gpu._logical_device.destroyDescriptorSetLayout( _uniform_set_layout );
+}
 
-		vk::ClearColorValue clear_color_value;
-		clear_color_value.setFloat32( { 0.0f, 0.0f, 0.0f, 1.0f } );
-		vk::ClearValue clear_value( clear_color_value );
-		vk::RenderPassBeginInfo render_pass_begin_info;
-		render_pass_begin_info.setRenderPass( _renderpass )
-		                      .setFramebuffer( _swapchain.framebuffers[ i ] )
-		                      .setRenderArea( { { 0, 0 }, _swapchain.chosen_extent } )
-		                      .setClearValueCount( 1 )
-		                      .setPClearValues( &clear_value );
+void
+window::create_uniform_buffers()
+{
+	vk::DescriptorPoolSize pool_size( vk::DescriptorType::eUniformBufferDynamic, ( uint32_t ) _frames.size() );
+	vk::DescriptorPoolCreateInfo pool_create_info;
+	pool_create_info.setMaxSets( ( uint32_t ) _frames.size() ).setPoolSizeCount( 1 ).setPPoolSizes( &pool_size );
+	_uniform_descriptor_pool = _gpu._logical_device.createDescriptorPool( pool_create_info );
+
+	std::vector<vk::DescriptorSetLayout> set_layouts( _frames.size(), _uniform_set_layout );
+	vk::DescriptorSetAllocateInfo set_allocate_info;
+	set_allocate_info.setDescriptorPool( _uniform_descriptor_pool )
+	                 .setDescriptorSetCount( ( uint32_t ) set_layouts.size() )
+	                 .setPSetLayouts( set_layouts.data() );
+	auto sets = _gpu._logical_device.allocateDescriptorSets( set_allocate_info );
+
+	for (uint32_t i = 0; i < _frames.size(); ++i) {
+		auto &frame = _frames[ i ];
+		std::tie( frame.uniform_buffer, frame.uniform_memory ) =
+			create_buffer( _config.uniform_ring_size, vk::BufferUsageFlagBits::eUniformBuffer,
+			               vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent );
+		frame.uniform_set = sets[ i ];
+
+		vk::DescriptorBufferInfo buffer_info( frame.uniform_buffer, 0, sizeof(frame_uniforms) );
+		vk::WriteDescriptorSet write;
+		write.setDstSet( frame.uniform_set )
+		     .setDstBinding( 0 )
+		     .setDescriptorCount( 1 )
+		     .setDescriptorType( vk::DescriptorType::eUniformBufferDynamic )
+		     .setPBufferInfo( &buffer_info );
+		_gpu._logical_device.updateDescriptorSets( write, nullptr );
+	}
+}
 
-		_command_buffers[ i ].beginRenderPass( render_pass_begin_info, vk::SubpassContents::eInline );
-		_command_buffers[ i ].bindPipeline( vk::PipelineBindPoint::eGraphics, _graphics_pipeline );
-		_command_buffers[ i ].bindVertexBuffers( 0, _vertex_buffer, { 0 } );
-		_command_buffers[ i ].bindIndexBuffer( _index_buffer, 0, vk::IndexType::eUint16 );
-		_command_buffers[i].drawIndexed(_indices.size(), 1, 0, 0, 0);
-		_command_buffers[ i ].endRenderPass();
-		_command_buffers[ i ].end();
+void
+window::destroy_uniform_buffers()
+{
+	for (auto &frame : _frames) {
+		_allocator.free( frame.uniform_memory );
+		_gpu._logical_device.destroyBuffer( frame.uniform_buffer );
+	}
+	_gpu._logical_device.destroyDescriptorPool( _uniform_descriptor_pool );
+}
+
+uint32_t
+window::push_uniforms( uint32_t slot, const void *data, vk::DeviceSize size )
+{
+	auto &frame = _frames[ slot ];
+	auto offset = align_up( frame.uniform_head,
+	                        _gpu._physical_device_properties.limits.minUniformBufferOffsetAlignment );
+	if (offset + size > _config.uniform_ring_size) {
+		throw std::runtime_error( "uniform ring exhausted" );
+	}
+	std::memcpy( static_cast<char *>( frame.uniform_memory.mapped ) + offset, data, size );
+	frame.uniform_head = offset + size;
+	return ( uint32_t ) offset;
+}
+
+void
+window::create_instance_buffer()
+{
+	// One region per frame slot; a slot's region is rewritten only after its
+	// fence has signaled, so the GPU never reads a half-written frame. The
+	// culling pass binds the regions as storage buffers.
+	_instances.region_size = align_up( sizeof(instance_data) * std::max<uint32_t>( _instances.count, 1 ),
+	                                   _gpu._physical_device_properties.limits.minStorageBufferOffsetAlignment );
+	std::tie( _instances.buffer, _instances.memory ) =
+		create_buffer( _instances.region_size * _frames.size(),
+		               vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eStorageBuffer,
+		               vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent );
+	for (size_t i = 0; i < _frames.size(); ++i) {
+		_frames[ i ].instance_offset = _instances.region_size * i;
+	}
+}
+
+void
+window::create_cull_resources()
+{
+	if (!(_gpu._queue_family_properties[ _gpu._graphics_family_index ].queueFlags & vk::QueueFlagBits::eCompute)) {
+		throw std::runtime_error( "GPU culling needs a graphics queue with compute support" );
+	}
+	// Every command draws its object as firstInstance.
+	if (!_gpu._physical_device_features.drawIndirectFirstInstance) {
+		throw std::runtime_error( "GPU culling needs the drawIndirectFirstInstance feature" );
+	}
+	auto storage_alignment = _gpu._physical_device_properties.limits.minStorageBufferOffsetAlignment;
+	auto object_count = std::max<uint32_t>( _instances.count, 1 );
+
+	// Commands stay on the device; the counts are host-visible so they can
+	// be read back once a frame's fence has signaled.
+	_culling.commands_stride = align_up( sizeof(VkDrawIndexedIndirectCommand) * object_count, storage_alignment );
+	std::tie( _culling.commands, _culling.commands_memory ) =
+		create_buffer( _culling.commands_stride * _frames.size(),
+		               vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer,
+		               vk::MemoryPropertyFlagBits::eDeviceLocal );
+	_culling.counts_stride = align_up( sizeof(uint32_t), storage_alignment );
+	std::tie( _culling.counts, _culling.counts_memory ) =
+		create_buffer( _culling.counts_stride * _frames.size(),
+		               vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer
+		               | vk::BufferUsageFlagBits::eTransferDst,
+		               vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent );
+
+	vk::DescriptorSetLayoutBinding bindings[3];
+	for (uint32_t i = 0; i < 3; ++i) {
+		bindings[ i ].setBinding( i )
+		             .setDescriptorType( vk::DescriptorType::eStorageBuffer )
+		             .setDescriptorCount( 1 )
+		             .setStageFlags( vk::ShaderStageFlagBits::eCompute );
+	}
+	vk::DescriptorSetLayoutCreateInfo set_layout_create_info;
+	set_layout_create_info.setBindingCount( 3 ).setPBindings( bindings );
+	_culling.set_layout = _gpu._logical_device.createDescriptorSetLayout( set_layout_create_info );
+
+	vk::DescriptorPoolSize pool_size( vk::DescriptorType::eStorageBuffer, 3 * ( uint32_t ) _frames.size() );
+	vk::DescriptorPoolCreateInfo pool_create_info;
+	pool_create_info.setMaxSets( ( uint32_t ) _frames.size() ).setPoolSizeCount( 1 ).setPPoolSizes( &pool_size );
+	_culling.descriptor_pool = _gpu._logical_device.createDescriptorPool( pool_create_info );
+
+	std::vector<vk::DescriptorSetLayout> set_layouts( _frames.size(), _culling.set_layout );
+	vk::DescriptorSetAllocateInfo set_allocate_info;
+	set_allocate_info.setDescriptorPool( _culling.descriptor_pool )
+	                 .setDescriptorSetCount( ( uint32_t ) set_layouts.size() )
+	                 .setPSetLayouts( set_layouts.data() );
+	auto sets = _gpu._logical_device.allocateDescriptorSets( set_allocate_info );
+	for (uint32_t i = 0; i < _frames.size(); ++i) {
+		_frames[ i ].cull_set = sets[ i ];
+
+		vk::DescriptorBufferInfo buffer_infos[3] = {
+			{ _instances.buffer, _frames[ i ].instance_offset, _instances.region_size },
+			{ _culling.commands, i * _culling.commands_stride, _culling.commands_stride },
+			{ _culling.counts, i * _culling.counts_stride, sizeof(uint32_t) },
+		};
+		vk::WriteDescriptorSet write;
+		write.setDstSet( sets[ i ] )
+		     .setDstBinding( 0 )
+		     .setDescriptorCount( 3 )
+		     .setDescriptorType( vk::DescriptorType::eStorageBuffer )
+		     .setPBufferInfo( buffer_infos );
+		_gpu._logical_device.updateDescriptorSets( write, nullptr );
+	}
+
+	vk::PushConstantRange push_constant_range( vk::ShaderStageFlagBits::eCompute, 0, sizeof(cull_params) );
+	vk::PipelineLayoutCreateInfo pipeline_layout_create_info;
+	pipeline_layout_create_info.setSetLayoutCount( 1 )
+	                           .setPSetLayouts( &_culling.set_layout )
+	                           .setPushConstantRangeCount( 1 )
+	                           .setPPushConstantRanges( &push_constant_range );
+	_culling.pipeline_layout = _gpu._logical_device.createPipelineLayout( pipeline_layout_create_info );
+
+	_culling.pipeline = build_cull_pipeline( std::string() );
+
+	std::cout << "GPU culling: " << object_count << " objects, draw count "
+		<< (_culling.draw_indexed_indirect_count ? _gpu._draw_indirect_count_extension
+		                                         : std::string( "read back only" )) << std::endl;
+}
+
+vk::Pipeline
+window::build_cull_pipeline( const std::string &override_dir )
+{
+	auto compute_module = create_shader_module( "cull.comp.spv", override_dir );
+	BOOST_SCOPE_EXIT( compute_module, &_gpu )
+		{
+			_gpu._logical_device.destroyShaderModule( compute_module );
+		}
+
+		BOOST_SCOPE_EXIT_END
+
+	vk::ComputePipelineCreateInfo pipeline_create_info;
+	pipeline_create_info.setLayout( _culling.pipeline_layout );
+	pipeline_create_info.stage.setStage( vk::ShaderStageFlagBits::eCompute )
+	                          .setModule( compute_module )
+	                          .setPName( "main" );
+	return _gpu._logical_device.createComputePipeline( _pipeline_cache, pipeline_create_info );
+}
+
+void
+window::destroy_cull_resources()
+{
+	_gpu._logical_device.destroyPipeline( _culling.pipeline );
+	_gpu._logical_device.destroyPipelineLayout( _culling.pipeline_layout );
+	_gpu._logical_device.destroyDescriptorPool( _culling.descriptor_pool );
+	_gpu._logical_device.destroyDescriptorSetLayout( _culling.set_layout );
+	_allocator.free( _culling.commands_memory );
+	_gpu._logical_device.destroyBuffer( _culling.commands );
+	_allocator.free( _culling.counts_memory );
+	_gpu._logical_device.destroyBuffer( _culling.counts );
+}
+
+void
+window::record_cull( vk::CommandBuffer cmd, uint32_t slot )
+{
+	auto counts_offset = slot * _culling.counts_stride;
+	cmd.fillBuffer( _culling.counts, counts_offset, sizeof(uint32_t), 0 );
+	vk::BufferMemoryBarrier clear_barrier;
+	clear_barrier.setSrcAccessMask( vk::AccessFlagBits::eTransferWrite )
+	             .setDstAccessMask( vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite )
+	             .setSrcQueueFamilyIndex( VK_QUEUE_FAMILY_IGNORED )
+	             .setDstQueueFamilyIndex( VK_QUEUE_FAMILY_IGNORED )
+	             .setBuffer( _culling.counts )
+	             .setOffset( counts_offset )
+	             .setSize( sizeof(uint32_t) );
+	cmd.pipelineBarrier( vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eComputeShader,
+	                     vk::DependencyFlags(), nullptr, clear_barrier, nullptr );
+
+	cull_params params;
+	auto planes = frustum_planes( _camera.view_proj );
+	std::copy( planes.begin(), planes.end(), params.planes );
+	params.object_count = _instances.count;
+	params.index_count = _mesh.index_count;
+	params.first_index = 0;
+	params.vertex_offset = 0;
+	params.radius = _mesh.radius * _mesh.fit_scale;
+	params.compact = _culling.draw_indexed_indirect_count ? 1 : 0;
+
+	cmd.bindPipeline( vk::PipelineBindPoint::eCompute, _culling.pipeline );
+	cmd.bindDescriptorSets( vk::PipelineBindPoint::eCompute, _culling.pipeline_layout, 0, _frames[ slot ].cull_set,
+	                        nullptr );
+	cmd.pushConstants( _culling.pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0, sizeof(params), &params );
+	cmd.dispatch( (_instances.count + 63) / 64, 1, 1 );
+}
+
+void
+window::collect_cull_results( uint32_t slot, uint64_t frame_number )
+{
+	auto count = *reinterpret_cast<const uint32_t *>( static_cast<const char *>( _culling.counts_memory.mapped )
+	                                                  + slot * _culling.counts_stride );
+	if (_config.record_timings && frame_number < _frame_timings.size()) {
+		_frame_timings[ frame_number ].visible_draws = count;
+	}
+}
+
+void
+window::destroy_instance_buffer()
+{
+	_allocator.free( _instances.memory );
+	_gpu._logical_device.destroyBuffer( _instances.buffer );
+}
+
+void
+window::update_instances( uint32_t slot )
+{
+	// Lays the quads out on a square grid that sways sideways, partly off
+	// screen, and spins each one a little out of phase with its neighbours.
+	// Every depth layer gets the same grid.
+	auto layer_count = std::max<uint32_t>( _instances.count / _config.depth_layers, 1 );
+	auto columns = ( uint32_t ) std::ceil( std::sqrt( ( double ) layer_count ) );
+	float cell = 2.0f / columns;
+	float time = ( float ) _frame_number / 60.0f;
+	float sway = 0.5f * std::sin( time * 0.5f );
+
+	auto instances = reinterpret_cast<instance_data *>( static_cast<char *>( _instances.memory.mapped )
+	                                                    + _frames[ slot ].instance_offset );
+	auto fill = [&]( uint32_t begin, uint32_t end ) {
+		for (uint32_t i = begin; i < end; ++i) {
+			uint32_t j = i % layer_count;
+			uint32_t x = j % columns;
+			uint32_t y = j / columns;
+			instances[ i ].transform = glm::vec4( -1.0f + cell * (x + 0.5f) + sway, -1.0f + cell * (y + 0.5f),
+			                                      (layer_count > 1 ? cell : 1.0f) * _mesh.fit_scale,
+			                                      time + j * 0.01f );
+			instances[ i ].color = glm::vec4( ( float ) x / columns, ( float ) y / columns, 1.0f, 1.0f );
+		}
+	};
+	if (_jobs) {
+		// Ranges of whole cache lines, so no two jobs write the same one.
+		_jobs->parallel_for( _instances.count, 4096, fill );
+	} else {
+		fill( 0, _instances.count );
+	}
+}
+
+void
+window::collect_gpu_timings( uint32_t slot, uint64_t frame_number )
+{
+	double gpu_ms = _profiler.collect( slot );
+	int64_t fragment_invocations = _profiler.collect_fragment_invocations( slot );
+	if (_config.record_timings && frame_number < _frame_timings.size()) {
+		_frame_timings[ frame_number ].gpu_ms = gpu_ms;
+		_frame_timings[ frame_number ].fragment_invocations = fragment_invocations;
 	}
 }
 
 void
 window::draw_frame()
 {
-	uint32_t image_index = _gpu._logical_device
-	                           .acquireNextImageKHR( _swapchain.swapchain, std::numeric_limits<uint64_t>::max()
-	                                                 ,
-	                                                 _image_available_sem, VK_NULL_HANDLE
-	                           )
-	                           .
-	                           value;
+	auto slot = ( uint32_t ) (_frame_number % _frames.size());
+	auto &frame = _frames[ slot ];
+	frame_timing timing;
+
+	apply_reloaded_pipelines();
+
+	// Texture uploads staged here go out with the flush below, which this
+	// frame waits for.
+	request_textures();
+	_textures.update();
+
+	// Uploads recorded since the last frame are submitted ahead of it;
+	// finished ones give their staging space back without waiting.
+	flush_uploads();
+	retire_uploads( false, _uploads.in_flight.size() );
+	auto wait_start = std::chrono::steady_clock::now();
+
+	// Blocks only when the CPU is a full ring ahead of the GPU; the command
+	// buffer and semaphores of this slot are free to reuse afterwards.
+	_gpu._logical_device.waitForFences( frame.in_flight_fence, VK_TRUE, std::numeric_limits<uint64_t>::max() );
+	if (_frame_number >= _frames.size()) {
+		note_frame_done( _frame_number - _frames.size(), std::chrono::steady_clock::now() );
+		collect_gpu_timings( slot, _frame_number - _frames.size() );
+		if (_config.gpu_culling) {
+			collect_cull_results( slot, _frame_number - _frames.size() );
+		}
+	}
+	run_deletion_queue( false );
+	frame.uniform_head = 0;
+	frame.arena.reset();
+	_uploads.free_semaphores.insert( _uploads.free_semaphores.end(), frame.upload_semaphores.begin(),
+	                                 frame.upload_semaphores.end() );
+	frame.upload_semaphores.swap( _uploads.pending_waits );
+	_uploads.pending_waits.clear();
+	auto acquire_start = std::chrono::steady_clock::now();
+
+	uint32_t image_index;
+	if (_config.headless) {
+		image_index = ( uint32_t ) (_frame_number % _swapchain.image_count);
+	} else {
+		image_index = _gpu._logical_device
+		                  .acquireNextImageKHR( _swapchain.swapchain, std::numeric_limits<uint64_t>::max(),
+		                                        frame.image_available_sem, VK_NULL_HANDLE )
+		                  .value;
+	}
+	auto record_start = std::chrono::steady_clock::now();
+
+	update_instances( slot );
+	_gpu._logical_device.resetFences( frame.in_flight_fence );
+	frame.input_time = _latency.input_time;
+	frame.command_buffer.reset( vk::CommandBufferResetFlags() );
+	record_command_buffer( frame.command_buffer, slot, image_index );
+	auto submit_start = std::chrono::steady_clock::now();
+
+	frame.wait_semaphores.clear();
+	frame.wait_stages.clear();
+	if (!_config.headless) {
+		frame.wait_semaphores.push_back( frame.image_available_sem );
+		frame.wait_stages.push_back( vk::PipelineStageFlagBits::eColorAttachmentOutput );
+	}
+	for (auto semaphore : frame.upload_semaphores) {
+		// Matches the source stage of the ownership acquire barrier.
+		frame.wait_semaphores.push_back( semaphore );
+		frame.wait_stages.push_back( vk::PipelineStageFlagBits::eAllCommands );
+	}
 
-	vk::PipelineStageFlags wait_stages[] = { vk::PipelineStageFlagBits::eColorAttachmentOutput };
 	vk::SubmitInfo submit_info;
-	submit_info.setPWaitSemaphores( &_image_available_sem )
-	           .setWaitSemaphoreCount( 1 )
-	           .setPWaitDstStageMask( wait_stages )
-	           .setCommandBufferCount( 1 )
-	           .setPCommandBuffers( &_command_buffers[ image_index ] )
-	           .setSignalSemaphoreCount( 1 )
-	           .setPSignalSemaphores( &_render_finished_sem );
+	submit_info.setCommandBufferCount( 1 )
+	           .setPCommandBuffers( &frame.command_buffer )
+	           .setWaitSemaphoreCount( ( uint32_t ) frame.wait_semaphores.size() )
+	           .setPWaitSemaphores( frame.wait_semaphores.data() )
+	           .setPWaitDstStageMask( frame.wait_stages.data() );
+	if (!_config.headless) {
+		submit_info.setSignalSemaphoreCount( 1 )
+		           .setPSignalSemaphores( &_swapchain.render_finished_sems[ image_index ] );
+	}
+
+	_gpu._graphics_queue.submit( submit_info, frame.in_flight_fence );
+	auto present_start = std::chrono::steady_clock::now();
 
-	_gpu._graphics_queue.submit( submit_info, VK_NULL_HANDLE );
+	if (!_config.headless) {
+		vk::PresentInfoKHR present_info;
+		present_info.setWaitSemaphoreCount( 1 )
+		            .setPWaitSemaphores( &_swapchain.render_finished_sems[ image_index ] )
+		            .setSwapchainCount( 1 )
+		            .setPSwapchains( &_swapchain.swapchain )
+		            .setPImageIndices( &image_index );
 
-	vk::PresentInfoKHR present_info;
-	present_info.setWaitSemaphoreCount( 1 )
-	            .setPWaitSemaphores( &_render_finished_sem )
-	            .setSwapchainCount( 1 )
-	            .setPSwapchains( &_swapchain.swapchain )
-	            .setPImageIndices( &image_index );
+		_gpu._present_queue.presentKHR( present_info );
+	}
+	auto present_end = std::chrono::steady_clock::now();
+	_latency.blocked_ms = elapsed_ms( wait_start, record_start );
+
+	if (_config.record_timings) {
+		timing.queue_wait_ms = _latency.queue_wait_ms;
+		timing.sleep_ms = _latency.sleep_ms;
+		timing.input_to_present_ms = elapsed_ms( _latency.input_time, present_end );
+		timing.fence_wait_ms = elapsed_ms( wait_start, acquire_start );
+		timing.acquire_ms = elapsed_ms( acquire_start, record_start );
+		timing.record_ms = elapsed_ms( record_start, submit_start );
+		timing.submit_ms = elapsed_ms( submit_start, present_start );
+		timing.present_ms = elapsed_ms( present_start, present_end );
+		_frame_timings.push_back( timing );
+	}
 
-	_gpu._present_queue.presentKHR( present_info );
+	++_frame_number;
 }
 
 void
-window::create_semaphores()
+window::create_frame_resources()
 {
 	vk::SemaphoreCreateInfo semaphore_create_info;
-	_image_available_sem = _gpu._logical_device.createSemaphore( semaphore_create_info );
-	_render_finished_sem = _gpu._logical_device.createSemaphore( semaphore_create_info );
+	vk::FenceCreateInfo fence_create_info;
+	// Start signaled so the first pass over the ring does not wait.
+	fence_create_info.setFlags( vk::FenceCreateFlagBits::eSignaled );
+
+	for (auto &frame : _frames) {
+		frame.image_available_sem = _gpu._logical_device.createSemaphore( semaphore_create_info );
+		frame.in_flight_fence = _gpu._logical_device.createFence( fence_create_info );
+	}
 }
 
 void
-window::destroy_semaphores()
+window::destroy_frame_resources()
 {
-	_gpu._logical_device.destroySemaphore( _image_available_sem );
-	_gpu._logical_device.destroySemaphore( _render_finished_sem );
+	for (auto &frame : _frames) {
+		_gpu._logical_device.destroySemaphore( frame.image_available_sem );
+		_gpu._logical_device.destroyFence( frame.in_flight_fence );
+	}
+	_frames.clear();
 }
 
 void
 window::recreate_swap_chain()
 {
-	_gpu._logical_device.waitIdle();
-
-	destroy_framebuffers();
-	destroy_graphics_pipeline();
-	destroy_renderpass();
-	destroy_image_views();
+	const auto resize_start = std::chrono::steady_clock::now();
+	const auto old_format = _swapchain.chosen_format.format;
+
+	// Frames still in flight reference the old views, framebuffers and
+	// transient images; they are destroyed once those frames have finished
+	// instead of idling the device. The old swapchain is retired by
+	// create_swapchain.
+	auto old_views = std::move( _swapchain.image_views );
+	_swapchain.image_views.clear();
+	defer_destroy( [this, old_views]() {
+		for (auto view : old_views) {
+			_gpu._logical_device.destroyImageView( view );
+		}
+	} );
+	defer_destroy( _frame_graph.reset() );
 
+	query_swapchain_support( _gpu._physical_device );
 	create_swapchain();
 	create_image_views();
-	create_renderpass();
-	create_graphics_pipeline();
-	create_framebuffers();
-	create_command_buffers();
+
+	// A reload or PSO compile building against the render pass would race
+	// with _renderpass being replaced. The graph hands back the same render
+	// pass unless the format changed; cached pipelines stay keyed to the old
+	// format, and the old render pass stays alive in the graph.
+	_pso_cache.wait_idle();
+	std::lock_guard<std::mutex> lock( _hot_reload.mutex );
+	create_frame_graph();
+	if (_swapchain.chosen_format.format != old_format) {
+		auto old_pipeline = _graphics_pipeline;
+		auto old_prepass_pipeline = _depth_prepass_pipeline;
+		defer_destroy( [this, old_pipeline, old_prepass_pipeline]() {
+			_gpu._logical_device.destroyPipeline( old_pipeline );
+			if (old_prepass_pipeline) {
+				_gpu._logical_device.destroyPipeline( old_prepass_pipeline );
+			}
+		} );
+		create_graphics_pipeline();
+		create_pipeline_variants();
+	}
+
+	std::cout << "Swapchain recreated in " << elapsed_ms( resize_start, std::chrono::steady_clock::now() ) << " ms"
+		<< std::endl;
 }
 
 void
-window::create_index_buffer()
+window::start_shader_watcher()
+{
+	// Every embedded module can be reloaded from its GLSL source.
+	std::vector<std::string> sources;
+	for (auto &blob : embedded_spirv) {
+		std::string name = blob.name;
+		sources.push_back( name.substr( 0, name.size() - 4 ) );
+	}
+	_hot_reload.watcher.reset( new shader_watcher( _config.watch_shader_dir, sources, _config.shader_compiler,
+	                                               [this]( const std::string &spirv_name ) {
+		                                               rebuild_pipeline( spirv_name );
+	                                               } ) );
+}
+
+void
+window::rebuild_pipeline( const std::string &spirv_name )
 {
-	vk::DeviceSize size = sizeof(_indices[ 0 ]) * _indices.size();
-	vk::Buffer staging_buffer;
-	vk::DeviceMemory staging_memory;
-	std::tie( staging_buffer, staging_memory ) = create_buffer( size, vk::BufferUsageFlagBits::eTransferSrc, vk::MemoryPropertyFlagBits::eHostCoherent | vk::MemoryPropertyFlagBits::eHostVisible );
-	BOOST_SCOPE_EXIT_ALL(&) {
+	// Runs on the watcher thread. Holding the lock keeps the render pass
+	// alive while the pipeline is built against it.
+	std::lock_guard<std::mutex> lock( _hot_reload.mutex );
+	const auto build_start = std::chrono::steady_clock::now();
+	reloaded_pipeline reloaded;
+	try {
+		if (spirv_name == "cull.comp.spv") {
+			if (!_config.gpu_culling) {
+				return;
+			}
+			reloaded.bind_point = vk::PipelineBindPoint::eCompute;
+			reloaded.pipeline = build_cull_pipeline( _config.watch_shader_dir );
+		} else if (spirv_name == "shader.vert.spv" || spirv_name == "shader.frag.spv") {
+			reloaded.bind_point = vk::PipelineBindPoint::eGraphics;
+			auto description = _graphics_pipeline_description;
+			description.shader_override_dir = _config.watch_shader_dir;
+			reloaded.render_pass = _renderpass;
+			reloaded.pipeline = build_graphics_pipeline( description, _renderpass );
+		} else if (spirv_name == "depth.vert.spv") {
+			if (!_depth_prepass_pipeline) {
+				return;
+			}
+			reloaded.bind_point = vk::PipelineBindPoint::eGraphics;
+			reloaded.depth_prepass = true;
+			auto description = depth_prepass_description();
+			description.shader_override_dir = _config.watch_shader_dir;
+			reloaded.render_pass = _renderpass;
+			reloaded.pipeline = build_graphics_pipeline( description, _renderpass );
+		} else {
+			return;
+		}
+	} catch (const std::exception &e) {
+		std::cout << "Pipeline rebuild for " << spirv_name << " failed: " << e.what() << std::endl;
+		return;
+	}
+	std::cout << "Pipeline rebuilt for " << spirv_name << " in "
+		<< elapsed_ms( build_start, std::chrono::steady_clock::now() ) << " ms" << std::endl;
+	_hot_reload.ready.push_back( reloaded );
+}
 
-			_gpu._logical_device.freeMemory( staging_memory );
-			_gpu._logical_device.destroyBuffer( staging_buffer );
-		};
+void
+window::apply_reloaded_pipelines()
+{
+	// Never waits on a build in progress; the swap just happens a frame
+	// later.
+	std::unique_lock<std::mutex> lock( _hot_reload.mutex, std::try_to_lock );
+	if (!lock || _hot_reload.ready.empty()) {
+		return;
+	}
+	for (auto &reloaded : _hot_reload.ready) {
+		if (reloaded.bind_point == vk::PipelineBindPoint::eGraphics && reloaded.render_pass != _renderpass) {
+			// Built before the render pass was replaced; never used.
+			_gpu._logical_device.destroyPipeline( reloaded.pipeline );
+			continue;
+		}
+		auto &current = reloaded.bind_point == vk::PipelineBindPoint::eCompute ? _culling.pipeline
+		                : reloaded.depth_prepass ? _depth_prepass_pipeline : _graphics_pipeline;
+		auto old_pipeline = current;
+		current = reloaded.pipeline;
+		defer_destroy( [this, old_pipeline]() {
+			_gpu._logical_device.destroyPipeline( old_pipeline );
+		} );
+		if (reloaded.bind_point == vk::PipelineBindPoint::eGraphics && !reloaded.depth_prepass) {
+			// Variants compiled from the old modules stay cached but are no
+			// longer requested.
+			_shader_generation++;
+			create_pipeline_variants();
+		}
+	}
+	_hot_reload.ready.clear();
+}
 
-	auto *data = static_cast<decltype(_indices)::pointer>( _gpu._logical_device.mapMemory( staging_memory, 0, size, vk::MemoryMapFlags() ) );
-	std::copy( begin( _indices ), end( _indices ), data );
-	_gpu._logical_device.unmapMemory( staging_memory );
+void
+window::defer_destroy( std::function<void()> destroy )
+{
+	_deletion_queue.push_back( deferred_destruction{ _frame_number, std::move( destroy ) } );
+}
 
+void
+window::run_deletion_queue( bool all )
+{
+	// Called right after waiting on the fence of frame _frame_number - N, so
+	// every frame up to that one has completed. An entry queued at frame R
+	// can only be referenced by frames up to R - 1.
+	while (!_deletion_queue.empty()) {
+		auto &entry = _deletion_queue.front();
+		if (!all && entry.frame + _frames.size() > _frame_number + 1) {
+			break;
+		}
+		entry.destroy();
+		_deletion_queue.pop_front();
+	}
+}
+
+void
+window::load_mesh()
+{
+	if (_config.mesh_path.empty()) {
+		_mesh.index_count = ( uint32_t ) (sizeof(builtin_indices) / sizeof(builtin_indices[ 0 ]));
+		_mesh.index_type = vk::IndexType::eUint16;
+		_mesh.radius = 0.70710678f;
+	} else {
+		_mesh_load_start = std::chrono::steady_clock::now();
+		_mesh_file.reset( new mesh_file( _config.mesh_path.c_str() ) );
+		auto &header = _mesh_file->header();
+		if (header.index_count > std::numeric_limits<uint32_t>::max()) {
+			throw std::runtime_error( _config.mesh_path + ": too many indices for a single draw" );
+		}
+		// The shader reads the position and color; other attributes stay in
+		// the file's vertices but are neither fetched nor converted.
+		if (!_mesh_file->find_attribute( mesh_semantic::position )
+		    || !_mesh_file->find_attribute( mesh_semantic::color )) {
+			throw std::runtime_error( _config.mesh_path + ": mesh needs a position and a color attribute" );
+		}
+		_mesh.index_count = ( uint32_t ) header.index_count;
+		_mesh.index_type = header.index_size == 2 ? vk::IndexType::eUint16 : vk::IndexType::eUint32;
+		_mesh.radius = _mesh_file->bounding_radius();
+		std::cout << "Mesh " << _config.mesh_path << ": " << header.vertex_count << " vertices, "
+			<< header.index_count / 3 << " triangles, " << header.index_size * 8 << "-bit indices" << std::endl;
+	}
+	auto source = mesh_vertex_source();
+	_mesh.streams = describe_vertex_layout( _config.vertex_layout, source );
+	_camera.position_decode = _mesh.streams.position_decode;
+	uint32_t vertex_size = 0;
+	for (auto stride : _mesh.streams.strides) {
+		vertex_size += stride;
+	}
+	std::cout << "Vertex layout " << vertex_layout_name( _config.vertex_layout ) << ": " << vertex_size
+		<< " bytes per vertex, " << _mesh.streams.strides[ 0 ] << " of them in the position stream" << std::endl;
+	// Instances are laid out for the built-in quad, whose radius is 1/sqrt(2).
+	_mesh.fit_scale = _mesh.radius > 0 ? 0.70710678f / _mesh.radius : 1.0f;
+}
+
+vertex_source
+window::mesh_vertex_source() const
+{
+	vertex_source source;
+	if (!_mesh_file) {
+		source.data = builtin_vertices;
+		source.stride = sizeof(vertex);
+		source.count = sizeof(builtin_vertices) / sizeof(builtin_vertices[ 0 ]);
+		source.position = mesh_attribute{ mesh_semantic::position, mesh_format::float32x2, offsetof(vertex, pos), 0 };
+		source.color = mesh_attribute{ mesh_semantic::color, mesh_format::float32x3, offsetof(vertex, color), 0 };
+		source.bounds_min = glm::vec2( -0.5f );
+		source.bounds_max = glm::vec2( 0.5f );
+		return source;
+	}
+	auto &header = _mesh_file->header();
+	source.data = _mesh_file->vertex_data();
+	source.stride = header.vertex_stride;
+	source.count = header.vertex_count;
+	source.position = *_mesh_file->find_attribute( mesh_semantic::position );
+	source.color = *_mesh_file->find_attribute( mesh_semantic::color );
+	source.bounds_min = glm::vec2( header.bounds_min[ 0 ], header.bounds_min[ 1 ] );
+	source.bounds_max = glm::vec2( header.bounds_max[ 0 ], header.bounds_max[ 1 ] );
+	return source;
+}
+
+void
+window::create_index_buffer()
+{
+	const void *data = builtin_indices;
+	vk::DeviceSize size = sizeof(builtin_indices);
+	if (_mesh_file) {
+		data = _mesh_file->index_data();
+		size = _mesh_file->index_bytes();
+	}
 	std::tie( _index_buffer, _index_buffer_memory ) = create_buffer( size, vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eIndexBuffer, vk::MemoryPropertyFlagBits::eDeviceLocal );
-	copy_buffer( size, staging_buffer, _index_buffer );
+	upload_buffer( data, size, _index_buffer );
 }
 
 uint32_t
@@ -870,12 +2368,13 @@ window::find_memory_type( uint32_t type_filter, vk::MemoryPropertyFlags properti
 			return i;
 		}
 	}
+	throw std::runtime_error( "no memory type with the requested properties" );
 }
 
-std::pair<vk::Buffer, vk::DeviceMemory>
+std::pair<vk::Buffer, device_allocation>
 window::create_buffer( vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlags mem_props )
 {
-	std::pair<vk::Buffer, vk::DeviceMemory> res;
+	std::pair<vk::Buffer, device_allocation> res;
 
 	vk::BufferCreateInfo buffer_create_info;
 	buffer_create_info.setSize( size )
@@ -885,74 +2384,305 @@ window::create_buffer( vk::DeviceSize size, vk::BufferUsageFlags usage, vk::Memo
 	res.first = _gpu._logical_device.createBuffer( buffer_create_info );
 
 	const auto memory_req = _gpu._logical_device.getBufferMemoryRequirements( res.first );
-	vk::MemoryAllocateInfo allocate_info;
-	allocate_info.setMemoryTypeIndex( find_memory_type( memory_req.memoryTypeBits, mem_props ) )
-	             .setAllocationSize( memory_req.size );
-
-	res.second = _gpu._logical_device.allocateMemory( allocate_info );
-	_gpu._logical_device.bindBufferMemory( res.first, res.second, 0 );
+	res.second = _allocator.allocate( memory_req, find_memory_type( memory_req.memoryTypeBits, mem_props ),
+	                                  device_allocator::resource_kind::linear );
+	_gpu._logical_device.bindBufferMemory( res.first, res.second.memory, res.second.offset );
 
 	return res;
 }
 
 void
-window::copy_buffer( vk::DeviceSize size, vk::Buffer src_buffer, vk::Buffer dst_buffer )
+window::open_upload_batch()
 {
-	vk::CommandBufferAllocateInfo command_buffer_allocate_info;
-	command_buffer_allocate_info.setCommandBufferCount( 1 )
-	                            .setCommandPool( _command_pool )
-	                            .setLevel( vk::CommandBufferLevel::ePrimary );
-	auto cmd_copy = _gpu._logical_device.allocateCommandBuffers( command_buffer_allocate_info )[ 0 ];
-	BOOST_SCOPE_EXIT_ALL(&) {
-			_gpu._logical_device.freeCommandBuffers( _command_pool, cmd_copy );
-		};
-	
-	{
-		vk::CommandBufferBeginInfo buffer_begin_info;
-		buffer_begin_info.setFlags( vk::CommandBufferUsageFlagBits::eOneTimeSubmit );
-
-		cmd_copy.begin( buffer_begin_info );
-		vk::BufferCopy copy_info;
-		copy_info.setSize( size )
-		         .setSrcOffset( 0 )
-		         .setDstOffset( 0 );
-		cmd_copy.copyBuffer( src_buffer, dst_buffer, copy_info );
-		cmd_copy.end();
+	if (_uploads.recording_open) {
+		return;
+	}
+	if (_uploads.free_batches.empty()) {
+		vk::CommandBufferAllocateInfo command_buffer_allocate_info;
+		command_buffer_allocate_info.setCommandBufferCount( 1 )
+		                            .setCommandPool( _uploads.command_pool )
+		                            .setLevel( vk::CommandBufferLevel::ePrimary );
+		upload_batch batch;
+		batch.cmd = _gpu._logical_device.allocateCommandBuffers( command_buffer_allocate_info )[ 0 ];
+		batch.fence = _gpu._logical_device.createFence( vk::FenceCreateInfo() );
+		_uploads.free_batches.push_back( batch );
 	}
+	_uploads.recording = _uploads.free_batches.back();
+	_uploads.free_batches.pop_back();
+	_uploads.recording.serial = ++_uploads.last_serial;
+	_uploads.recording_open = true;
+
+	vk::CommandBufferBeginInfo buffer_begin_info;
+	buffer_begin_info.setFlags( vk::CommandBufferUsageFlagBits::eOneTimeSubmit );
+	_uploads.recording.cmd.begin( buffer_begin_info );
+}
+
+void
+window::copy_buffer( vk::DeviceSize size, vk::Buffer src_buffer, vk::DeviceSize src_offset, vk::Buffer dst_buffer,
+                     vk::DeviceSize dst_offset )
+{
+	open_upload_batch();
+
+	vk::BufferCopy copy_info;
+	copy_info.setSize( size )
+	         .setSrcOffset( src_offset )
+	         .setDstOffset( dst_offset );
+	_uploads.recording.cmd.copyBuffer( src_buffer, dst_buffer, copy_info );
+
+	if (_gpu._transfer_family_index != _gpu._graphics_family_index) {
+		vk::BufferMemoryBarrier release;
+		release.setSrcQueueFamilyIndex( _gpu._transfer_family_index )
+		       .setDstQueueFamilyIndex( _gpu._graphics_family_index )
+		       .setBuffer( dst_buffer )
+		       .setOffset( dst_offset )
+		       .setSize( size );
+		_uploads.recording_releases.push_back( release );
+	}
+}
+
+upload_ticket
+window::upload_buffer( const void *data, vk::DeviceSize size, vk::Buffer dst_buffer, vk::DeviceSize dst_offset )
+{
+	// Large uploads are split so they can stream through the ring while
+	// earlier chunks are still being copied.
+	const vk::DeviceSize max_chunk = _uploads.ring.capacity() / 4;
+	auto *bytes = static_cast<const char *>( data );
+	while (size > 0) {
+		auto chunk = std::min( size, max_chunk );
+		staging_ring::region region;
+		while (!_uploads.ring.try_reserve( chunk, 16, region )) {
+			// The space is still held by submitted copies; push out what is
+			// recorded and wait for the oldest batch to free its part.
+			flush_uploads();
+			retire_uploads( true, 1 );
+		}
+		std::memcpy( region.data, bytes, ( size_t ) chunk );
+		copy_buffer( chunk, region.buffer, region.offset, dst_buffer, dst_offset );
+		bytes += chunk;
+		dst_offset += chunk;
+		size -= chunk;
+	}
+	return upload_ticket{ _uploads.recording_open ? _uploads.recording.serial : _uploads.last_serial };
+}
+
+void
+window::begin_image_upload( vk::Image image, uint32_t level_count )
+{
+	open_upload_batch();
+	vk::ImageMemoryBarrier barrier;
+	barrier.setDstAccessMask( vk::AccessFlagBits::eTransferWrite )
+	       .setOldLayout( vk::ImageLayout::eUndefined )
+	       .setNewLayout( vk::ImageLayout::eTransferDstOptimal )
+	       .setSrcQueueFamilyIndex( VK_QUEUE_FAMILY_IGNORED )
+	       .setDstQueueFamilyIndex( VK_QUEUE_FAMILY_IGNORED )
+	       .setImage( image )
+	       .setSubresourceRange( { vk::ImageAspectFlagBits::eColor, 0, level_count, 0, 1 } );
+	_uploads.recording.cmd.pipelineBarrier( vk::PipelineStageFlagBits::eTopOfPipe,
+	                                        vk::PipelineStageFlagBits::eTransfer, vk::DependencyFlags(), nullptr,
+	                                        nullptr, barrier );
+}
+
+bool
+window::upload_image_region( vk::Image image, const void *data, vk::DeviceSize size, vk::DeviceSize alignment,
+                             vk::BufferImageCopy region )
+{
+	// Unlike upload_buffer, never waits for staging space: the texture
+	// streamer retries on the next frame.
+	staging_ring::region staging;
+	if (!_uploads.ring.try_reserve( size, alignment, staging )) {
+		return false;
+	}
+	std::memcpy( staging.data, data, ( size_t ) size );
+	open_upload_batch();
+	region.setBufferOffset( staging.offset );
+	_uploads.recording.cmd.copyBufferToImage( staging.buffer, image, vk::ImageLayout::eTransferDstOptimal, region );
+	return true;
+}
+
+void
+window::end_image_upload( vk::Image image, uint32_t level_count )
+{
+	// Moves the image to its sampled layout, and hands it to the graphics
+	// family if that is a different one. Visibility comes from the
+	// semaphore the next frame waits on, as for buffers.
+	open_upload_batch();
+	bool transfer_ownership = _gpu._transfer_family_index != _gpu._graphics_family_index;
+	vk::ImageMemoryBarrier release;
+	release.setSrcAccessMask( vk::AccessFlagBits::eTransferWrite )
+	       .setOldLayout( vk::ImageLayout::eTransferDstOptimal )
+	       .setNewLayout( vk::ImageLayout::eShaderReadOnlyOptimal )
+	       .setSrcQueueFamilyIndex( transfer_ownership ? _gpu._transfer_family_index : VK_QUEUE_FAMILY_IGNORED )
+	       .setDstQueueFamilyIndex( transfer_ownership ? _gpu._graphics_family_index : VK_QUEUE_FAMILY_IGNORED )
+	       .setImage( image )
+	       .setSubresourceRange( { vk::ImageAspectFlagBits::eColor, 0, level_count, 0, 1 } );
+	_uploads.recording.cmd.pipelineBarrier( vk::PipelineStageFlagBits::eTransfer,
+	                                        vk::PipelineStageFlagBits::eBottomOfPipe, vk::DependencyFlags(), nullptr,
+	                                        nullptr, release );
+	if (transfer_ownership) {
+		auto acquire = release;
+		acquire.setSrcAccessMask( vk::AccessFlags() ).setDstAccessMask( vk::AccessFlagBits::eShaderRead );
+		_uploads.recording_image_acquires.push_back( acquire );
+	}
+}
+
+bool
+window::upload_complete( upload_ticket ticket )
+{
+	retire_uploads( false, _uploads.in_flight.size() );
+	return ticket.serial <= _uploads.completed_serial;
+}
+
+void
+window::wait_upload( upload_ticket ticket )
+{
+	if (_uploads.recording_open && ticket.serial >= _uploads.recording.serial) {
+		flush_uploads();
+	}
+	while (ticket.serial > _uploads.completed_serial && !_uploads.in_flight.empty()) {
+		retire_uploads( true, 1 );
+	}
+}
+
+void
+window::flush_uploads()
+{
+	if (!_uploads.recording_open) {
+		return;
+	}
+	auto &batch = _uploads.recording;
+
+	if (!_uploads.recording_releases.empty()) {
+		// Hand the written ranges over to the graphics family; the matching
+		// acquire is recorded at the start of the next frame.
+		for (auto &release : _uploads.recording_releases) {
+			release.setSrcAccessMask( vk::AccessFlagBits::eTransferWrite );
+			auto acquire = release;
+			acquire.setSrcAccessMask( vk::AccessFlags() )
+			       .setDstAccessMask( vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead
+				       | vk::AccessFlagBits::eUniformRead | vk::AccessFlagBits::eShaderRead );
+			_uploads.pending_acquires.push_back( acquire );
+		}
+		batch.cmd.pipelineBarrier( vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe,
+		                           vk::DependencyFlags(), nullptr, _uploads.recording_releases, nullptr );
+		_uploads.recording_releases.clear();
+	}
+	_uploads.pending_image_acquires.insert( _uploads.pending_image_acquires.end(),
+	                                        _uploads.recording_image_acquires.begin(),
+	                                        _uploads.recording_image_acquires.end() );
+	_uploads.recording_image_acquires.clear();
+	batch.cmd.end();
+
+	// The next frame waits on this semaphore, which also makes the copies
+	// visible to it when both families are the same.
+	vk::Semaphore done;
+	if (_uploads.free_semaphores.empty()) {
+		done = _gpu._logical_device.createSemaphore( vk::SemaphoreCreateInfo() );
+	} else {
+		done = _uploads.free_semaphores.back();
+		_uploads.free_semaphores.pop_back();
+	}
+	_uploads.pending_waits.push_back( done );
+
 	vk::SubmitInfo submit_info;
 	submit_info.setCommandBufferCount( 1 )
-	           .setPCommandBuffers( &cmd_copy );
-	_gpu._graphics_queue.submit( submit_info, VK_NULL_HANDLE );
-	_gpu._graphics_queue.waitIdle();
+	           .setPCommandBuffers( &batch.cmd )
+	           .setSignalSemaphoreCount( 1 )
+	           .setPSignalSemaphores( &done );
+	_gpu._transfer_queue.submit( submit_info, batch.fence );
+
+	batch.ring_end = _uploads.ring.head();
+	_uploads.in_flight.push_back( batch );
+	_uploads.recording_open = false;
 }
 
 void
-window::create_vertex_buffer()
+window::retire_uploads( bool wait, size_t max_count )
 {
-	auto size = sizeof(vertex) * _vertices.size();
-	vk::Buffer staging_buffer;
-	vk::DeviceMemory staging_memory;
-	std::tie( staging_buffer, staging_memory ) = create_buffer( size, vk::BufferUsageFlagBits::eTransferSrc, vk::MemoryPropertyFlagBits::eHostCoherent | vk::MemoryPropertyFlagBits::eHostVisible );
-	BOOST_SCOPE_EXIT_ALL(&) {
-			_gpu._logical_device.freeMemory( staging_memory );
-			_gpu._logical_device.destroyBuffer( staging_buffer );
-		};
+	for (size_t retired = 0; retired < max_count && !_uploads.in_flight.empty(); ++retired) {
+		auto batch = _uploads.in_flight.front();
+		if (wait) {
+			_gpu._logical_device.waitForFences( batch.fence, VK_TRUE, std::numeric_limits<uint64_t>::max() );
+		} else if (_gpu._logical_device.getFenceStatus( batch.fence ) != vk::Result::eSuccess) {
+			break;
+		}
+		_uploads.ring.release( batch.ring_end );
+		_uploads.completed_serial = batch.serial;
+		_gpu._logical_device.resetFences( batch.fence );
+		batch.cmd.reset( vk::CommandBufferResetFlags() );
+		_uploads.free_batches.push_back( batch );
+		_uploads.in_flight.pop_front();
+	}
+}
 
-	auto *data = static_cast<vertex *>( _gpu._logical_device.mapMemory( staging_memory, 0, size, vk::MemoryMapFlags() ) );
-	std::copy( begin( _vertices ), end( _vertices ), data );
-	_gpu._logical_device.unmapMemory( staging_memory );
+void
+window::create_upload_resources()
+{
+	vk::CommandPoolCreateInfo command_pool_create_info;
+	command_pool_create_info.setQueueFamilyIndex( _gpu._transfer_family_index )
+	                        .setFlags( vk::CommandPoolCreateFlagBits::eResetCommandBuffer
+		                        | vk::CommandPoolCreateFlagBits::eTransient );
+	_uploads.command_pool = _gpu._logical_device.createCommandPool( command_pool_create_info );
+
+	vk::DeviceSize capacity = _config.staging_ring_size;
+	std::tie( _uploads.buffer, _uploads.memory ) = create_buffer( capacity, vk::BufferUsageFlagBits::eTransferSrc, vk::MemoryPropertyFlagBits::eHostCoherent | vk::MemoryPropertyFlagBits::eHostVisible );
+	_uploads.ring.create( _uploads.buffer, _uploads.memory.mapped, capacity );
+}
 
-	std::tie( _vertex_buffer, _vertex_buffer_memory ) = create_buffer( size, vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eVertexBuffer, vk::MemoryPropertyFlagBits::eDeviceLocal );
+void
+window::destroy_upload_resources()
+{
+	flush_uploads();
+	retire_uploads( true, _uploads.in_flight.size() );
+	for (auto &frame : _frames) {
+		_uploads.free_semaphores.insert( _uploads.free_semaphores.end(), frame.upload_semaphores.begin(),
+		                                 frame.upload_semaphores.end() );
+		frame.upload_semaphores.clear();
+	}
+	for (auto &batch : _uploads.free_batches) {
+		_gpu._logical_device.destroyFence( batch.fence );
+	}
+	_uploads.free_batches.clear();
+	// Semaphores still pending were never waited on; the device is idle.
+	_uploads.free_semaphores.insert( _uploads.free_semaphores.end(), _uploads.pending_waits.begin(),
+	                                 _uploads.pending_waits.end() );
+	for (auto semaphore : _uploads.free_semaphores) {
+		_gpu._logical_device.destroySemaphore( semaphore );
+	}
+	_uploads.free_semaphores.clear();
+	_uploads.pending_waits.clear();
+	_gpu._logical_device.destroyCommandPool( _uploads.command_pool );
+	_gpu._logical_device.destroyBuffer( _uploads.buffer );
+	_allocator.free( _uploads.memory );
+}
 
-	copy_buffer( size, staging_buffer, _vertex_buffer );
+void
+window::create_vertex_buffer()
+{
+	auto source = mesh_vertex_source();
+	const void *data = source.data;
+	vk::DeviceSize size = source.count * source.stride;
+	_mesh.stream_offsets.assign( 1, 0 );
+	packed_vertices packed;
+	if (_config.vertex_layout != vertex_layout_kind::interleaved) {
+		const auto pack_start = std::chrono::steady_clock::now();
+		packed = pack_vertices( _config.vertex_layout, source );
+		data = packed.data.data();
+		size = packed.data.size();
+		_mesh.stream_offsets.assign( packed.offsets.begin(), packed.offsets.end() );
+		std::cout << "Vertices converted to the " << vertex_layout_name( _config.vertex_layout ) << " layout in "
+			<< elapsed_ms( pack_start, std::chrono::steady_clock::now() ) << " ms (" << size << " bytes, "
+			<< source.count * source.stride << " as stored)" << std::endl;
+	}
+	std::tie( _vertex_buffer, _vertex_buffer_memory ) = create_buffer( size, vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eVertexBuffer, vk::MemoryPropertyFlagBits::eDeviceLocal );
+	upload_buffer( data, size, _vertex_buffer );
 }
 
 void
 window::destroy_buffers()
 {
-	_gpu._logical_device.freeMemory( _vertex_buffer_memory );
+	_allocator.free( _vertex_buffer_memory );
 	_gpu._logical_device.destroyBuffer( _vertex_buffer );
 
-	_gpu._logical_device.freeMemory( _index_buffer_memory );
+	_allocator.free( _index_buffer_memory );
 	_gpu._logical_device.destroyBuffer( _index_buffer );
 }
@@ -1,7 +1,24 @@
 #pragma once
 
 #include "vulkan.h"
+#include "device_allocator.h"
+#include "frame_arena.h"
+#include "gpu_profiler.h"
+#include "job_system.h"
+#include "mesh.h"
+#include "pso_cache.h"
+#include "render_graph.h"
+#include "shader_watcher.h"
+#include "staging_ring.h"
+#include "texture_streamer.h"
+#include "vertex_layout.h"
 #include <glm/glm.hpp>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
 struct vertex {
@@ -9,14 +26,209 @@ struct vertex {
 	glm::vec3 color;
 };
 
+// Per-instance vertex attributes, read through the binding after the mesh's
+// vertex streams.
+struct instance_data {
+	// xy: offset in clip space, z: scale, w: rotation in radians.
+	glm::vec4 transform;
+	glm::vec4 color;
+};
+
+// Per-frame shader data, bound through set 0 with a dynamic offset.
+struct frame_uniforms {
+	glm::mat4 view_proj = glm::mat4( 1.0f );
+	// vertex_streams::position_decode of the mesh.
+	glm::vec4 position_decode = glm::vec4( 1.0f, 1.0f, 0.0f, 0.0f );
+};
+
+struct draw_item {
+	uint32_t index_count = 0;
+	uint32_t first_index = 0;
+	int32_t vertex_offset = 0;
+	uint32_t instance_count = 1;
+	uint32_t first_instance = 0;
+	// Pushed as a constant before the draw; its origin is the point the
+	// draw is sorted by.
+	glm::mat4 transform = glm::mat4( 1.0f );
+	// Index into the pipeline variants; 0 is the default pipeline.
+	uint32_t pipeline_variant = 0;
+	// Sampled by the fragment shader; no_texture samples plain white.
+	texture_streamer::texture texture = texture_streamer::no_texture;
+};
+
+struct window_config {
+	// Number of frames the CPU may record ahead of the GPU. Each one owns its
+	// own semaphores, fence and command buffer.
+	uint32_t frames_in_flight = 2;
+
+	// Render into a ring of device-local images instead of a swapchain. No
+	// GLFW window or surface is created and no present queue is required.
+	bool headless = false;
+
+	// Stop run() after this many frames; 0 runs until the window is closed.
+	uint64_t max_frames = 0;
+
+	// Load SPIR-V from this directory instead of the modules embedded at
+	// build time; meant for iterating on shaders without relinking.
+	std::string shader_dir;
+
+	// GLSL source directory to watch; changed shaders are recompiled with
+	// shader_compiler and their pipelines replaced between frames. Empty
+	// disables hot reload.
+	std::string watch_shader_dir;
+	std::string shader_compiler = "glslangValidator";
+
+	// Mesh file (see mesh.h) to draw; empty draws a built-in quad.
+	std::string mesh_path;
+
+	// Storage of the mesh's vertices; other layouts than interleaved are
+	// converted, and quantized, while loading.
+	vertex_layout_kind vertex_layout = vertex_layout_kind::interleaved;
+
+	// Lay down the depth of the opaque draws with a position-only pipeline
+	// before shading them, so that hidden fragments are never shaded. With
+	// a split vertex layout the pre-pass fetches only the position stream.
+	// Ignored with gpu_culling.
+	bool depth_prepass = false;
+
+	// Pipeline cache file loaded at startup and rewritten at shutdown; empty
+	// disables persistence.
+	std::string pipeline_cache_path = "pipeline_cache.bin";
+
+	// Threads of the job system, the calling thread included, which records
+	// the draw list into one secondary command buffer per thread and fills
+	// the instance data; 0 does both inline and records into the primary
+	// buffer.
+	uint32_t record_threads = 0;
+
+	// Number of draw calls per frame, each drawing instances_per_draw
+	// copies of the mesh.
+	uint32_t draw_count = 1;
+	uint32_t instances_per_draw = 1;
+
+	// Cull instances against the view frustum in a compute pass and draw the
+	// survivors with indirect draws. Needs the drawIndirectFirstInstance
+	// feature.
+	bool gpu_culling = false;
+
+	// Number of pipeline variants, differing in cull, blend and polygon
+	// mode, that the draw list cycles through; at most 8. Variants other
+	// than the first are compiled by the PSO cache on pso_threads threads
+	// when first requested. Until then their draws use the default pipeline,
+	// or are skipped with skip_pending_pipelines. Ignored with gpu_culling.
+	uint32_t pipeline_variants = 1;
+	uint32_t pso_threads = 2;
+	bool skip_pending_pipelines = false;
+
+	// Sort opaque draws front to back, and blended ones back to front after
+	// them, before recording. Ignored with gpu_culling.
+	bool sort_draws = true;
+
+	// Stack the draws into this many full-screen layers, declared back to
+	// front, to measure overdraw; draw_count must be a multiple of it.
+	// Ignored with gpu_culling.
+	uint32_t depth_layers = 1;
+
+	// KTX2 or PNG files the draws cycle through, decoded on texture_threads
+	// threads and streamed in under texture_budget bytes of device memory,
+	// at most texture_upload_per_frame bytes per frame. The upload share
+	// may be at most half of staging_ring_size. With gpu_culling, every
+	// draw uses the first texture.
+	std::vector<std::string> texture_paths;
+	uint32_t texture_threads = 2;
+	uint64_t texture_budget = 256ull << 20;
+	uint64_t texture_upload_per_frame = 4ull << 20;
+
+	// Size of each frame's persistently mapped uniform buffer.
+	uint64_t uniform_ring_size = 64ull << 10;
+
+	// Size of the persistently mapped buffer all uploads are staged through.
+	uint64_t staging_ring_size = 16ull << 20;
+
+	// Stop run() after this many seconds; 0 disables the limit.
+	double max_seconds = 0;
+
+	// Use present_mode instead of walking the preference list in
+	// create_swapchain; construction fails if it is unavailable.
+	bool force_present_mode = false;
+	vk::PresentModeKHR present_mode = vk::PresentModeKHR::eFifo;
+
+	// Keep a frame_timing entry for every frame drawn by run().
+	bool record_timings = false;
+
+	// Returns the number of heap allocations made so far, by any thread;
+	// with record_timings, each frame_timing gets the count of its frame.
+	uint64_t (*count_allocations)() = nullptr;
+
+	// Trade throughput for latency: run() samples input only once at most
+	// max_queued_frames frames (1 to frames_in_flight) are still on the GPU,
+	// and the swapchain gets the fewest images the surface allows. With
+	// latency_sleep, run() also sleeps before sampling input for as long
+	// as recent frames spent blocked after it, less latency_sleep_margin_ms.
+	bool low_latency = false;
+	uint32_t max_queued_frames = 1;
+	bool latency_sleep = false;
+	double latency_sleep_margin_ms = 1.0;
+};
+
+// CPU-side durations of one run() iteration, in milliseconds.
+struct frame_timing {
+	double cpu_frame_ms = 0;
+	double fence_wait_ms = 0;
+	double acquire_ms = 0;
+	double record_ms = 0;
+	double submit_ms = 0;
+	double present_ms = 0;
+	// Summed GPU duration of the frame's profiled passes; negative when no
+	// timestamps were available.
+	double gpu_ms = -1;
+	// Draws that survived GPU culling; negative when culling is off.
+	int64_t visible_draws = -1;
+	// Fragment shader invocations; negative when pipeline statistics
+	// queries are not supported.
+	int64_t fragment_invocations = -1;
+	// Low-latency pacing before input was sampled: waiting for the queued
+	// frames to drain, then the deadline sleep.
+	double queue_wait_ms = 0;
+	double sleep_ms = 0;
+	// From sampling input to the return of the present call, and to the
+	// frame's fence being seen signaled; the latter is an upper bound, and
+	// negative when the fence was never waited on.
+	double input_to_present_ms = 0;
+	double input_to_gpu_done_ms = -1;
+	// Heap allocations during the frame; negative without
+	// count_allocations.
+	int64_t allocations = -1;
+};
+
+// Identifies the upload batch a transfer was recorded into.
+struct upload_ticket {
+	uint64_t serial = 0;
+};
+
 class window {
 public:
-	window( uint32_t width, uint32_t height, std::string name );
+	window( uint32_t width, uint32_t height, std::string name, window_config config = window_config() );
 
 	~window();
 
 	void run();
 
+	const std::vector<frame_timing> &frame_timings() const { return _frame_timings; }
+
+	vk::PresentModeKHR present_mode() const { return _swapchain.chosen_present_mode; }
+
+	const gpu_profiler &profiler() const { return _profiler; }
+
+	device_allocator::statistics memory_statistics() const { return _allocator.stats(); }
+
+	pso_cache::statistics pso_statistics() const { return _pso_cache.stats(); }
+
+	const texture_streamer::statistics &texture_statistics() const { return _textures.stats(); }
+
+	// Takes effect from the next recorded frame.
+	void set_camera( const glm::mat4 &view_proj ) { _camera.view_proj = view_proj; }
+
 private:
 	void create_window();
 
@@ -32,6 +244,9 @@ private:
 
 	void choose_physical_device();
 
+	// First of the preferred depth formats usable as an attachment.
+	void choose_depth_format();
+
 	void create_logical_device();
 
 	void destroy_logical_device();
@@ -52,21 +267,73 @@ private:
 
 	void destroy_swapchain();
 
+	void create_offscreen_targets();
+
+	void destroy_offscreen_targets();
+
 	void create_image_views();
 
 	void destroy_image_views();
 
-	void create_renderpass();
+	// Declares and compiles the frame's passes; _renderpass is the main
+	// pass's render pass.
+	void create_frame_graph();
+
+	void destroy_frame_graph();
 
-	void destroy_renderpass();
+	// Takes the module compiled into the binary, or loads `name` from
+	// _config.shader_dir when that is set. A module present in
+	// `override_dir` takes precedence over both.
+	vk::ShaderModule create_shader_module( const char *name, const std::string &override_dir );
 
 	void create_graphics_pipeline();
 
+	// State of the default pipeline for the current mesh and render pass.
+	pipeline_description graphics_pipeline_description() const;
+
+	// Position-only pipeline writing the depth of the opaque draws, derived
+	// from _graphics_pipeline_description.
+	pipeline_description depth_prepass_description() const;
+
+	// `render_pass` must be compatible with description.color_format.
+	vk::Pipeline build_graphics_pipeline( const pipeline_description &description, vk::RenderPass render_pass );
+
+	// Derives the draw list's variant descriptions from the default
+	// pipeline's; called whenever that one is replaced.
+	void create_pipeline_variants();
+
+	// Asks the PSO cache for every variant used by the frame about to be
+	// recorded.
+	void resolve_pipeline_variants();
+
+	vk::Pipeline build_cull_pipeline( const std::string &override_dir );
+
+	void start_shader_watcher();
+
+	// Called by the shader watcher thread after a module was recompiled.
+	void rebuild_pipeline( const std::string &spirv_name );
+
+	// Swaps in pipelines rebuilt since the last frame; the replaced ones are
+	// destroyed once the frames using them have finished.
+	void apply_reloaded_pipelines();
+
+	void create_pipeline_layout();
+
+	void destroy_pipeline_layout();
+
+	void create_uniform_buffers();
+
+	void destroy_uniform_buffers();
+
+	// Copies `data` into the slot's uniform ring and returns its dynamic
+	// offset. The ring is rewound once the slot's fence has signaled.
+	uint32_t push_uniforms( uint32_t slot, const void *data, vk::DeviceSize size );
+
 	void destroy_graphics_pipeline();
 
-	void create_framebuffers();
+	void create_pipeline_cache();
 
-	void destroy_framebuffers();
+	void destroy_pipeline_cache();
 
 	void create_commandpool();
 
@@ -74,25 +341,113 @@ private:
 
 	void create_command_buffers();
 
+	void destroy_command_buffers();
+
+	void record_command_buffer( vk::CommandBuffer cmd, uint32_t slot, uint32_t image_index );
+
+	void record_main_pass( vk::CommandBuffer cmd, const render_graph::pass_context &context );
+
+	void record_draws( vk::CommandBuffer cmd, uint32_t slot, uint32_t first_draw, uint32_t end_draw );
+
+	void create_draw_list();
+
+	// Rebuilds _draw_order for the current camera.
+	void sort_draws();
+
+	void create_textures();
+
+	// Tells the texture streamer how large the draws' textures appear.
+	void request_textures();
+
+	void create_instance_buffer();
+
+	void destroy_instance_buffer();
+
+	// Rewrites the instance data read by the frame in `slot`.
+	void update_instances( uint32_t slot );
+
+	void create_cull_resources();
+
+	void destroy_cull_resources();
+
+	// Clears the slot's draw count and dispatches the culling pass; record
+	// outside of any render pass.
+	void record_cull( vk::CommandBuffer cmd, uint32_t slot );
+
+	void collect_cull_results( uint32_t slot, uint64_t frame_number );
+
+	void collect_gpu_timings( uint32_t slot, uint64_t frame_number );
+
 	void draw_frame();
 
-	void create_semaphores();
+	// Low-latency mode: waits until at most max_queued_frames frames are
+	// queued, then sleeps for the planned time.
+	void pace_frame();
+
+	// Records when the frame's fence was seen signaled, if not yet known.
+	void note_frame_done( uint64_t frame_number, std::chrono::steady_clock::time_point now );
+
+	void create_frame_resources();
 
-	void destroy_semaphores();
+	void destroy_frame_resources();
 
 	void recreate_swap_chain();
 
+	// Runs `destroy` once every frame submitted so far has completed.
+	void defer_destroy( std::function<void()> destroy );
+
+	void run_deletion_queue( bool all );
+
 	void create_index_buffer();
 
+	// Maps the configured mesh file, or selects the built-in quad, and sets
+	// up _mesh; the pipeline's vertex layout is taken from it.
+	void load_mesh();
+
+	// The built-in quad's or the mapped mesh file's vertices.
+	vertex_source mesh_vertex_source() const;
+
 	uint32_t find_memory_type( uint32_t type_filter, vk::MemoryPropertyFlags properties );
 
-	std::pair<vk::Buffer, vk::DeviceMemory> create_buffer( vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlags mem_props );
+	std::pair<vk::Buffer, device_allocation> create_buffer( vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlags mem_props );
+
+	void copy_buffer( vk::DeviceSize size, vk::Buffer src_buffer, vk::DeviceSize src_offset, vk::Buffer dst_buffer,
+	                  vk::DeviceSize dst_offset );
+
+	// Stages `data` and records its copy on the transfer queue. The copy is
+	// visible to frames drawn after this call; `dst_buffer` must not be in
+	// use by the GPU.
+	upload_ticket upload_buffer( const void *data, vk::DeviceSize size, vk::Buffer dst_buffer,
+	                             vk::DeviceSize dst_offset = 0 );
+
+	// Texture uploads, recorded like upload_buffer's copies; see
+	// texture_streamer::upload_hooks.
+	void begin_image_upload( vk::Image image, uint32_t level_count );
+
+	bool upload_image_region( vk::Image image, const void *data, vk::DeviceSize size, vk::DeviceSize alignment,
+	                          vk::BufferImageCopy region );
+
+	void end_image_upload( vk::Image image, uint32_t level_count );
+
+	bool upload_complete( upload_ticket ticket );
+
+	void wait_upload( upload_ticket ticket );
+
+	// Starts recording an upload batch unless one is open.
+	void open_upload_batch();
+
+	void flush_uploads();
+
+	void retire_uploads( bool wait, size_t max_count );
 
-	void copy_buffer( vk::DeviceSize size, vk::Buffer src_buffer, vk::Buffer dst_buffer );
+	void create_upload_resources();
+
+	void destroy_upload_resources();
 
 	uint32_t _width;
 	uint32_t _height;
 	std::string _name;
+	window_config _config;
 
 	GLFWwindow *_glfw_window = nullptr;
 
@@ -113,9 +468,13 @@ private:
 		std::vector<vk::QueueFamilyProperties> _queue_family_properties;
 		uint32_t _graphics_family_index;
 		uint32_t _present_family_index;
+		uint32_t _transfer_family_index;
 		vk::Device _logical_device;
 		vk::Queue _graphics_queue;
 		vk::Queue _present_queue;
+		vk::Queue _transfer_queue;
+		// Enabled extension providing vkCmdDrawIndexedIndirectCount*, if any.
+		std::string _draw_indirect_count_extension;
 	} _gpu;
 
 	struct {
@@ -129,31 +488,214 @@ private:
 		vk::Extent2D chosen_extent;
 		std::vector<vk::Image> swapchain_images;
 		std::vector<vk::ImageView> image_views;
-		std::vector<vk::Framebuffer> framebuffers;
+		// Signaled by the frame rendering to the image and waited on by its
+		// present. Keyed by image rather than frame slot: the slot's fence
+		// does not cover the presentation engine's wait, but an image is
+		// only acquired again once that present is done with it.
+		std::vector<vk::Semaphore> render_finished_sems;
 	} _swapchain;
 
+	// Backing memory of the headless render targets, which stand in for
+	// _swapchain.swapchain_images.
+	std::vector<device_allocation> _offscreen_memory;
+
 	vk::SurfaceKHR _surface;
+
+	render_graph _frame_graph;
+
+	struct {
+		render_graph::resource backbuffer;
+		render_graph::resource depth;
+		render_graph::resource draw_commands;
+		render_graph::resource draw_counts;
+		uint32_t main_pass;
+	} _frame_graph_ids;
+
+	// Owned by _frame_graph.
 	vk::RenderPass _renderpass;
+	vk::Format _depth_format = vk::Format::eUndefined;
 	vk::Pipeline _graphics_pipeline;
+	// Null without depth_prepass.
+	vk::Pipeline _depth_prepass_pipeline;
+	// Written under _hot_reload.mutex.
+	pipeline_description _graphics_pipeline_description;
+	pso_cache _pso_cache;
+	std::vector<pipeline_description> _pipeline_variants;
+	// Pipelines of _pipeline_variants for the frame being recorded; null
+	// while the variant is still compiling.
+	std::vector<vk::Pipeline> _variant_pipelines;
+	// Bumped by every graphics pipeline reload.
+	uint32_t _shader_generation = 0;
+	vk::DescriptorSetLayout _uniform_set_layout;
+	vk::PipelineLayout _pipeline_layout;
+	vk::DescriptorPool _uniform_descriptor_pool;
+	frame_uniforms _camera;
+	vk::PipelineCache _pipeline_cache;
+	bool _pipeline_cache_warm = false;
 	vk::CommandPool _command_pool;
-	std::vector<vk::CommandBuffer> _command_buffers;
-	vk::Semaphore _image_available_sem;
-	vk::Semaphore _render_finished_sem;
-
-	const std::vector<vertex> _vertices = {
-		{ { -0.5f, -0.5f },{ 1.0f, 0.0f, 0.0f } },
-		{ { 0.5f, -0.5f },{ 0.0f, 1.0f, 0.0f } },
-		{ { 0.5f, 0.5f },{ 0.0f, 0.0f, 1.0f } },
-		{ { -0.5f, 0.5f },{ 1.0f, 1.0f, 1.0f } }
+
+	struct recorder {
+		vk::CommandPool pool;
+		vk::CommandBuffer secondary;
+	};
+
+	struct frame {
+		vk::Semaphore image_available_sem;
+		vk::Fence in_flight_fence;
+		vk::CommandBuffer command_buffer;
+		// Upload semaphores this frame's submission waits on; recycled once
+		// the frame's fence has signaled.
+		std::vector<vk::Semaphore> upload_semaphores;
+		std::vector<vk::Semaphore> wait_semaphores;
+		std::vector<vk::PipelineStageFlags> wait_stages;
+		// One per recording job, each with its own pool.
+		std::vector<recorder> recorders;
+		std::vector<vk::CommandBuffer> secondaries;
+		// Start of this frame's region in _instances.buffer.
+		vk::DeviceSize instance_offset = 0;
+		vk::DescriptorSet cull_set;
+		vk::Buffer uniform_buffer;
+		device_allocation uniform_memory;
+		vk::DescriptorSet uniform_set;
+		vk::DeviceSize uniform_head = 0;
+		uint32_t camera_offset = 0;
+		// Input sample time of the frame last drawn in this slot.
+		std::chrono::steady_clock::time_point input_time;
+		// Scratch memory of the frame's recording, reset once the slot's
+		// fence has signaled.
+		frame_arena arena;
+	};
+
+	std::vector<frame> _frames;
+	std::unique_ptr<job_system> _jobs;
+	texture_streamer _textures;
+	std::vector<texture_streamer::texture> _texture_ids;
+	std::vector<draw_item> _draw_list;
+	// Indices into _draw_list in recording order, and the sort keys they
+	// are built from: blended (1 bit), depth (24), pipeline variant (7),
+	// draw index (32).
+	std::vector<uint32_t> _draw_order;
+	std::vector<uint64_t> _sort_keys;
+	std::vector<uint64_t> _sort_scratch;
+	uint64_t _frame_number = 0;
+	std::vector<frame_timing> _frame_timings;
+
+	struct {
+		// When run() sampled input for the next frame, and the pacing
+		// before it.
+		std::chrono::steady_clock::time_point input_time;
+		double queue_wait_ms = 0;
+		double sleep_ms = 0;
+		// Sleep for the next frame; grows while frames still block after
+		// sampling input, and shrinks once they do not.
+		double planned_sleep_ms = 0;
+		// Time the last frame spent on its fence and acquire.
+		double blocked_ms = 0;
+	} _latency;
+
+	struct deferred_destruction {
+		// Value of _frame_number when the work was queued.
+		uint64_t frame;
+		std::function<void()> destroy;
 	};
 
-	const std::vector<uint16_t> _indices = {
-		0, 1, 2, 2, 3, 0
+	std::deque<deferred_destruction> _deletion_queue;
+	gpu_profiler _profiler;
+	device_allocator _allocator;
+
+	struct reloaded_pipeline {
+		vk::Pipeline pipeline;
+		vk::PipelineBindPoint bind_point;
+		// Render pass a graphics pipeline was built against.
+		vk::RenderPass render_pass;
+		// Replaces _depth_prepass_pipeline rather than _graphics_pipeline.
+		bool depth_prepass = false;
 	};
 
+	// Hot reload; `mutex` guards `ready` and is held while a pipeline is
+	// being built.
+	struct {
+		std::unique_ptr<shader_watcher> watcher;
+		std::mutex mutex;
+		std::vector<reloaded_pipeline> ready;
+	} _hot_reload;
+
+	struct {
+		// Bound from binding 0 up; the instance data takes the next binding.
+		vertex_streams streams;
+		// Where each stream starts in _vertex_buffer.
+		std::vector<vk::DeviceSize> stream_offsets;
+		uint32_t index_count = 0;
+		vk::IndexType index_type = vk::IndexType::eUint16;
+		// Bounding radius around the mesh origin.
+		float radius = 0;
+		// Scale that brings the mesh to the size of the built-in quad.
+		float fit_scale = 1;
+	} _mesh;
+
+	// Mapped only until its blobs have been staged.
+	std::unique_ptr<mesh_file> _mesh_file;
+	std::chrono::steady_clock::time_point _mesh_load_start;
+
 	vk::Buffer _vertex_buffer;
-	vk::DeviceMemory _vertex_buffer_memory;
+	device_allocation _vertex_buffer_memory;
 
 	vk::Buffer _index_buffer;
-	vk::DeviceMemory _index_buffer_memory;
+	device_allocation _index_buffer_memory;
+
+	// Host-visible instance data, one region per frame slot.
+	struct {
+		vk::Buffer buffer;
+		device_allocation memory;
+		vk::DeviceSize region_size = 0;
+		uint32_t count = 0;
+	} _instances;
+
+	// Compute culling pass; commands and counts hold one region per frame
+	// slot.
+	struct {
+		vk::DescriptorSetLayout set_layout;
+		vk::DescriptorPool descriptor_pool;
+		vk::PipelineLayout pipeline_layout;
+		vk::Pipeline pipeline;
+		vk::Buffer commands;
+		device_allocation commands_memory;
+		vk::DeviceSize commands_stride = 0;
+		vk::Buffer counts;
+		device_allocation counts_memory;
+		vk::DeviceSize counts_stride = 0;
+		// Loaded vkCmdDrawIndexedIndirectCount*, or null.
+		PFN_vkVoidFunction draw_indexed_indirect_count = nullptr;
+	} _culling;
+
+	struct upload_batch {
+		vk::CommandBuffer cmd;
+		vk::Fence fence;
+		// Staging ring position after the batch's last reservation.
+		vk::DeviceSize ring_end = 0;
+		uint64_t serial = 0;
+	};
+
+	struct {
+		vk::CommandPool command_pool;
+		vk::Buffer buffer;
+		device_allocation memory;
+		staging_ring ring;
+		upload_batch recording;
+		bool recording_open = false;
+		std::deque<upload_batch> in_flight;
+		std::vector<upload_batch> free_batches;
+		uint64_t last_serial = 0;
+		uint64_t completed_serial = 0;
+		// Queue family release barriers of the batch being recorded, and the
+		// matching acquires the next frame has to execute.
+		std::vector<vk::BufferMemoryBarrier> recording_releases;
+		std::vector<vk::BufferMemoryBarrier> pending_acquires;
+		// Images are released as soon as they are complete.
+		std::vector<vk::ImageMemoryBarrier> recording_image_acquires;
+		std::vector<vk::ImageMemoryBarrier> pending_image_acquires;
+		// Signaled by submitted batches, waited on by the next frame.
+		std::vector<vk::Semaphore> pending_waits;
+		std::vector<vk::Semaphore> free_semaphores;
+	} _uploads;
 };